@@ -0,0 +1,25 @@
+#ifndef _CHECKS_H
+#define _CHECKS_H
+
+#include <stdio.h>
+
+/*
+ * The pass/fail lines of the self-checking host tools (qosreq, thermfit,
+ * loadagg). Every check() prints a line; checkSummary() prints the count and
+ * gives the exit status, 1 if any of them failed. One tool per binary, so the
+ * counters can live here.
+ */
+static int failures, checks;
+
+static inline void check(bool ok, const char* what) {
+	checks++;
+	if (!ok) failures++;
+	printf("  %-4s %s\n", ok ? "ok" : "FAIL", what);
+}
+
+static inline int checkSummary() {
+	printf("\n%s: %d of %d checks failed\n", failures ? "FAIL" : "ok", failures, checks);
+	return failures ? 1 : 0;
+}
+
+#endif // _CHECKS_H
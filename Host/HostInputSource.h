@@ -0,0 +1,29 @@
+#ifndef _HOSTINPUTSOURCE_H
+#define _HOSTINPUTSOURCE_H
+
+#include "InputSource.h"
+
+/*
+ * Stand-in for HIDIdleInputSource: there is no HID system to watch, the
+ * caller decides when input happens and calls fire(). The handler runs
+ * right there, on the caller's thread, like it runs on the workloop in the
+ * kext. Events while stopped are dropped.
+ */
+class HostInputSource : public InputSource {
+public:
+	HostInputSource() : running(false), events(0) {}
+
+	virtual bool	start() { running = true; return true; }
+	virtual void	stop() { running = false; }
+
+	void	fire() {
+		if (!running) return;
+		events++;
+		notify();
+	}
+
+	bool		running;
+	uint64_t	events;		// fired while running
+};
+
+#endif // _HOSTINPUTSOURCE_H
@@ -0,0 +1,148 @@
+#include <time.h>
+#include <pthread.h>
+
+#include "HostKernel.h"
+
+IESS_TLS bool	HostVirtualClock = true;
+IESS_TLS int	HostCPUCount = 2;
+IESS_TLS HostRendezvousImpl*	HostRendezvous;
+
+static IESS_TLS uint64_t	virtualNow;
+static __thread int		currentCPU;
+static IESS_TLS bool		interruptsOff[256];
+static IESS_TLS uint64_t	interruptsOffSince[256];
+static IESS_TLS uint64_t	interruptsOffNS[256];
+
+uint64_t hostUptimeNS() {
+	if (HostVirtualClock)
+		return __atomic_load_n(&virtualNow, __ATOMIC_RELAXED);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void hostAdvanceNS(uint64_t ns) {
+	if (HostVirtualClock) {
+		__atomic_fetch_add(&virtualNow, ns, __ATOMIC_RELAXED);
+		return;
+	}
+	uint64_t until = hostUptimeNS() + ns;
+	while (hostUptimeNS() < until)
+		; // spin, like IODelay does
+}
+
+int cpu_number() {
+	return currentCPU;
+}
+
+void hostSetCPU(int cpu) {
+	currentCPU = cpu;
+}
+
+void clock_get_uptime(uint64_t* result) {
+	*result = hostUptimeNS();
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result) {
+	*result = abstime;
+}
+
+IESS_TLS host_load_info HostLoadInfo;
+
+void hostSchedulerTick(uint32_t runnable) {
+	static const int fract[3] = { 800, 966, 983 }; // osfmk/kern/mach_factor.c
+	for (int i = 0; i < 3; i++)
+		HostLoadInfo.avenrun[i] = (HostLoadInfo.avenrun[i] * fract[i] + (int) runnable * (LOAD_SCALE - fract[i])) / LOAD_SCALE;
+}
+
+void IOLog(const char* format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+void IODelay(unsigned microseconds) {
+	hostAdvanceNS(microseconds * 1000ULL);
+}
+
+void IOSleep(unsigned milliseconds) {
+	hostAdvanceNS(milliseconds * 1000000ULL);
+}
+
+struct HostSimpleLock {
+	pthread_spinlock_t spin;
+};
+
+IOSimpleLock* IOSimpleLockAlloc() {
+	IOSimpleLock* lock = new IOSimpleLock;
+	pthread_spin_init(&lock->spin, PTHREAD_PROCESS_PRIVATE);
+	return lock;
+}
+
+void IOSimpleLockFree(IOSimpleLock* lock) {
+	pthread_spin_destroy(&lock->spin);
+	delete lock;
+}
+
+void IOSimpleLockLock(IOSimpleLock* lock) {
+	pthread_spin_lock(&lock->spin);
+}
+
+void IOSimpleLockUnlock(IOSimpleLock* lock) {
+	pthread_spin_unlock(&lock->spin);
+}
+
+bool ml_get_interrupts_enabled() {
+	return !interruptsOff[cpu_number()];
+}
+
+bool ml_set_interrupts_enabled(bool enable) {
+	int cpu = cpu_number();
+	bool old = ml_get_interrupts_enabled();
+	if (old && !enable)
+		interruptsOffSince[cpu] = hostUptimeNS();
+	else if (!old && enable)
+		interruptsOffNS[cpu] = hostUptimeNS() - interruptsOffSince[cpu];
+	interruptsOff[cpu] = !enable;
+	return old;
+}
+
+uint64_t hostLastInterruptsOffNS(int cpu) {
+	return interruptsOffNS[cpu];
+}
+
+/*
+ * Runs each phase on every simulated CPU in turn, on the calling thread.
+ * Same ordering guarantees as the real thing: all setups, then all actions,
+ * then all teardowns.
+ */
+extern "C" void mp_rendezvous(	void (*setup_func) (void *),
+			void (*action_func) (void *),
+			void (*teardown_func) (void *),
+			void *arg) {
+	if (HostRendezvous) {
+		HostRendezvous->rendezvous(setup_func, action_func, teardown_func, arg);
+		return;
+	}
+	int self = cpu_number();
+	for (int cpu = 0; cpu < HostCPUCount; cpu++) {
+		hostSetCPU(cpu);
+		if (setup_func) setup_func(arg);
+	}
+	for (int cpu = 0; cpu < HostCPUCount; cpu++) {
+		hostSetCPU(cpu);
+		if (action_func) action_func(arg);
+	}
+	for (int cpu = 0; cpu < HostCPUCount; cpu++) {
+		hostSetCPU(cpu);
+		if (teardown_func) teardown_func(arg);
+	}
+	hostSetCPU(self);
+}
+
+void rtc_clock_stepping(__unused uint32_t new_frequency, __unused uint32_t old_frequency) {
+}
+
+void rtc_clock_stepped(__unused uint32_t new_frequency, __unused uint32_t old_frequency) {
+}
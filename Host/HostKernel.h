@@ -0,0 +1,147 @@
+#ifndef _HOSTKERNEL_H
+#define _HOSTKERNEL_H
+
+/*
+ * Userland stand-ins for the few kernel functions used by the portable driver
+ * code in Source/. Only used when building with -DIESS_HOST (see hostbuild.sh).
+ *
+ * System headers must come before Utility.h, which defines abs() as a macro.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <sys/cdefs.h>
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+/*
+ * With -DIESS_HOST_TLS the driver globals and the clock are per thread, so
+ * independent simulations can run in parallel (see sweep.cpp). Without it
+ * they are shared, as the rendezvous emulator needs.
+ */
+#ifdef IESS_HOST_TLS
+#define IESS_TLS	__thread
+#else
+#define IESS_TLS
+#endif
+
+/*
+ * Clock. The simulator tools run on a virtual clock that only moves when
+ * IODelay()/hostAdvanceNS() is called, the benchmarks use the real one.
+ */
+extern IESS_TLS bool	HostVirtualClock;
+uint64_t	hostUptimeNS();
+void		hostAdvanceNS(uint64_t ns);
+
+/* kern/clock.h, absolute time is in ns here */
+void	clock_get_uptime(uint64_t* result);
+void	absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+
+/*
+ * Simulated logical CPUs. cpu_number() is the CPU the caller is "running" on.
+ */
+extern IESS_TLS int	HostCPUCount;
+int		cpu_number();
+void		hostSetCPU(int cpu);
+
+/* IOLib */
+void	IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void	IODelay(unsigned microseconds);
+void	IOSleep(unsigned milliseconds);
+
+typedef struct HostSimpleLock IOSimpleLock;
+IOSimpleLock*	IOSimpleLockAlloc();
+void		IOSimpleLockFree(IOSimpleLock* lock);
+void		IOSimpleLockLock(IOSimpleLock* lock);
+void		IOSimpleLockUnlock(IOSimpleLock* lock);
+
+/* machine_routines */
+bool	ml_set_interrupts_enabled(bool enable);
+bool	ml_get_interrupts_enabled();
+
+/* How long interrupts were off on a CPU the last time they got turned back on */
+uint64_t	hostLastInterruptsOffNS(int cpu);
+
+extern "C" void mp_rendezvous(	void (*setup_func) (void *),
+			void (*action_func) (void *),
+			void (*teardown_func) (void *),
+			void *arg);
+
+/*
+ * mp_rendezvous() runs every phase on the calling thread, one simulated CPU
+ * after the other, unless another implementation is installed here (see
+ * Rendezvous.h for one with a thread per CPU).
+ */
+class HostRendezvousImpl {
+public:
+	virtual ~HostRendezvousImpl() {}
+	virtual void rendezvous(void (*setup_func) (void *), void (*action_func) (void *),
+				void (*teardown_func) (void *), void *arg) = 0;
+};
+extern IESS_TLS HostRendezvousImpl*	HostRendezvous;
+
+void	rtc_clock_stepping(uint32_t new_frequency, uint32_t old_frequency);
+void	rtc_clock_stepped (uint32_t new_frequency, uint32_t old_frequency);
+
+/* mach/processor_info.h */
+#define CPU_STATE_MAX		4
+#define CPU_STATE_USER		0
+#define CPU_STATE_SYSTEM	1
+#define CPU_STATE_IDLE		2
+#define CPU_STATE_NICE		3
+
+struct processor_cpu_load_info {
+	unsigned int	cpu_ticks[CPU_STATE_MAX];
+};
+
+/* mach/host_info.h */
+#define LOAD_SCALE		1000
+
+struct host_load_info {
+	int	avenrun[3];	// 5, 30 and 60 second averages of runnable threads, LOAD_SCALE units
+	int	mach_factor[3];
+};
+
+/*
+ * Stand-in for the scheduler statistics behind host_statistics(HOST_LOAD_INFO).
+ * Whoever drives the simulation calls hostSchedulerTick() once a (simulated)
+ * second with the number of runnable threads, and it is folded into avenrun[]
+ * the way compute_averages() does it.
+ */
+extern IESS_TLS host_load_info	HostLoadInfo;
+void	hostSchedulerTick(uint32_t runnable);	// LOAD_SCALE units
+
+typedef int IOReturn;
+#define kIOReturnSuccess	0
+#define kIOReturnError		0xe00002bc
+
+/*
+ * Stand-in for IOTimerEventSource. setTimeoutMS() arms a deadline on the
+ * host clock; whoever drives the simulation fires the event once it passes.
+ */
+class IOTimerEventSource {
+public:
+	IOTimerEventSource() : armed(false), deadline(0) {}
+
+	IOReturn setTimeoutMS(uint32_t ms) {
+		return setTimeoutUS(ms * 1000ULL);
+	}
+	IOReturn setTimeoutUS(uint64_t us) {
+		deadline = hostUptimeNS() + us * 1000ULL;
+		armed = true;
+		return kIOReturnSuccess;
+	}
+	void	cancelTimeout()	{ armed = false; }
+	void	enable()	{}
+	void	disable()	{ armed = false; }
+
+	bool		armed;
+	uint64_t	deadline;	// ns, valid while armed
+};
+
+#endif // _HOSTKERNEL_H
@@ -0,0 +1,51 @@
+#include "HostSetup.h"
+#include "Utility.h"
+
+IESS_TLS MSRBackend*	MSR;
+
+bool hostLoadPStates(const char* pstateTable) {
+	const char* p = pstateTable;
+	NumberOfPStates = 0;
+	while (*p && NumberOfPStates < 16) {
+		unsigned mhz = 0, mv = 0, latency = 10, power = 0;
+		int used = 0;
+		if (sscanf(p, "%u:%u%n", &mhz, &mv, &used) < 2) {
+			warn("Bad P-State entry \"%s\", expected MHz:mV[:latency[:mW]]\n", p);
+			return false;
+		}
+		p += used;
+		if (*p == ':') {
+			if (sscanf(p, ":%u%n", &latency, &used) < 1) return false;
+			p += used;
+		}
+		if (*p == ':') {
+			if (sscanf(p, ":%u%n", &power, &used) < 1) return false;
+			p += used;
+		}
+		PState& ps	= PStates[NumberOfPStates];
+		ps.AcpiFreq	= mhz;
+		ps.Frequency	= MHz_to_FID(mhz); // this accounts for N/2 automatically
+		ps.OriginalVoltage = mV_to_VID(mv);
+		ps.Voltage	= ps.OriginalVoltage;
+		ps.Latency	= latency;
+		ps.Power	= power;
+		ps.TimesChosen	= 0;
+		if (latency > MaxLatency) MaxLatency = latency;
+		NumberOfPStates++;
+		if (*p == ',') p++;
+	}
+	return NumberOfPStates > 0;
+}
+
+bool hostSetupDriver(SimulatedCPU* cpu, const char* pstateTable) {
+	MSR		= cpu;
+	HostCPUCount	= cpu->model().cores;
+	FSB		= cpu->model().fsb;
+	Is45nmPenryn	= cpu->model().penryn;
+	ConstantTSC	= true;
+	RtcFixKernel	= false;
+	if (!Lock) Lock = IOSimpleLockAlloc();
+	checkForNby2Ratio(); // before the table, like init() does
+	totalThrottles	= 0;
+	return hostLoadPStates(pstateTable ? pstateTable : HOST_DEFAULT_PSTATES);
+}
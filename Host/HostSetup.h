@@ -0,0 +1,26 @@
+#ifndef _HOSTSETUP_H
+#define _HOSTSETUP_H
+
+#include "SimulatedCPU.h"
+#include "Throttling.h"
+
+/*
+ * The MacBook Air Rev. A table from Info.plist, as MHz:mV[:latency usec[:mW]]
+ */
+#define HOST_DEFAULT_PSTATES	"1600:950,1400:900,1200:900,800:900"
+
+/*
+ * Does what the driver's init() and start() do, against a simulated CPU:
+ * installs it as the MSR backend, sets FSB/Penryn/N/2 globals, allocates
+ * the lock and fills PStates[] from the given table.
+ */
+bool hostSetupDriver(SimulatedCPU* cpu, const char* pstateTable);
+
+/*
+ * Parses a comma separated list of MHz:mV[:latency[:mW]] entries into
+ * PStates[], the same way loadPStateOverride() treats the Info.plist
+ * PStateTable. The power is what _PSS would report, 0 if not given.
+ */
+bool hostLoadPStates(const char* pstateTable);
+
+#endif // _HOSTSETUP_H
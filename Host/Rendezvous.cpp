@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "Rendezvous.h"
+#include "WorkPool.h"
+
+ThreadedRendezvous::ThreadedRendezvous(int cpus, bool pinThreads) :
+	ncpus(cpus < 1 ? 1 : cpus), pin(pinThreads), stamps(ncpus), postedAt(0),
+	generation(0), exiting(false), entered(0), exited(0), finished(0),
+	setup(0), action(0), teardown(0), arg(0) {
+	yield = ncpus > WorkStealingPool::hardwareThreads();
+	for (int cpu = 0; cpu < ncpus; cpu++)
+		if (cpu != cpu_number())
+			threads.push_back(std::thread(&ThreadedRendezvous::worker, this, cpu));
+}
+
+ThreadedRendezvous::~ThreadedRendezvous() {
+	exiting = true;
+	generation++;
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+/* Spin until every CPU has checked in */
+void ThreadedRendezvous::wait(std::atomic<int>& counter) {
+	while (counter.load(std::memory_order_acquire) < ncpus)
+		if (yield) sched_yield();
+}
+
+void ThreadedRendezvous::participate(int cpu) {
+	Stamp& s = stamps[cpu];
+	s.arrive = hostUptimeNS();
+	if (setup) setup(arg);
+	entered++;
+	wait(entered);
+
+	s.action = hostUptimeNS();
+	if (action) action(arg);
+	s.actionEnd = hostUptimeNS();
+	exited++;
+	wait(exited);
+
+	if (teardown) teardown(arg);
+	s.done = hostUptimeNS();
+	finished++;
+}
+
+void ThreadedRendezvous::worker(int cpu) {
+	hostSetCPU(cpu);
+#ifdef __linux__
+	if (pin) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % WorkStealingPool::hardwareThreads(), &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+	unsigned seen = 0;
+	for (;;) {
+		// Idle until the next "IPI"
+		while (generation.load(std::memory_order_acquire) == seen)
+			if (yield) sched_yield();
+		seen = generation.load(std::memory_order_acquire);
+		if (exiting) return;
+		participate(cpu);
+	}
+}
+
+void ThreadedRendezvous::rendezvous(void (*setup_func) (void *), void (*action_func) (void *),
+				    void (*teardown_func) (void *), void *a) {
+	setup = setup_func; action = action_func; teardown = teardown_func; arg = a;
+	entered = 0; exited = 0; finished = 0;
+
+	postedAt = hostUptimeNS();
+	generation.fetch_add(1, std::memory_order_release);
+	participate(cpu_number());
+	wait(finished);
+}
@@ -0,0 +1,64 @@
+#ifndef _RENDEZVOUS_H
+#define _RENDEZVOUS_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "HostKernel.h"
+
+/*
+ * mp_rendezvous() with one thread per simulated CPU, shaped like the xnu one:
+ * the caller "sends the IPI" by bumping a generation counter, every CPU runs
+ * setup, waits at the entry barrier, runs the action, waits at the exit
+ * barrier, runs teardown, and the caller returns once all of them are done.
+ * Barriers spin, as in the kernel; if there are more simulated CPUs than host
+ * CPUs the waiters yield so the run still finishes.
+ *
+ * The caller is the CPU it was on (cpu_number()), the others are worker
+ * threads pinned round robin to host CPUs. Needs the real clock and shared
+ * driver globals, i.e. a build without IESS_HOST_TLS.
+ */
+class ThreadedRendezvous : public HostRendezvousImpl {
+public:
+	/* Per CPU timestamps of the last rendezvous, hostUptimeNS() */
+	struct Stamp {
+		uint64_t	arrive;		// saw the IPI
+		uint64_t	action;		// action started, i.e. left the entry barrier
+		uint64_t	actionEnd;
+		uint64_t	done;		// teardown finished
+	};
+
+	ThreadedRendezvous(int cpus, bool pin);
+	virtual ~ThreadedRendezvous();
+
+	virtual void rendezvous(void (*setup_func) (void *), void (*action_func) (void *),
+				void (*teardown_func) (void *), void *arg);
+
+	int		cpus() const		{ return ncpus; }
+	bool		oversubscribed() const	{ return yield; }
+	uint64_t	posted() const		{ return postedAt; }
+	const Stamp&	stamp(int cpu) const	{ return stamps[cpu]; }
+
+private:
+	void	worker(int cpu);
+	void	participate(int cpu);
+	void	wait(std::atomic<int>& counter);
+
+	int				ncpus;
+	bool				pin, yield;
+	std::vector<std::thread>	threads;
+	std::vector<Stamp>		stamps;
+	uint64_t			postedAt;
+
+	std::atomic<unsigned>	generation;
+	std::atomic<bool>	exiting;
+	std::atomic<int>	entered, exited, finished;
+
+	void	(*setup)	(void *);
+	void	(*action)	(void *);
+	void	(*teardown)	(void *);
+	void*	arg;
+};
+
+#endif // _RENDEZVOUS_H
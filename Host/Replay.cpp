@@ -0,0 +1,316 @@
+#include <math.h>
+
+#include "Replay.h"
+#include "HostInputSource.h"
+#include "Utility.h"
+
+ReplayConfig::ReplayConfig() :
+	model(SimulatedCPU::MacBookAirRevA()), pstates(0), power(PowerModel::Merom()),
+	targetCPULoad(defaultTargetLoad), quantumMS(throttleQuantum), timeoutScale(defaultTimeoutScale),
+	upThreshold(defaultUpThreshold), downThreshold(defaultDownThreshold), minDwellMS(defaultMinDwell),
+	governor("proportional"), skipCostly(true), loadSource(loadFromTicks), reduction(reduceMax), memBoundIPC(defaultMemBoundIPC),
+	coreCPI(1.0), stallNS(0), boostPState(0), boostHoldMS(0),
+	thermal(ThermalStandIn::None()), thermalSoft(defaultThermalSoft), thermalHard(defaultThermalHard),
+	thermalLimit(defaultThermalLimit), thermalBoostMinMS(defaultThermalBoostMin), temperatures(0),
+	spikeLow(300), spikeHigh(800) {
+	pid.setDefaults();
+	tuner.setDefaults();
+	damper.setDefaults();
+	limiter.setDefaults();
+}
+
+/* What AutoThrottler's input handler does */
+static void inputEvent(void* owner) {
+	((ThrottleController*) owner)->boost();
+}
+
+/* Which PStates[] entry the package is running */
+static int stateForCtl(uint16_t ctl) {
+	for (int i = 0; i < NumberOfPStates; i++)
+		if (PStates[i].Frequency == FID(ctl)) return i;
+	return FindClosestPState(FID_to_MHz(FID(ctl)));
+}
+
+bool runReplay(const LoadTrace& trace, const ReplayConfig& cfg, ReplayResult* r) {
+	SimulatedCPU::Model model = cfg.model;
+	model.cores = trace.cpus > 256 ? 256 : trace.cpus;
+
+	HostVirtualClock = true;
+	SimulatedCPU cpu(model);
+	if (!hostSetupDriver(&cpu, cfg.pstates)) return false;
+	totalTimerEvents = 0;
+
+	// Where the table has no power, report what the model draws, like _PSS would
+	double refMHz    = FID_to_MHz(FID(model.maxCtl));
+	double refmV     = VID_to_mV(VID(model.maxCtl));
+	for (int i = 0; i < NumberOfPStates; i++) {
+		if (PStates[i].Power) continue;
+		double volts = VID_to_mV(PStates[i].OriginalVoltage) / refmV;
+		double busyW = cfg.power.dynamicW * volts * volts * (FID_to_MHz(PStates[i].Frequency) / refMHz) + cfg.power.leakageW * volts;
+		PStates[i].Power = (uint32_t) (busyW * 1000 + 0.5);
+	}
+
+	// What start() does, then forget about the transitions it made
+	calibrateTransitions();
+	cpu.transitions = 0;
+	cpu.haltedNS = 0;
+	totalThrottles = 0;
+
+	// What AutoThrottler::setup() does
+	ThrottleController controller = ThrottleController();
+	controller.setDefaults();
+	controller.targetCPULoad = cfg.targetCPULoad;
+	controller.quantumMS     = cfg.quantumMS;
+	controller.timeoutScale  = cfg.timeoutScale;
+	controller.upThreshold   = cfg.upThreshold;
+	controller.downThreshold = cfg.downThreshold;
+	controller.minDwellMS    = cfg.minDwellMS;
+	controller.skipCostly    = cfg.skipCostly;
+	controller.loadSource    = cfg.loadSource;
+	controller.loads.reduction = cfg.reduction;
+	controller.tuner = cfg.tuner;
+	controller.tuner.reset(cfg.targetCPULoad);
+	controller.memBoundIPC   = cfg.memBoundIPC;
+	controller.damper.flips    = cfg.damper.flips;
+	controller.damper.windowMS = cfg.damper.windowMS;
+	controller.damper.holdMS   = cfg.damper.holdMS;
+	controller.limiter.ratePerS = cfg.limiter.ratePerS;
+	controller.limiter.burst    = cfg.limiter.burst;
+	controller.thermal.tjMax      = model.tjMax;
+	controller.thermal.softMargin = cfg.thermalSoft;
+	controller.thermal.hardMargin = cfg.thermalHard;
+	controller.thermalBudget.limitMargin = cfg.thermalLimit;
+	controller.thermalBudget.boostMinMS  = cfg.thermalBoostMinMS;
+	controller.boostPState   = cfg.boostPState;
+	controller.boostHoldMS   = cfg.boostHoldMS;
+	if (controller.memBoundIPC) mp_rendezvous(0, enableFixedCounters, 0, 0);
+	FixedCounters counters[max_cpus];
+	ClockCounters clocks[max_cpus], firstClocks;
+	(PIDController&) controller.pid = cfg.pid;
+	controller.energy.idlePower = (uint32_t) (cfg.power.idleW * 1000 + 0.5);
+	if (!controller.selectGovernor(cfg.governor)) {
+		fprintf(stderr, "Unknown governor %s\n", cfg.governor);
+		return false;
+	}
+	controller.reset();
+	IOTimerEventSource timer, limiterTimer;
+	controller.limiterTimer = &limiterTimer;
+	timer.setTimeoutMS(controller.quantumMS * (1 + controller.currentPState));
+	HostInputSource input;
+	input.setHandler(inputEvent, &controller);
+	if (controller.boostHoldMS) input.start();
+
+	int tickCPUs = trace.cpus < max_cpus ? trace.cpus : max_cpus;
+	std::vector<processor_cpu_load_info> load(tickCPUs);
+	std::vector<double> busyTicks(tickCPUs, 0), idleTicks(tickCPUs, 0), backlog(trace.cpus, 0);
+	bzero(&load[0], tickCPUs * sizeof(processor_cpu_load_info));
+	bzero(r, sizeof(*r));
+	bzero(&HostLoadInfo, sizeof(HostLoadInfo));
+
+	TraceCursor cursor(trace);
+	double recordMHz = FID_to_MHz(PStates[0].Frequency);
+	double recordRate = recordMHz / (cfg.coreCPI + cfg.stallNS * recordMHz / 1000); // instructions per us
+	double mhzSum = 0, rampSum = 0;
+	uint32_t ramps = 0;
+	bool spikeArmed = true, waitingForP0 = false;
+	uint64_t spikeStart = 0, start = hostUptimeNS();
+	bool thermal = cfg.thermal.rCPerW > 0;
+	double dieC = cfg.thermal.ambientC, coreW[256];
+	uint64_t thermStatus[max_cpus];
+	mp_rendezvous(0, readClockCounters, 0, clocks);
+	controller.c0.update(clocks, tickCPUs);
+	firstClocks = clocks[0];
+
+	for (uint64_t ms = 0; ms < trace.durationMS; ms++) {
+		uint16_t ctl	= cpu.operatingPoint();
+		double mhz	= FID_to_MHz(FID(ctl));
+		double volts	= VID_to_mV(VID(ctl)) / refmV;
+		double cpi	= cfg.coreCPI + cfg.stallNS * mhz / 1000;
+		double capacity	= mhz / cpi / recordRate;	// P0-ms of work served per ms
+		double busyW	= cfg.power.dynamicW * volts * volts * (mhz / refMHz) + cfg.power.leakageW * volts;
+
+		int state	= stateForCtl(ctl);
+		r->timeAtState[state]++;
+		for (int i = 0; i < tunerArms; i++)
+			if (tunerTargets[i] == controller.targetCPULoad) r->timeAtTarget[ms * 2 >= trace.durationMS][i]++;
+		mhzSum += mhz;
+
+		uint16_t maxDemand = 0;
+		bool queued = false;
+		double runnable = 0;
+		for (int c = 0; c < trace.cpus; c++) {
+			uint16_t d = cursor.demand(ms, c);
+			if (d > maxDemand) maxDemand = d;
+			backlog[c] += d / 1000.0;
+			double done = backlog[c] < capacity ? backlog[c] : capacity;
+			double busy = capacity > 0 ? done / capacity : 1.0;
+			backlog[c] -= done;
+			if (backlog[c] > 1e-9) queued = true;
+			runnable += busy + backlog[c] / 10.0; // 10 ms timeslices waiting
+			if (c < model.cores) {
+				uint64_t cycles = (uint64_t) (busy * mhz * 1000);
+				cpu.execute(c, cycles, (uint64_t) (cycles / cpi));
+			}
+			r->energyJ += (busy * busyW + (1.0 - busy) * cfg.power.idleW) / 1000.0;
+			if (c < model.cores) coreW[c] = busy * busyW + (1.0 - busy) * cfg.power.idleW;
+			r->pssEnergyJ += (busy * PStates[state].Power + (1.0 - busy) * controller.energy.idlePower) / 1000000.0;
+			if (c < tickCPUs) { // HZ=100, so a tick is 10 ms
+				busyTicks[c] += busy / 10.0;
+				idleTicks[c] += (1.0 - busy) / 10.0;
+				load[c].cpu_ticks[CPU_STATE_USER] = (unsigned int) busyTicks[c];
+				load[c].cpu_ticks[CPU_STATE_IDLE] = (unsigned int) idleTicks[c];
+			}
+		}
+		if (queued) r->missedDemandMS++;
+
+		// Heat the die by what the package drew this ms
+		if (thermal) {
+			double packageW = 0;
+			for (int c = 0; c < model.cores; c++) packageW += coreW[c];
+			dieC += (packageW - (dieC - cfg.thermal.ambientC) / cfg.thermal.rCPerW) / cfg.thermal.cJPerC / 1000.0;
+			for (int c = 0; c < model.cores; c++) {
+				double coreC = dieC + coreW[c] * cfg.thermal.hotspotCPerW;
+				cpu.setTemperature(c, coreC);
+				if (coreC > r->maxTempC) r->maxTempC = coreC;
+			}
+			if (cpu.prochot()) r->prochotMS++;
+		}
+		if (ms % 1000 == 999)
+			hostSchedulerTick((uint32_t) (runnable * LOAD_SCALE));
+
+		// Load spikes and how long it takes to get to P0
+		if (maxDemand < cfg.spikeLow) spikeArmed = true;
+		if (spikeArmed && maxDemand >= cfg.spikeHigh) {
+			r->spikes++;
+			spikeArmed = false;
+			input.fire();
+			if (!waitingForP0) { waitingForP0 = true; spikeStart = ms; }
+		}
+		if (waitingForP0 && FID(ctl) == PStates[0].Frequency) {
+			double delay = ms - spikeStart;
+			rampSum += delay; ramps++;
+			if (delay > r->rampMaxMS) r->rampMaxMS = delay;
+			waitingForP0 = false;
+		}
+
+		// Move the clock on and fire the perfTimer if it's due
+		uint64_t next = start + (ms + 1) * 1000000ULL, now = hostUptimeNS();
+		if (now < next) hostAdvanceNS(next - now);
+		if (limiterTimer.armed && hostUptimeNS() >= limiterTimer.deadline) {
+			limiterTimer.armed = false;
+			controller.limiterEvent();
+		}
+		if (timer.armed && hostUptimeNS() >= timer.deadline) {
+			long idle, total;
+			timer.armed = false;
+			controller.ticks.update(&load[0], tickCPUs, &idle, &total);
+			if (controller.loadSource == loadFromRunQueue)
+				controller.runQueue.update(&HostLoadInfo, trace.cpus);
+			// One rendezvous for what the sample needs, like AutoThrottler::GetCounters()
+			CounterReads reads = { controller.loadSource == loadFromAPERF ? clocks : 0,
+					       controller.memBoundIPC ? counters : 0, thermal ? thermStatus : 0 };
+			if (reads.clocks || reads.fixed || reads.thermal)
+				mp_rendezvous(0, readCounters, 0, &reads);
+			if (reads.clocks)	controller.c0.update(clocks, tickCPUs);
+			if (reads.fixed)	controller.ipc.update(counters, tickCPUs);
+			if (reads.thermal)	controller.thermal.update(thermStatus, tickCPUs);
+			uint32_t interval = controller.lastTimeoutMS;
+			controller.timerEvent(idle, total, &timer);
+			if (thermal && cfg.temperatures) {
+				TemperatureSample t = { interval, controller.thermalBudget.model.power(),
+							controller.thermal.tjMax - controller.thermal.margin() };
+				cfg.temperatures->samples.push_back(t);
+			}
+		}
+	}
+
+	if (waitingForP0) { // never got there
+		double delay = trace.durationMS - spikeStart;
+		rampSum += delay; ramps++;
+		if (delay > r->rampMaxMS) r->rampMaxMS = delay;
+	}
+
+	r->durationMS	= trace.durationMS;
+	r->states	= NumberOfPStates;
+	for (int i = 0; i < NumberOfPStates; i++) r->stateMHz[i] = PStates[i].AcpiFreq;
+	r->timerEvents	= totalTimerEvents;
+	r->throttles	= totalThrottles;
+	r->transitions	= cpu.transitions;
+	r->stateChanges	= controller.stateChanges;
+	r->transitionsAvoided = controller.transitionsAvoided();
+	r->skippedChanges = controller.skippedChanges;
+	r->inputEvents	= input.events;
+	r->boosts	= controller.boosts;
+	r->memBoundSamples = controller.memBoundSamples;
+	r->oscillations	= controller.damper.oscillations;
+	r->damped	= controller.damper.damped;
+	r->thermalCapped = controller.thermalCapped;
+	const ThermalModel& fit = controller.thermalBudget.model;
+	r->modelValid	= fit.valid();
+	r->modelResistance = fit.resistance();
+	r->modelTauMS	= fit.tauMS();
+	r->modelAmbientC = fit.ambient();
+	r->modelFits	= fit.fits;
+	r->thermalBoosts = controller.thermalBudget.boosts;
+	r->sustainableMHz = PStates[controller.thermalBudget.sustainable()].AcpiFreq;
+	r->deferredChanges = controller.deferredChanges;
+	r->coalescedChanges = controller.coalescedChanges;
+	r->haltedNS	= cpu.haltedNS;
+	r->tuned	= controller.tuner.enabled;
+	for (int i = 0; i < tunerArms; i++) r->tunerStats[i] = controller.tuner.stats(i);
+	r->tunerEpochs	= controller.tuner.epochs();
+	mp_rendezvous(0, readClockCounters, 0, clocks);
+	if (clocks[0].mperf > firstClocks.mperf)
+		r->effectiveMHz = (double) (clocks[0].aperf - firstClocks.aperf) / (clocks[0].mperf - firstClocks.mperf) * refMHz;
+	r->avgMHz	= trace.durationMS ? mhzSum / trace.durationMS : 0;
+	r->rampMeanMS	= ramps ? rampSum / ramps : 0;
+	for (int c = 0; c < trace.cpus; c++) r->backlogMS += backlog[c];
+	return true;
+}
+
+void printReplayResult(FILE* out, const LoadTrace& trace, const ReplayResult& r) {
+	fprintf(out, "Trace %s: %d cpus, %.1f s\n", trace.name.c_str(), trace.cpus, r.durationMS / 1000.0);
+	fprintf(out, "  Time at frequency:");
+	for (int i = r.states - 1; i >= 0; i--)
+		fprintf(out, "  %d MHz %.1f%%", r.stateMHz[i], r.durationMS ? 100.0 * r.timeAtState[i] / r.durationMS : 0.0);
+	fprintf(out, "\n  Average frequency: %.0f MHz, %.0f MHz while busy from APERF/MPERF\n", r.avgMHz, r.effectiveMHz);
+	fprintf(out, "  Timer events: %llu, throttles: %llu, transitions: %llu (%.1f usec halted)\n",
+		(unsigned long long) r.timerEvents, (unsigned long long) r.throttles,
+		(unsigned long long) r.transitions, r.haltedNS / 1000.0);
+	fprintf(out, "  P-State changes: %llu, %lld avoided compared to the proportional governor, %llu skipped as not worth it\n",
+		(unsigned long long) r.stateChanges, (long long) r.transitionsAvoided, (unsigned long long) r.skippedChanges);
+	if (r.oscillations)
+		fprintf(out, "  Oscillations: %llu, %llu P-State changes damped\n",
+			(unsigned long long) r.oscillations, (unsigned long long) r.damped);
+	if (r.deferredChanges)
+		fprintf(out, "  Rate limited: %llu P-State changes deferred, %llu of them coalesced into a later one\n",
+			(unsigned long long) r.deferredChanges, (unsigned long long) r.coalescedChanges);
+	if (r.memBoundSamples)
+		fprintf(out, "  Memory bound: %llu samples capped\n", (unsigned long long) r.memBoundSamples);
+	if (r.tuned) {
+		fprintf(out, "  Tuner: %u epochs\n    target   cost mW  miss %%o  epochs  time 1st half  2nd half\n", r.tunerEpochs);
+		for (int i = 0; i < tunerArms; i++) {
+			double half[2];
+			for (int h = 0; h < 2; h++) {
+				uint64_t len = h ? r.durationMS - r.durationMS / 2 : r.durationMS / 2;
+				half[h] = len ? 100.0 * r.timeAtTarget[h][i] / len : 0;
+			}
+			fprintf(out, "    %5u%% %9u %8u %7u %13.1f%% %8.1f%%\n", tunerTargets[i] / 10, r.tunerStats[i].cost,
+				r.tunerStats[i].miss, r.tunerStats[i].epochs, half[0], half[1]);
+		}
+	}
+	fprintf(out, "  Energy: %.2f J, %.3f W average, %.2f J by _PSS\n", r.energyJ,
+		r.durationMS ? r.energyJ * 1000.0 / r.durationMS : 0.0, r.pssEnergyJ);
+	if (r.maxTempC > 0)
+		fprintf(out, "  Thermal: hottest core %.1f C, %llu ms at PROCHOT, %llu throttles capped\n", r.maxTempC,
+			(unsigned long long) r.prochotMS, (unsigned long long) r.thermalCapped);
+	if (r.modelValid)
+		fprintf(out, "  Thermal model: %.2f C/W, tau %.1f s, ambient %d C after %llu fits; %llu boosts, %u MHz sustainable\n",
+			r.modelResistance / 1000.0, r.modelTauMS / 1000.0, r.modelAmbientC, (unsigned long long) r.modelFits,
+			(unsigned long long) r.thermalBoosts, r.sustainableMHz);
+	fprintf(out, "  Load spikes: %u, ramp to P0 %.1f ms mean, %.0f ms max\n", r.spikes, r.rampMeanMS, r.rampMaxMS);
+	if (r.inputEvents)
+		fprintf(out, "  Input events: %llu, %llu boosted\n", (unsigned long long) r.inputEvents, (unsigned long long) r.boosts);
+	fprintf(out, "  Missed demand: %llu ms with work queued, %.1f P0-ms left at the end\n",
+		(unsigned long long) r.missedDemandMS, r.backlogMS);
+}
@@ -0,0 +1,144 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include "HostSetup.h"
+#include "ThrottleController.h"
+#include "Trace.h"
+
+/*
+ * Core power while busy is dynamic * (V/Vref)^2 * (f/fref) + leakage * (V/Vref),
+ * the reference being the highest operating point of the model. Idle cores
+ * sit in C1E/C2 at a flat idleW.
+ */
+struct PowerModel {
+	double	dynamicW;	// per core at the reference point
+	double	leakageW;	// per core at the reference voltage
+	double	idleW;		// per idle core
+
+	static PowerModel Merom() { PowerModel p = { 7.0, 1.5, 0.4 }; return p; }
+};
+
+/*
+ * Stand-in for the die and its cooling: one thermal resistance and capacitance
+ * from the package to ambient, heated by what the cores draw, plus a hot spot
+ * per core of hotspotCPerW for each watt that core draws itself. The cores'
+ * IA32_THERM_STATUS reads the result. rCPerW = 0 leaves the sensors without
+ * readings.
+ */
+struct ThermalStandIn {
+	double	rCPerW;		// package to ambient
+	double	cJPerC;
+	double	ambientC;
+	double	hotspotCPerW;
+
+	/* Sustained P0 on both cores runs into TjMax in well under a minute, like the Air does */
+	static ThermalStandIn MacBookAir() { ThermalStandIn t = { 4.5, 6.7, 35.0, 0.5 }; return t; }
+	static ThermalStandIn None() { ThermalStandIn t = { 0, 0, 0, 0 }; return t; }
+};
+
+struct ReplayConfig {
+	SimulatedCPU::Model	model;
+	const char*		pstates;	// MHz:mV[:lat],... or 0 for the Info.plist table
+	PowerModel		power;
+	uint16_t		targetCPULoad;	// percent x 10
+	uint32_t		quantumMS;
+	uint16_t		timeoutScale;	// x10
+	uint16_t		upThreshold;	// percent x 10
+	uint16_t		downThreshold;	// percent x 10
+	uint32_t		minDwellMS;
+	const char*		governor;	// name, see Governors.h
+	PIDController		pid;		// gains for the pid governor
+	bool			skipCostly;	// ThrottleController::skipCostly
+	uint8_t			loadSource;	// ThrottleController::loadSource
+	uint8_t			reduction;	// LoadAggregator::reduction
+	TargetTuner		tuner;		// ThrottleController::tuner, starts from targetCPULoad
+	uint16_t		memBoundIPC;	// ThrottleController::memBoundIPC
+	double			coreCPI;	// cycles per instruction of the work without memory stalls
+	double			stallNS;	// memory stall per instruction, the same at every speed
+	OscillationDamper	damper;		// ThrottleController::damper, its settings
+	TransitionLimiter	limiter;	// ThrottleController::limiter, its settings
+	uint8_t			boostPState;	// ThrottleController::boostPState
+	uint32_t		boostHoldMS;	// ThrottleController::boostHoldMS, 0 = no input events
+	ThermalStandIn		thermal;	// temperatures for the DTS, off by default
+	uint8_t			thermalSoft;	// ThermalCap::softMargin
+	uint8_t			thermalHard;	// ThermalCap::hardMargin
+	uint8_t			thermalLimit;	// ThermalBudget::limitMargin
+	uint32_t		thermalBoostMinMS;	// ThermalBudget::boostMinMS
+	TemperatureTrace*	temperatures;	// if set, gets what the thermal model was fed
+	uint16_t		spikeLow;	// demand below this, then at or above spikeHigh,
+	uint16_t		spikeHigh;	// is a load spike (permille)
+
+	ReplayConfig();
+};
+
+struct ReplayResult {
+	uint64_t	durationMS;
+	int		states;
+	uint16_t	stateMHz[16];
+	uint64_t	timeAtState[16];	// ms
+	uint64_t	timerEvents;
+	uint64_t	throttles;		// throttleAllCPUs calls
+	uint64_t	transitions;		// operating point changes in the package
+	uint64_t	stateChanges;		// PState switches the controller asked for
+	int64_t		transitionsAvoided;	// compared to the proportional governor
+	uint64_t	skippedChanges;		// not worth their transition latency
+	uint64_t	memBoundSamples;	// held down by the memory bound cap
+	uint64_t	oscillations;		// the damper found
+	uint64_t	damped;			// changes it dropped
+	uint64_t	deferredChanges;	// waited for the limiter
+	uint64_t	coalescedChanges;	// replaced while waiting
+	uint64_t	haltedNS;		// cores halted for PLL relock
+	double		effectiveMHz;		// APERF / MPERF of cpu 0 over the run, while busy
+	double		energyJ;
+	double		maxTempC;		// hottest core, with a thermal stand-in
+	uint64_t	prochotMS;		// TM2 held the package at the lowest point
+	uint64_t	thermalCapped;		// throttles the controller's cap held back
+	bool		modelValid;		// the thermal model's fit at the end
+	uint32_t	modelResistance;	// C/W x 1000
+	uint32_t	modelTauMS;
+	int		modelAmbientC;
+	uint64_t	modelFits;
+	uint64_t	thermalBoosts;		// the budget let P0 run past the sustainable state
+	uint16_t	sustainableMHz;		// as of the end
+	double		pssEnergyJ;		// the same from PStates[].Power and idlePower, what the kext knows
+	double		avgMHz;
+	uint32_t	spikes;
+	uint64_t	inputEvents;		// HostInputSource events, one per spike
+	uint64_t	boosts;			// of them, the ones that raised the speed
+	double		rampMeanMS;		// spike until the package reaches P0
+	double		rampMaxMS;
+	uint64_t	missedDemandMS;		// time some cpu had work queued
+	bool		tuned;			// the tuner ran
+	uint64_t	timeAtTarget[2][tunerArms];	// ms at each tuner target, first and second half
+	TunerArm	tunerStats[tunerArms];	// what it learned
+	uint32_t	tunerEpochs;
+	double		backlogMS;		// P0-ms of work still queued at the end
+};
+
+/*
+ * Replays the trace through ThrottleController on the virtual clock, after
+ * calibrateTransitions() like the kext's start().
+ *
+ * Work in the trace was measured at P0. Each ms every cpu gets its demand
+ * added to a backlog and serves as much as the current frequency allows, so
+ * running slower shows up as higher load in the ticks the throttler sees, and
+ * as missed demand when a cpu can't keep up. Ticks are synthesized at HZ=100.
+ * Work runs at f / (coreCPI + stallNS * f) instructions per ns, so with
+ * stallNS > 0 it gains less than the clock from going faster; the trace
+ * demand is in P0-ms of that work. The simulated fixed counters get the
+ * cycles and instructions, and are read like the kext does before every
+ * timer event while memBoundIPC is set. TSC, MPERF and APERF are read
+ * before every timer event.
+ * For the scheduler's load average a cpu counts as one runnable thread while
+ * busy plus one waiting thread per timeslice (10 ms) of work queued, sampled
+ * once a second into hostSchedulerTick().
+ * With boostHoldMS set, every load spike starts with an input event from a
+ * HostInputSource, the way a keypress or click starts the work it causes.
+ *
+ * The simulator state is global like the driver's: one replay at a time,
+ * or one per thread when built with -DIESS_HOST_TLS.
+ */
+bool	runReplay(const LoadTrace& trace, const ReplayConfig& cfg, ReplayResult* result);
+void	printReplayResult(FILE* out, const LoadTrace& trace, const ReplayResult& r);
+
+#endif // _REPLAY_H
@@ -0,0 +1,269 @@
+#include "SimulatedCPU.h"
+#include "Utility.h"
+
+/* Bus ratio x2, so N/2 ratios compare properly */
+static inline int ratioX2(uint16_t ctl) {
+	uint8_t fid = FID(ctl);
+	return (fid & 0x80) ? (fid & 0x7f) : (fid & 0x7f) * 2;
+}
+
+SimulatedCPU::Model SimulatedCPU::MacBookAirRevA() {
+	Model m;
+	m.name		= "MacBook Air Rev. A (Core 2 Duo P7500)";
+	m.fsb		= 200000000ULL;
+	m.penryn	= false;
+	m.nby2		= true;
+	m.maxCtl	= CTL(8, 25);	// 1600 MHz, 1100 mV
+	m.minCtl	= CTL(6, 12);	// 1200 MHz,  892 mV
+	m.vidStepNS	= 2000;
+	m.pllRelockNS	= 10000;
+	m.stsLagNS	= 1000;
+	m.cores		= 2;
+	m.tjMax		= 100;
+	return m;
+}
+
+SimulatedCPU::Model SimulatedCPU::PenrynP8600() {
+	Model m;
+	m.name		= "Core 2 Duo P8600 (Penryn)";
+	m.fsb		= 266666667ULL;
+	m.penryn	= true;
+	m.nby2		= true;
+	m.maxCtl	= CTL(9, 31);	// 2400 MHz, 1100 mV
+	m.minCtl	= CTL(6, 15);	// 1600 MHz,  900 mV
+	m.vidStepNS	= 2000;
+	m.pllRelockNS	= 5000;
+	m.stsLagNS	= 1000;
+	m.cores		= 2;
+	m.tjMax		= 105;
+	return m;
+}
+
+SimulatedCPU::SimulatedCPU(const Model& model) : m(model) {
+	cur.from = cur.to = m.maxCtl;
+	cur.start = cur.relockStart = cur.end = 0;
+	prev = cur;
+	for (int i = 0; i < 256; i++)
+		request[i] = m.maxCtl;
+	bzero(fixedCtr, sizeof(fixedCtr));
+	bzero(fixedCtrl, sizeof(fixedCtrl));
+	bzero(globalCtrl, sizeof(globalCtrl));
+	bzero(mperf, sizeof(mperf));
+	bzero(aperf, sizeof(aperf));
+	bzero(temperature, sizeof(temperature));
+	bzero(thermalLog, sizeof(thermalLog));
+	thermalValid = hot = false;
+	pending = false;
+	pendingCtl = 0; pendingTime = 0;
+	transitions = haltedNS = rampNS = 0;
+}
+
+uint64_t SimulatedCPU::duration(uint16_t from, uint16_t to, bool* up) {
+	uint64_t ramp   = abs((int) VID(to) - (int) VID(from)) * (uint64_t) m.vidStepNS;
+	uint64_t relock = (FID(to) != FID(from)) ? m.pllRelockNS : 0;
+	if (up) *up = ratioX2(to) > ratioX2(from);
+	return ramp + relock;
+}
+
+void SimulatedCPU::begin(uint16_t to, uint64_t at) {
+	Transition tr;
+	bool up;
+	tr.from  = cur.to;
+	tr.to    = to;
+	tr.start = at;
+	tr.end   = at + duration(tr.from, to, &up);
+	uint64_t relock = (FID(to) != FID(tr.from)) ? m.pllRelockNS : 0;
+	// Going up the voltage has to be there before the clock, going down the other way around
+	tr.relockStart = up ? tr.end - relock : at;
+
+	transitions++;
+	haltedNS += relock;
+	rampNS   += (tr.end - tr.start) - relock;
+	prev = cur;
+	cur  = tr;
+}
+
+void SimulatedCPU::update(uint64_t now) {
+	if (!pending) return;
+	uint64_t start = pendingTime > cur.end ? pendingTime : cur.end;
+	if (start > now) return;
+	pending = false;
+	begin(pendingCtl, start);
+}
+
+uint16_t SimulatedCPU::evaluate(const Transition& tr, uint64_t t) {
+	if (t >= tr.end)   return tr.to;
+	if (t <  tr.start) return tr.from;
+
+	uint64_t relock   = (FID(tr.to) != FID(tr.from)) ? m.pllRelockNS : 0;
+	bool     up       = ratioX2(tr.to) > ratioX2(tr.from);
+	uint64_t rampFrom = up ? tr.start : tr.relockStart + relock;
+	uint8_t  fid      = (t >= tr.relockStart + relock) ? FID(tr.to) : FID(tr.from);
+	int      vid      = VID(tr.from);
+	int      dv       = (int) VID(tr.to) - (int) VID(tr.from);
+
+	if (t >= rampFrom && dv != 0) {
+		int steps = (t - rampFrom) / m.vidStepNS;
+		if (steps > abs(dv)) steps = abs(dv);
+		vid += dv > 0 ? steps : -steps;
+	}
+	return CTL(fid, vid);
+}
+
+uint16_t SimulatedCPU::ctlAt(uint64_t t) {
+	if (t >= cur.start)  return evaluate(cur, t);
+	if (t >= prev.start) return evaluate(prev, t);
+	return prev.from;
+}
+
+uint16_t SimulatedCPU::runningAt(uint64_t t) {
+	return hot ? m.minCtl : ctlAt(t);
+}
+
+void SimulatedCPU::setTemperature(int core, double celsius) {
+	std::lock_guard<std::mutex> guard(mutex);
+	if (core < 0 || core >= 256) return;
+	temperature[core] = celsius;
+	thermalValid = true;
+	if (celsius >= m.tjMax) thermalLog[core] = true;
+	hot = false;
+	for (int i = 0; i < m.cores; i++)
+		if (temperature[i] >= m.tjMax) hot = true;
+}
+
+bool SimulatedCPU::prochot() {
+	std::lock_guard<std::mutex> guard(mutex);
+	return hot;
+}
+
+void SimulatedCPU::execute(int core, uint64_t cycles, uint64_t instructions) {
+	std::lock_guard<std::mutex> guard(mutex);
+	// Counter n counts while its ring bits in FIXED_CTR_CTRL and bit 32+n in PERF_GLOBAL_CTRL are set
+	if ((fixedCtrl[core] & 0x3) && (globalCtrl[core] & (1ULL << 32)))
+		fixedCtr[core][0] = (fixedCtr[core][0] + instructions) & FIXED_CTR_MASK;
+	if ((fixedCtrl[core] & 0x30) && (globalCtrl[core] & (1ULL << 33)))
+		fixedCtr[core][1] = (fixedCtr[core][1] + cycles) & FIXED_CTR_MASK;
+	// The same busy time in TSC ticks
+	uint64_t now = hostUptimeNS();
+	update(now);
+	aperf[core] += cycles;
+	mperf[core] += cycles * ratioX2(m.maxCtl) / ratioX2(runningAt(now));
+}
+
+uint64_t SimulatedCPU::read(uint32_t msr) {
+	std::lock_guard<std::mutex> guard(mutex);
+	uint64_t now = hostUptimeNS();
+	update(now);
+
+	switch (msr) {
+		case INTEL_MSR_PERF_STS: {
+			uint64_t t   = now > m.stsLagNS ? now - m.stsLagNS : 0;
+			uint64_t sts = runningAt(t);
+			sts |= (uint64_t) VID(m.maxCtl)		<< 32;
+			sts |= (uint64_t) (FID(m.maxCtl) & 0x1f) << 40;
+			sts |= (uint64_t) (m.nby2 ? 1 : 0)	<< 46;
+			sts |= (uint64_t) VID(m.minCtl)		<< 48;
+			sts |= (uint64_t) (FID(m.minCtl) & 0x1f) << 56;
+			return sts;
+		}
+		case INTEL_MSR_PERF_CTL:
+			return request[cpu_number()];
+		case INTEL_MSR_TSC:
+			return (now / 1000) * (m.fsb / 1000) * ratioX2(m.maxCtl) / 2 / 1000;
+		case INTEL_MSR_MPERF:
+			return mperf[cpu_number()];
+		case INTEL_MSR_APERF:
+			return aperf[cpu_number()];
+		case INTEL_MSR_FIXED_CTR0:
+		case INTEL_MSR_FIXED_CTR1:
+			return fixedCtr[cpu_number()][msr - INTEL_MSR_FIXED_CTR0];
+		case INTEL_MSR_FIXED_CTR_CTRL:
+			return fixedCtrl[cpu_number()];
+		case INTEL_MSR_PERF_GLOBAL_CTRL:
+			return globalCtrl[cpu_number()];
+		case INTEL_MSR_THERM_STATUS: {
+			int cpu = cpu_number();
+			if (!thermalValid) return 0;
+			int below = m.tjMax - (int) temperature[cpu];
+			if (temperature[cpu] >= m.tjMax) below = 0;
+			if (below > 127) below = 127;
+			return THERM_STATUS_VALID | ((uint64_t) below << 16)
+			       | (temperature[cpu] >= m.tjMax ? THERM_STATUS_PROCHOT : 0) | (thermalLog[cpu] ? THERM_STATUS_LOG : 0);
+		}
+		default:
+			return regs[msr];
+	}
+}
+
+void SimulatedCPU::write(uint32_t msr, uint64_t value) {
+	std::lock_guard<std::mutex> guard(mutex);
+	uint64_t now = hostUptimeNS();
+	update(now);
+
+	switch (msr) {
+		case INTEL_MSR_PERF_CTL:
+			break;
+		case INTEL_MSR_FIXED_CTR0:
+		case INTEL_MSR_FIXED_CTR1:
+			fixedCtr[cpu_number()][msr - INTEL_MSR_FIXED_CTR0] = value & FIXED_CTR_MASK;
+			return;
+		case INTEL_MSR_FIXED_CTR_CTRL:
+			fixedCtrl[cpu_number()] = value;
+			return;
+		case INTEL_MSR_MPERF:
+			mperf[cpu_number()] = value;
+			return;
+		case INTEL_MSR_APERF:
+			aperf[cpu_number()] = value;
+			return;
+		case INTEL_MSR_PERF_GLOBAL_CTRL:
+			globalCtrl[cpu_number()] = value;
+			return;
+		case INTEL_MSR_THERM_STATUS:	// the log bit clears by writing 0 to it
+			if (!(value & THERM_STATUS_LOG)) thermalLog[cpu_number()] = false;
+			return;
+		default:
+			regs[msr] = value;
+			return;
+	}
+
+	request[cpu_number()] = value & 0xffff;
+
+	// The package follows the fastest core
+	uint16_t target = request[0];
+	for (int i = 1; i < m.cores; i++)
+		if (ratioX2(request[i]) > ratioX2(target)
+		    || (ratioX2(request[i]) == ratioX2(target) && VID(request[i]) > VID(target)))
+			target = request[i];
+
+	if (target == cur.to) {
+		pending = false;
+	} else {
+		if (!pending) pendingTime = now;
+		pending    = true;
+		pendingCtl = target;
+	}
+	update(now);
+}
+
+uint16_t SimulatedCPU::operatingPoint() {
+	std::lock_guard<std::mutex> guard(mutex);
+	uint64_t now = hostUptimeNS();
+	update(now);
+	return runningAt(now);
+}
+
+bool SimulatedCPU::settled() {
+	std::lock_guard<std::mutex> guard(mutex);
+	uint64_t now = hostUptimeNS();
+	update(now);
+	return !pending && now >= cur.end;
+}
+
+uint64_t SimulatedCPU::settleTime() {
+	std::lock_guard<std::mutex> guard(mutex);
+	update(hostUptimeNS());
+	if (!pending) return cur.end;
+	uint64_t start = pendingTime > cur.end ? pendingTime : cur.end;
+	return start + duration(cur.to, pendingCtl, 0);
+}
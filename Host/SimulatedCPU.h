@@ -0,0 +1,105 @@
+#ifndef _SIMULATEDCPU_H
+#define _SIMULATEDCPU_H
+
+#include <map>
+#include <mutex>
+
+#include "HostKernel.h"
+#include "MSRAccess.h"
+
+/*
+ * A Core 2 (Merom) / Penryn package as seen through its EIST MSRs.
+ *
+ * Every core has its own PERF_CTL request; the package runs at the highest
+ * requested FID, like the real shared voltage/frequency domain. Transitions
+ * follow the hardware sequence:
+ *   going up:	the VR ramps VID first (one code per vidStepNS), then the PLL relocks
+ *   going down:	the PLL relocks first, then the VR ramps VID down
+ * While the PLL relocks all cores are halted. A write that arrives during a
+ * transition is taken once the current one has completed. PERF_STS reports
+ * the operating point stsLagNS late, and bits 63:32 carry the min/max
+ * ratio and VID fields including the N/2 flag in bit 46.
+ *
+ * Each core also has the architectural fixed counters 0 (instructions
+ * retired) and 1 (unhalted core cycles), 40 bits wide. They count what
+ * execute() reports, while enabled in FIXED_CTR_CTRL and PERF_GLOBAL_CTRL.
+ * The TSC runs at the highest operating point's clock off the uptime; MPERF
+ * and APERF count the busy time execute() reports at that rate and at the
+ * clock the package runs at.
+ *
+ * IA32_THERM_STATUS reads back whatever temperature the host last gave each
+ * core with setTemperature() (nothing valid before that), as degrees below
+ * tjMax. At tjMax TM2 takes over like on the real part: PROCHOT and its log
+ * bit are set and the package runs at minCtl, whatever PERF_CTL says, until
+ * every core is below tjMax again.
+ *
+ * Time comes from hostUptimeNS(), so the model can run on the virtual clock.
+ */
+class SimulatedCPU : public MSRBackend {
+public:
+	struct Model {
+		const char*	name;
+		uint64_t	fsb;		// Hz
+		bool		penryn;		// 12.5 mV VID steps instead of 16 mV
+		bool		nby2;		// supports N/2 bus ratios
+		uint16_t	maxCtl;		// FID/VID of the highest operating point
+		uint16_t	minCtl;		// FID/VID of the lowest operating point
+		uint32_t	vidStepNS;	// VR slew time per VID code
+		uint32_t	pllRelockNS;	// cores halted while PLL relocks
+		uint32_t	stsLagNS;	// PERF_STS shows the operating point this late
+		int		cores;
+		uint8_t		tjMax;		// degrees C
+	};
+
+	static Model	MacBookAirRevA();	// Core 2 Duo P7500 (Merom), 1.6 GHz, 800 MT/s FSB
+	static Model	PenrynP8600();		// Core 2 Duo P8600 (Penryn), 2.4 GHz, 1066 MT/s FSB
+
+	SimulatedCPU(const Model& m);
+
+	virtual uint64_t read	(uint32_t msr);
+	virtual void	 write	(uint32_t msr, uint64_t value);
+
+	const Model&	model() const { return m; }
+	uint16_t	operatingPoint();		// FID/VID right now, without PERF_STS lag
+	void		setTemperature(int core, double celsius);	// for IA32_THERM_STATUS
+	bool		prochot();			// TM2 holding the package at minCtl
+	void		execute(int core, uint64_t cycles, uint64_t instructions); // work the core just did
+	bool		settled();			// no transition in flight or pending
+	uint64_t	settleTime();			// when the last requested transition completes
+
+	/* Statistics */
+	uint64_t	transitions;		// operating point changes started
+	uint64_t	haltedNS;		// total time cores were halted for PLL relock
+	uint64_t	rampNS;			// total time spent ramping VID
+
+private:
+	struct Transition {
+		uint16_t	from, to;
+		uint64_t	start, relockStart, end;
+	};
+
+	void		update(uint64_t now);
+	void		begin(uint16_t to, uint64_t at);
+	uint16_t	ctlAt(uint64_t t);
+	uint16_t	runningAt(uint64_t t);	// ctlAt() unless TM2 overrides it
+	uint16_t	evaluate(const Transition& tr, uint64_t t);
+	uint64_t	duration(uint16_t from, uint16_t to, bool* up);
+
+	std::mutex	mutex;
+	Model		m;
+	uint16_t	request[256];	// per core PERF_CTL
+	uint64_t	fixedCtr[256][2];
+	uint64_t	fixedCtrl[256];
+	uint64_t	globalCtrl[256];
+	uint64_t	mperf[256], aperf[256];
+	double		temperature[256];
+	bool		thermalLog[256];
+	bool		thermalValid, hot;
+	Transition	cur, prev;
+	bool		pending;
+	uint16_t	pendingCtl;
+	uint64_t	pendingTime;
+	std::map<uint32_t, uint64_t> regs;	// everything else
+};
+
+#endif // _SIMULATEDCPU_H
@@ -0,0 +1,205 @@
+#include "Trace.h"
+
+/* Small deterministic generator, so synthesized traces are the same everywhere */
+static uint32_t nextRandom(uint64_t* state) {
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (uint32_t) (*state >> 33);
+}
+
+static uint32_t randomBetween(uint64_t* state, uint32_t lo, uint32_t hi) {
+	return lo + nextRandom(state) % (hi - lo + 1);
+}
+
+void LoadTrace::append(uint32_t ms, const std::vector<uint16_t>& demand) {
+	if (ms == 0) return;
+	TraceRecord r;
+	r.durationMS = ms;
+	r.demand = demand;
+	r.demand.resize(cpus, 0);
+	records.push_back(r);
+	durationMS += ms;
+}
+
+bool LoadTrace::load(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot open trace %s\n", path);
+		return false;
+	}
+	char line[4096];
+	int lineno = 0;
+	name = path;
+	cpus = 0; durationMS = 0; records.clear();
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\0') continue;
+		if (!strncmp(p, "cpus", 4)) {
+			cpus = atoi(p + 4);
+			if (cpus < 1 || cpus > 256) break;
+			continue;
+		}
+		if (cpus == 0) {
+			fprintf(stderr, "%s:%d: record before \"cpus\" line\n", path, lineno);
+			fclose(f);
+			return false;
+		}
+		char* end;
+		uint32_t ms = strtoul(p, &end, 10);
+		std::vector<uint16_t> demand(cpus);
+		for (int c = 0; c < cpus; c++) {
+			unsigned long ticks[CPU_STATE_MAX], sum = 0;
+			for (int t = 0; t < CPU_STATE_MAX; t++) {
+				p = end;
+				ticks[t] = strtoul(p, &end, 10);
+				if (end == p) {
+					fprintf(stderr, "%s:%d: expected %d cpus x 4 tick counts\n", path, lineno, cpus);
+					fclose(f);
+					return false;
+				}
+				sum += ticks[t];
+			}
+			demand[c] = sum ? (1000 * (sum - ticks[CPU_STATE_IDLE])) / sum : 0;
+		}
+		append(ms, demand);
+	}
+	fclose(f);
+	if (cpus < 1 || cpus > 256 || records.empty()) {
+		fprintf(stderr, "%s: no usable records\n", path);
+		return false;
+	}
+	return true;
+}
+
+bool LoadTrace::save(const char* path) const {
+	FILE* f = fopen(path, "w");
+	if (!f) return false;
+	fprintf(f, "# %s\ncpus %d\n", name.c_str(), cpus);
+	for (size_t i = 0; i < records.size(); i++) {
+		fprintf(f, "%u", records[i].durationMS);
+		// permille as ticks keeps the ratio exact
+		for (int c = 0; c < cpus; c++)
+			fprintf(f, "  %u 0 %u 0", records[i].demand[c], 1000 - records[i].demand[c]);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	return true;
+}
+
+bool LoadTrace::synthesize(const char* spec, uint32_t total, int ncpus) {
+	unsigned a = 0, b = 0, c = 0;
+	uint64_t seed;
+	name = spec;
+	cpus = ncpus; durationMS = 0; records.clear();
+	std::vector<uint16_t> d(cpus);
+
+	if (sscanf(spec, "steady:%u", &a) == 1) {
+		d.assign(cpus, a > 1000 ? 1000 : a);
+		append(total, d);
+	} else if (sscanf(spec, "burst:%u:%u:%u", &a, &b, &c) == 3 && a > 0 && b <= a) {
+		std::vector<uint16_t> busy(cpus, c > 1000 ? 1000 : c), idle(cpus, 10);
+		while (durationMS < total) {
+			append(b, busy);
+			append(a - b, idle);
+		}
+	} else if (sscanf(spec, "ramp:%u", &a) == 1 && a >= 40) {
+		while (durationMS < total) {
+			for (int step = 0; step < 40; step++) {
+				d.assign(cpus, 50 * (step < 20 ? step : 40 - step));
+				append(a / 40, d);
+			}
+		}
+	} else if (sscanf(spec, "mixed:%llu", (unsigned long long*) &seed) == 1) {
+		while (durationMS < total) {
+			uint32_t phase = randomBetween(&seed, 0, 99), length;
+			if (phase < 40) {		// idle with background noise
+				length = randomBetween(&seed, 500, 5000);
+				for (uint32_t t = 0; t < length; t += 100) {
+					for (int i = 0; i < cpus; i++) d[i] = randomBetween(&seed, 0, 60);
+					append(100, d);
+				}
+			} else if (phase < 70) {	// typing: short spikes on one cpu
+				length = randomBetween(&seed, 1000, 6000);
+				for (uint32_t t = 0; t < length; ) {
+					uint32_t spike = randomBetween(&seed, 10, 60), gap = randomBetween(&seed, 80, 400);
+					d.assign(cpus, 20); d[0] = randomBetween(&seed, 600, 1000);
+					append(spike, d);
+					d[0] = 20;
+					append(gap, d);
+					t += spike + gap;
+				}
+			} else if (phase < 90) {	// page load: a few hundred ms of heavy work
+				length = randomBetween(&seed, 200, 1500);
+				for (int i = 0; i < cpus; i++) d[i] = randomBetween(&seed, 500, 1000);
+				append(length, d);
+			} else {			// build: everything busy for seconds
+				length = randomBetween(&seed, 3000, 15000);
+				for (uint32_t t = 0; t < length; t += 250) {
+					for (int i = 0; i < cpus; i++) d[i] = randomBetween(&seed, 850, 1000);
+					append(250, d);
+				}
+			}
+		}
+	} else {
+		fprintf(stderr, "Unknown trace spec \"%s\"\n", spec);
+		return false;
+	}
+	return true;
+}
+
+bool LoadTrace::open(const char* source, uint32_t total, int ncpus) {
+	if (strchr(source, ':') && !strchr(source, '/'))
+		return synthesize(source, total, ncpus);
+	return load(source);
+}
+
+uint16_t TraceCursor::demand(uint64_t ms, int cpu) {
+	while (index < trace.records.size() && ms >= recordStart + trace.records[index].durationMS) {
+		recordStart += trace.records[index].durationMS;
+		index++;
+	}
+	if (index >= trace.records.size() || cpu >= trace.cpus) return 0;
+	return trace.records[index].demand[cpu];
+}
+
+bool TemperatureTrace::load(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot open temperature trace %s\n", path);
+		return false;
+	}
+	char line[256];
+	int lineno = 0;
+	name = path;
+	samples.clear();
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\0') continue;
+		TemperatureSample s;
+		if (sscanf(p, "%u %u %d", &s.intervalMS, &s.powerMW, &s.tempC) != 3) {
+			fprintf(stderr, "%s:%d: expected <interval ms> <mW> <C>\n", path, lineno);
+			fclose(f);
+			return false;
+		}
+		samples.push_back(s);
+	}
+	fclose(f);
+	if (samples.empty()) {
+		fprintf(stderr, "%s: no samples\n", path);
+		return false;
+	}
+	return true;
+}
+
+bool TemperatureTrace::save(const char* path) const {
+	FILE* f = fopen(path, "w");
+	if (!f) return false;
+	fprintf(f, "# %s\n", name.c_str());
+	for (size_t i = 0; i < samples.size(); i++)
+		fprintf(f, "%u %u %d\n", samples[i].intervalMS, samples[i].powerMW, samples[i].tempC);
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,95 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <vector>
+#include <string>
+
+#include "HostKernel.h"
+
+/*
+ * A recorded CPU load trace: per-CPU processor_cpu_load_info tick deltas,
+ * taken while the machine ran at P0. Stored as text, one record per line:
+ *
+ *	# comment
+ *	cpus <n>
+ *	<duration ms> <user> <system> <idle> <nice>  (repeated for each cpu)
+ *
+ * Demand is kept as the busy share of each CPU in permille of P0 capacity.
+ */
+struct TraceRecord {
+	uint32_t		durationMS;
+	std::vector<uint16_t>	demand;		// permille, one per cpu
+};
+
+class LoadTrace {
+public:
+	LoadTrace() : cpus(0), durationMS(0) {}
+
+	bool	load(const char* path);
+	bool	save(const char* path) const;
+
+	/*
+	 * Builds a trace from a spec instead of a file:
+	 *	steady:<permille>
+	 *	burst:<period ms>:<busy ms>:<permille>
+	 *	ramp:<period ms>		idle to full and back
+	 *	mixed:<seed>			idle, typing, page loads and builds
+	 */
+	bool	synthesize(const char* spec, uint32_t durationMS, int cpus);
+
+	/* A file path or a synthesize() spec */
+	bool	open(const char* source, uint32_t durationMS, int cpus);
+
+	void	append(uint32_t ms, const std::vector<uint16_t>& demand);
+
+	std::string		name;
+	int			cpus;
+	uint64_t		durationMS;
+	std::vector<TraceRecord> records;
+};
+
+/*
+ * Sequential access to a trace by time
+ */
+class TraceCursor {
+public:
+	TraceCursor(const LoadTrace& t) : trace(t), index(0), recordStart(0) {}
+
+	/* Demand of the given cpu at ms, which must not go backwards */
+	uint16_t demand(uint64_t ms, int cpu);
+
+private:
+	const LoadTrace&	trace;
+	size_t			index;
+	uint64_t		recordStart;
+};
+
+/*
+ * A recorded temperature trace: what the thermal model is fed at every
+ * sample, the interval since the previous one, the power drawn over it
+ * as costed from _PSS, and the hottest core at its end (whole degrees,
+ * like the DTS reads). Text, one sample per line:
+ *
+ *	# comment
+ *	<interval ms> <mW> <C>
+ *
+ * replay -W records them from the thermal stand-in; on a Mac, a logger
+ * polling kern.cputhrottle_thermal_model writes the time since its last
+ * poll in front of the first two fields.
+ */
+struct TemperatureSample {
+	uint32_t	intervalMS;
+	uint32_t	powerMW;
+	int		tempC;
+};
+
+class TemperatureTrace {
+public:
+	bool	load(const char* path);
+	bool	save(const char* path) const;
+
+	std::string			name;
+	std::vector<TemperatureSample>	samples;
+};
+
+#endif // _TRACE_H
@@ -0,0 +1,64 @@
+#include <sched.h>
+#include <unistd.h>
+
+#include "WorkPool.h"
+
+WorkStealingPool::WorkStealingPool(int threads) : nthreads(threads < 1 ? 1 : threads), stolen(0) {
+	for (int i = 0; i < nthreads; i++)
+		workers.push_back(new Worker);
+}
+
+int WorkStealingPool::hardwareThreads() {
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		return CPU_COUNT(&set);
+#endif
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+bool WorkStealingPool::next(int self, size_t* index) {
+	{
+		std::lock_guard<std::mutex> guard(workers[self]->lock);
+		if (!workers[self]->jobs.empty()) {
+			*index = workers[self]->jobs.back();
+			workers[self]->jobs.pop_back();
+			return true;
+		}
+	}
+	// Own deque is empty, go steal the oldest job of someone else
+	for (int i = 1; i < nthreads; i++) {
+		Worker* victim = workers[(self + i) % nthreads];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if (!victim->jobs.empty()) {
+			*index = victim->jobs.front();
+			victim->jobs.pop_front();
+			__atomic_fetch_add(&stolen, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::work(int self, Job job, void* context) {
+	size_t index;
+	while (next(self, &index))
+		job(context, index);
+}
+
+void WorkStealingPool::run(size_t count, Job job, void* context) {
+	// Contiguous blocks, pushed so the owner works through its block front to back
+	for (int w = 0; w < nthreads; w++) {
+		size_t begin = count * w / nthreads, end = count * (w + 1) / nthreads;
+		for (size_t i = end; i > begin; i--)
+			workers[w]->jobs.push_back(i - 1);
+	}
+
+	std::vector<std::thread> running;
+	for (int w = 1; w < nthreads; w++)
+		running.push_back(std::thread(&WorkStealingPool::work, this, w, job, context));
+	work(0, job, context);
+	for (size_t i = 0; i < running.size(); i++)
+		running[i].join();
+}
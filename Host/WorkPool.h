@@ -0,0 +1,46 @@
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A work-stealing thread pool for lots of small independent jobs.
+ *
+ * The index range is dealt out in contiguous blocks, one deque per worker.
+ * Workers take from the back of their own deque and, once it runs dry, steal
+ * from the front of a victim's, so a worker that got the slow jobs doesn't
+ * hold everyone up and nobody contends on a shared queue.
+ */
+class WorkStealingPool {
+public:
+	typedef void (*Job)(void* context, size_t index);
+
+	WorkStealingPool(int threads);
+
+	/* Runs job(context, i) for every i in [0, count) and waits for all of them */
+	void	run(size_t count, Job job, void* context);
+
+	int	threads() const { return nthreads; }
+	size_t	steals() const	{ return stolen; }
+
+	/* Number of CPUs available to this process */
+	static int hardwareThreads();
+
+private:
+	struct Worker {
+		std::mutex		lock;
+		std::deque<size_t>	jobs;
+	};
+
+	bool	next(int self, size_t* index);
+	void	work(int self, Job job, void* context);
+
+	int			nthreads;
+	size_t			stolen;
+	std::vector<Worker*>	workers;
+};
+
+#endif // _WORKPOOL_H
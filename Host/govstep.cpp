@@ -0,0 +1,164 @@
+/*
+ * govstep - step response of every auto-throttle governor against a simple
+ * load plant, each driven through the same Governor interface the kext uses.
+ *
+ * The plant is a fixed amount of work per ms (permille of what P0 can do),
+ * so the load the throttler sees is demand * P0 MHz / current MHz, capped at
+ * 100%. For every from:to demand step the controller first settles on the
+ * old demand, then the step is applied and the response is recorded:
+ *   settle	time until the last change of P-State
+ *   overshoot	furthest the frequency went past where it ended up, in % of the step
+ *   switches	P-State changes after the step
+ */
+#include <unistd.h>
+#include <vector>
+
+#include "HostSetup.h"
+#include "ThrottleController.h"
+#include "Utility.h"
+
+struct Step {
+	unsigned	from, to;	// permille of P0
+};
+
+struct Response {
+	uint32_t	settleMS;
+	double		overshoot;	// % of the step
+	int		switches;
+	int		finalMHz;
+	int		finalLoad;	// % x 10
+};
+
+static uint32_t noiseState = 1;
+
+/* Plant: load seen over one sampling interval at the given state, +- noise permille */
+static long plantLoad(unsigned demand, int pstate, unsigned noise) {
+	long load = (long) demand * PStates[0].AcpiFreq / PStates[pstate].AcpiFreq;
+	if (noise) {
+		noiseState = noiseState * 1103515245 + 12345;
+		load += (long) ((noiseState >> 16) % (2 * noise + 1)) - noise;
+	}
+	return load < 0 ? 0 : (load > 1000 ? 1000 : load);
+}
+
+/* Runs the controller on constant demand for a while, recording the state at each event */
+static void run(ThrottleController* c, IOTimerEventSource* timer, unsigned demand, uint32_t ms, unsigned noise,
+		std::vector<uint32_t>* times, std::vector<int>* states, std::vector<long>* loads) {
+	uint64_t start = hostUptimeNS(), end = start + ms * 1000000ULL;
+	while (hostUptimeNS() < end) {
+		uint64_t wait = timer->deadline > hostUptimeNS() ? timer->deadline - hostUptimeNS() : 0;
+		hostAdvanceNS(wait);
+		long load = plantLoad(demand, c->currentPState, noise);
+		c->timerEvent(1000 - load, 1000, timer);
+		if (times) {
+			times->push_back((hostUptimeNS() - start) / 1000000);
+			states->push_back(c->currentPState);
+			loads->push_back(load);
+		}
+	}
+}
+
+static Response stepResponse(ThrottleController* c, const Step& s, uint32_t settleMS, unsigned noise) {
+	IOTimerEventSource timer;
+	std::vector<uint32_t> times;
+	std::vector<int> states;
+	std::vector<long> loads;
+	Response r = Response();
+
+	c->reset();
+	timer.setTimeoutMS(c->quantumMS);
+	run(c, &timer, s.from, settleMS, noise, 0, 0, 0);
+	int initial = c->currentPState, initialMHz = PStates[initial].AcpiFreq;
+	run(c, &timer, s.to, settleMS, noise, &times, &states, &loads);
+
+	r.finalMHz = PStates[states.back()].AcpiFreq;
+	r.finalLoad = loads.back();
+	int prev = initial, worst = 0;
+	for (size_t i = 0; i < states.size(); i++) {
+		int mhz = PStates[states[i]].AcpiFreq;
+		int past = r.finalMHz >= initialMHz ? mhz - r.finalMHz : r.finalMHz - mhz;
+		if (past > worst) worst = past;
+		if (states[i] != prev) {
+			r.switches++;
+			r.settleMS = times[i];
+		}
+		prev = states[i];
+	}
+	int span = abs(r.finalMHz - initialMHz);
+	r.overshoot = span ? 100.0 * worst / span : (worst ? 100.0 : 0.0);
+	return r;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: govstep [-p MHz:mV[:lat],...] [-l target%%] [-q quantum ms] [-k kp:ki:kd:filter[:deadband]]\n"
+			"               [-t from:to,...] [-N noise permille] [-d settle ms] [-g governor,...]\n"
+			"  -k sets the pid governor's gains in 1/256, demand is in permille of P0, e.g. -k 32:160:16:96:50 -t 100:300,300:100\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	const char* table = 0;
+	const char* steps = "100:300,300:100,100:600,600:150,200:350";
+	const char* only = 0;
+	unsigned target = 40, quantum = throttleQuantum, noise = 0, settle = 10000;
+	PIDController gains;
+	gains.setDefaults();
+	int ch;
+
+	while ((ch = getopt(argc, argv, "p:l:q:k:t:N:d:g:")) != -1) {
+		switch (ch) {
+			case 'p': table = optarg; break;
+			case 'l': target = atoi(optarg); break;
+			case 'q': quantum = atoi(optarg); break;
+			case 'k':
+				if (sscanf(optarg, "%d:%d:%d:%d:%d", &gains.kp, &gains.ki, &gains.kd, &gains.dFilter, &gains.deadband) < 4) usage();
+				break;
+			case 't': steps = optarg; break;
+			case 'N': noise = atoi(optarg); break;
+			case 'd': settle = atoi(optarg); break;
+			case 'g': only = optarg; break;
+			default: usage();
+		}
+	}
+	if (target < 1 || target > 95 || quantum < 1) usage();
+
+	std::vector<Step> list;
+	for (const char* p = steps; *p; ) {
+		Step s;
+		int used;
+		if (sscanf(p, "%u:%u%n", &s.from, &s.to, &used) != 2) usage();
+		list.push_back(s);
+		p += used;
+		if (*p == ',') p++;
+	}
+
+	HostVirtualClock = true;
+	SimulatedCPU cpu(SimulatedCPU::MacBookAirRevA());
+	if (!hostSetupDriver(&cpu, table)) return 1;
+
+	ThrottleController c = ThrottleController();
+	std::vector<int> governors;
+	for (int g = 0; g < numberOfGovernors; g++)
+		if (!only || strstr(only, c.governor(g)->name()))
+			governors.push_back(g);
+
+	printf("target %u%%, quantum %u ms, pid gains kp %d ki %d kd %d filter %d (/256), deadband %d.%d%%\n\n",
+	       target, quantum, gains.kp, gains.ki, gains.kd, gains.dFilter, gains.deadband / 10, gains.deadband % 10);
+	printf("%11s  %-13s %8s %9s %8s %5s\n", "step", "governor", "settle", "overshoot", "switches", "MHz");
+
+	for (size_t i = 0; i < list.size(); i++) {
+		for (size_t g = 0; g < governors.size(); g++) {
+			c = ThrottleController();
+			c.setDefaults();
+			c.targetCPULoad = target * 10;
+			c.quantumMS = quantum;
+			(PIDController&) c.pid = gains;
+			c.selectGovernor(governors[g]);
+			noiseState = 1;
+			Response r = stepResponse(&c, list[i], settle, noise);
+			printf("%5u->%-5u  %-13s %5u ms %8.0f%% %8d %5d\n", list[i].from, list[i].to,
+			       c.governor(governors[g])->name(), r.settleMS, r.overshoot, r.switches, r.finalMHz);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * loadagg - feeds tick sequences through CPULoadTracker and LoadAggregator
+ * the way ThrottleController::sample() does, and prints what every
+ * reduction makes of them: the load of the sample, and the short and long
+ * averages.
+ *
+ * A sequence is a list of samples, each a comma separated list of per-CPU
+ * busy percentages with an optional xN repeat count; a sample is 100 ticks,
+ * so every percent is a tick. The CPUs run at P0 throughout, so load and
+ * demand are the same number.
+ *
+ * Without arguments it prints the built in examples and then checks what the
+ * aggregator makes of a few known sequences against worked out values; the
+ * exit status is 1 if any of them is off.
+ */
+#include <math.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ThrottleController.h"
+#include "Utility.h"
+#include "Checks.h"
+
+struct Sample {
+	std::vector<unsigned>	busy;	// percent per CPU
+	unsigned		repeat;
+};
+
+/* What every reduction made of one sample, permille */
+struct Row {
+	long	now[numberOfReductions];
+	long	shortAvg[numberOfReductions];
+	long	longAvg[numberOfReductions];
+};
+
+static const char* reductionNames[numberOfReductions] = { "max", "mean", "sum", "second" };
+
+/* Built in: a step, a single spike, one hog among idle CPUs */
+static const char* examples[] = {
+	"0,20x5 100,20x20 0,20x10",
+	"5,5x5 100,5 5,5x10",
+	"100,10,10,10x10 10,10,10,10x10",
+};
+
+static void usage() {
+	fprintf(stderr, "usage: loadagg [-s short shift] [-l long shift] [sample[xN] ...]\n"
+			"  e.g. loadagg 0,20x5 100,20x20 runs 2 cpus at 0%% and 20%% for 5 samples, then 100%% and 20%% for 20\n");
+	exit(1);
+}
+
+static bool parse(const char* arg, Sample* s) {
+	s->busy.clear();
+	s->repeat = 1;
+	while (*arg) {
+		char* end;
+		unsigned long v = strtoul(arg, &end, 10);
+		if (end == arg || v > 100) return false;
+		s->busy.push_back(v);
+		arg = end;
+		if (*arg == ',') arg++;
+		else if (*arg == 'x') {
+			s->repeat = strtoul(arg + 1, &end, 10);
+			if (!s->repeat || *end) return false;
+			break;
+		} else if (*arg) return false;
+	}
+	return !s->busy.empty() && s->busy.size() <= max_cpus;
+}
+
+static std::vector<Sample> sequence(const char* text) {
+	std::vector<Sample> seq;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%s", text);
+	for (char* tok = strtok(buf, " "); tok; tok = strtok(0, " ")) {
+		Sample s;
+		parse(tok, &s);
+		seq.push_back(s);
+	}
+	return seq;
+}
+
+static std::vector<Row> run(const std::vector<Sample>& seq, uint8_t shortShift, uint8_t longShift, bool print = true) {
+	int cpus = 0;
+	for (size_t i = 0; i < seq.size(); i++)
+		if ((int) seq[i].busy.size() > cpus) cpus = seq[i].busy.size();
+
+	CPULoadTracker ticks;
+	LoadAggregator agg[numberOfReductions];
+	processor_cpu_load_info load[max_cpus];
+	bzero(load, sizeof(load));
+	ticks.reset();
+	for (int r = 0; r < numberOfReductions; r++) {
+		agg[r].setDefaults();
+		agg[r].reduction = r;
+		agg[r].shortShift = shortShift;
+		agg[r].longShift = longShift;
+		agg[r].reset();
+	}
+
+	if (print) {
+		printf("%6s  %-*s", "sample", 4 * cpus, "busy %");
+		for (int r = 0; r < numberOfReductions; r++)
+			printf("  %-6s now short  long", reductionNames[r]);
+		printf("\n");
+	}
+
+	// Prime the tracker so the first printed sample is a full interval
+	long idle, total;
+	ticks.update(load, cpus, &idle, &total);
+
+	std::vector<Row> rows;
+	int n = 0;
+	for (size_t i = 0; i < seq.size(); i++) {
+		for (unsigned k = 0; k < seq[i].repeat; k++, n++) {
+			for (int c = 0; c < cpus; c++) {
+				unsigned busy = c < (int) seq[i].busy.size() ? seq[i].busy[c] : 0;
+				load[c].cpu_ticks[CPU_STATE_USER] += busy;
+				load[c].cpu_ticks[CPU_STATE_IDLE] += 100 - busy;
+			}
+			ticks.update(load, cpus, &idle, &total);
+
+			long perCPU[max_cpus];
+			for (int c = 0; c < cpus; c++)
+				perCPU[c] = ticks.load(c);
+			Row row;
+			for (int r = 0; r < numberOfReductions; r++) {
+				agg[r].update(perCPU, cpus);
+				row.now[r] = agg[r].reduce(perCPU, cpus);
+				row.shortAvg[r] = agg[r].shortDemand();
+				row.longAvg[r] = agg[r].longDemand();
+			}
+			rows.push_back(row);
+			if (!print) continue;
+
+			printf("%6d  ", n);
+			for (int c = 0; c < cpus; c++)
+				printf("%4ld", perCPU[c] / 10);
+			for (int r = 0; r < numberOfReductions; r++)
+				printf("  %6s %3ld %5.1f %5.1f", "", row.now[r] / 10, row.shortAvg[r] / 10.0, row.longAvg[r] / 10.0);
+			printf("\n");
+		}
+	}
+	return rows;
+}
+
+/*
+ * An average that moves 1/2^shift of the way per sample is
+ * to + (from - to) * (1 - 1/2^shift)^n after n samples. The aggregator does
+ * it in fixed point, which may leave it a permille or two behind.
+ */
+static bool near(long got, double from, double to, uint8_t shift, int n) {
+	return fabs(got - (to + (from - to) * pow(1 - 1.0 / (1 << shift), n))) <= 2;
+}
+
+static void aggregatorChecks(uint8_t shortShift, uint8_t longShift) {
+	char what[128];
+
+	// One sample: every reduction of the same per-CPU loads
+	Row r = run(sequence("100,10,30,20"), shortShift, longShift, false).back();
+	check(r.now[reduceMax] == 1000, "max of 100,10,30,20 is 100%");
+	check(r.now[reduceMean] == 400, "mean of 100,10,30,20 is 40%");
+	check(r.now[reduceSum] == 1000, "sum of 100,10,30,20 is capped at 100%");
+	check(r.now[reduceSecond] == 300, "second highest of 100,10,30,20 is 30%");
+	r = run(sequence("10,20,30"), shortShift, longShift, false).back();
+	check(r.now[reduceSum] == 600, "sum of 10,20,30 is 60%");
+	r = run(sequence("70"), shortShift, longShift, false).back();
+	check(r.now[reduceSecond] == 700, "second highest of a single CPU is that CPU");
+
+	// A step from idle to flat out: both averages start from the first sample
+	std::vector<Row> rows = run(sequence("0x5 100x20"), shortShift, longShift, false);
+	bool primed = true, shortOk = true, longOk = true;
+	for (int n = 0; n < 5; n++)
+		primed &= rows[n].shortAvg[reduceMax] == 0 && rows[n].longAvg[reduceMax] == 0;
+	for (int n = 1; n <= 20; n++) {
+		shortOk &= near(rows[4 + n].shortAvg[reduceMax], 0, 1000, shortShift, n);
+		longOk &= near(rows[4 + n].longAvg[reduceMax], 0, 1000, longShift, n);
+	}
+	check(primed, "step: both averages start at the idle load");
+	snprintf(what, sizeof(what), "step: short average moves 1/%u of the way to 100%% per sample", 1 << shortShift);
+	check(shortOk, what);
+	snprintf(what, sizeof(what), "step: long average moves 1/%u of the way to 100%% per sample", 1 << longShift);
+	check(longOk, what);
+
+	// A single spike on a 5% load, then back to 5% for 10 samples
+	rows = run(sequence("5x5 100 5x10"), shortShift, longShift, false);
+	check(rows[5].now[reduceMax] == 1000 && near(rows[5].shortAvg[reduceMax], 50, 1000, shortShift, 1) &&
+	      near(rows[5].longAvg[reduceMax], 50, 1000, longShift, 1), "spike: lifts each average by its share of it");
+	double shortPeak = rows[5].shortAvg[reduceMax], longPeak = rows[5].longAvg[reduceMax];
+	check(near(rows[15].shortAvg[reduceMax], shortPeak, 50, shortShift, 10) &&
+	      near(rows[15].longAvg[reduceMax], longPeak, 50, longShift, 10), "spike: and both decay back towards 5%");
+
+	// One hog among three 10% CPUs: the reductions apply to the per-CPU averages
+	rows = run(sequence("100,10,10,10x10 10,10,10,10x10"), shortShift, longShift, false);
+	r = rows[9];
+	check(r.shortAvg[reduceMax] == 1000 && r.longAvg[reduceMax] == 1000 &&
+	      r.shortAvg[reduceMean] == 325 && r.longAvg[reduceMean] == 325 &&
+	      r.shortAvg[reduceSum] == 1000 && r.shortAvg[reduceSecond] == 100 && r.longAvg[reduceSecond] == 100,
+	      "hog: steady averages are 100%, 32.5%, 100% and 10% by max, mean, sum and second highest");
+	r = rows[19];
+	long hogShort = r.shortAvg[reduceMax], hogLong = r.longAvg[reduceMax];
+	check(near(hogShort, 1000, 100, shortShift, 10) && near(hogLong, 1000, 100, longShift, 10),
+	      "hog gone: max follows the former hog's averages down to 10%");
+	check(labs(r.shortAvg[reduceMean] - (hogShort + 300) / 4) <= 1 && labs(r.longAvg[reduceMean] - (hogLong + 300) / 4) <= 1,
+	      "hog gone: mean is the mean of the per-CPU averages");
+	check(r.longAvg[reduceSum] == (hogLong + 300 < 1000 ? hogLong + 300 : 1000) && r.longAvg[reduceSecond] == 100 &&
+	      r.now[reduceMax] == 100 && r.now[reduceSum] == 400,
+	      "hog gone: sum and second highest of the averages, 10% and 40% now");
+}
+
+int main(int argc, char** argv) {
+	unsigned shortShift = defaultShortShift, longShift = defaultLongShift;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s:l:")) != -1) {
+		switch (ch) {
+			case 's': shortShift = atoi(optarg); break;
+			case 'l': longShift = atoi(optarg); break;
+			default: usage();
+		}
+	}
+	if (shortShift < 1 || shortShift > 8 || longShift < 1 || longShift > 8) usage();
+
+	std::vector<std::vector<Sample> > runs;
+	if (optind < argc) {
+		runs.resize(1);
+		for (int i = optind; i < argc; i++) {
+			Sample s;
+			if (!parse(argv[i], &s)) usage();
+			runs[0].push_back(s);
+		}
+	} else {
+		for (size_t e = 0; e < sizeof(examples) / sizeof(examples[0]); e++)
+			runs.push_back(sequence(examples[e]));
+	}
+
+	printf("short average 1/%u, long 1/%u per sample\n", 1 << shortShift, 1 << longShift);
+	for (size_t i = 0; i < runs.size(); i++) {
+		printf("\n");
+		run(runs[i], shortShift, longShift);
+	}
+	if (optind < argc) return 0;
+
+	printf("\n");
+	aggregatorChecks(shortShift, longShift);
+	return checkSummary();
+}
@@ -0,0 +1,88 @@
+/*
+ * msrbench - cost of every P-State transition in the table against the
+ * simulated CPU.
+ *
+ * For each from -> to pair it reports the simulated time until PERF_STS
+ * shows the new FID/VID (this includes the IODelay in throttleAllCPUs),
+ * the time the cores were halted for PLL relock, and how long the host
+ * needs to run throttleAllCPUs itself.
+ */
+#include <time.h>
+#include <unistd.h>
+
+#include "HostSetup.h"
+#include "Utility.h"
+
+static uint64_t wallNS() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Poll PERF_STS in 100 ns steps until it reports the wanted FID */
+static uint64_t waitForFID(uint8_t fid, uint64_t limitNS) {
+	uint64_t start = hostUptimeNS();
+	while (FID(MSR->read(INTEL_MSR_PERF_STS)) != fid && hostUptimeNS() - start < limitNS)
+		hostAdvanceNS(100);
+	return hostUptimeNS() - start;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: msrbench [-c air|penryn] [-p MHz:mV[:lat],...] [-n iterations] [-d]\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	SimulatedCPU::Model model = SimulatedCPU::MacBookAirRevA();
+	const char* table = 0;
+	int iterations = 100000, ch;
+
+	while ((ch = getopt(argc, argv, "c:p:n:d")) != -1) {
+		switch (ch) {
+			case 'c':
+				if (!strcmp(optarg, "penryn"))	model = SimulatedCPU::PenrynP8600();
+				else if (strcmp(optarg, "air"))	usage();
+				break;
+			case 'p': table = optarg; break;
+			case 'n': iterations = atoi(optarg); break;
+			case 'd': DebugOn = true; break;
+			default: usage();
+		}
+	}
+
+	HostVirtualClock = true;
+	SimulatedCPU cpu(model);
+	if (!hostSetupDriver(&cpu, table)) return 1;
+
+	printf("%s, %d cores, FSB %llu MHz, %d P-States\n\n", model.name, model.cores,
+	       (unsigned long long) (FSB / 1000000ULL), NumberOfPStates);
+
+	printf("Settle time until PERF_STS shows the new state (usec, incl. IODelay)\n%8s", "from\\to");
+	for (int to = 0; to < NumberOfPStates; to++) printf("%8d", PStates[to].AcpiFreq);
+	printf("\n");
+	for (int from = 0; from < NumberOfPStates; from++) {
+		printf("%8d", PStates[from].AcpiFreq);
+		for (int to = 0; to < NumberOfPStates; to++) {
+			throttleAllCPUs(&PStates[from]);
+			hostAdvanceNS(1000000); // let it settle
+			uint64_t start = hostUptimeNS();
+			throttleAllCPUs(&PStates[to]);
+			waitForFID(PStates[to].Frequency, 1000000);
+			printf("%8.1f", (hostUptimeNS() - start) / 1000.0);
+		}
+		printf("\n");
+	}
+
+	hostAdvanceNS(1000000);
+	uint64_t transitions = cpu.transitions, halted = cpu.haltedNS;
+	uint64_t start = wallNS();
+	for (int i = 0; i < iterations; i++)
+		throttleAllCPUs(&PStates[i % NumberOfPStates]);
+	uint64_t elapsed = wallNS() - start;
+
+	printf("\n%d throttleAllCPUs calls: %.1f ns each on the host, %llu transitions, "
+	       "%.1f usec halted per transition\n", iterations, (double) elapsed / iterations,
+	       (unsigned long long) (cpu.transitions - transitions),
+	       cpu.transitions > transitions ? (cpu.haltedNS - halted) / 1000.0 / (cpu.transitions - transitions) : 0.0);
+	return 0;
+}
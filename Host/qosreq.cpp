@@ -0,0 +1,191 @@
+/*
+ * qosreq - checks the client floor/ceiling table (Source/QoSRequests.h) and
+ * how the auto-throttler clamps against it, on the virtual clock.
+ *
+ * The table checks cover overlapping holders from several owners,
+ * references, expiry, an owner going away and a full table. The controller
+ * checks run the proportional governor on a constant load (the load plant
+ * of govstep) with holders coming and going, and look at the P-State it
+ * picks. Every check prints a line; exits with 1 if any of them failed.
+ */
+#include <unistd.h>
+
+#include "Checks.h"
+#include "HostSetup.h"
+#include "ThrottleController.h"
+#include "Utility.h"
+
+static uint64_t ms(uint64_t n) { return n * 1000000ULL; }
+
+static void tableChecks() {
+	QoSRequests q;
+	const uintptr_t daemon = 1, batch = 2, other = 3;
+	q.reset();
+
+	printf("Table\n");
+	check(q.floor(0) == qosNone && q.ceiling(0) == qosNone && q.clamp(2, 0) == 2, "empty table leaves the state alone");
+	check(!q.add(daemon, qosNone, qosNone, 0, 0), "a request without limits is refused");
+	check(!q.add(daemon, NumberOfPStates, qosNone, 0, 0), "a floor past the table is refused");
+
+	uint32_t a = q.add(daemon, 2, qosNone, 0, 0), b = q.add(other, 1, qosNone, 0, 0);
+	check(a && b && a != b, "two owners get their own holders");
+	check(q.floor(0) == 1 && q.clamp(3, 0) == 1 && q.clamp(0, 0) == 0, "overlapping floors: the fastest one holds");
+	check(q.release(other, b) && q.floor(0) == 2, "releasing it falls back to the other floor");
+	check(!q.release(other, a), "an owner can't release someone else's handle");
+
+	uint32_t again = q.add(daemon, 2, qosNone, 0, 0);
+	check(again == a && q.holders() == 1, "the same request again takes a reference on the same holder");
+	check(q.release(daemon, a) && q.floor(0) == 2, "dropping one of two references keeps the floor");
+	check(q.release(daemon, a) && q.floor(0) == qosNone && !q.holders(), "dropping the last one frees the holder");
+	check(!q.release(daemon, a), "a freed handle is gone");
+
+	uint32_t c = q.add(batch, qosNone, 2, 0, 0), d = q.add(other, qosNone, 3, 0, 0);
+	check(c && d && q.ceiling(0) == 3 && q.clamp(0, 0) == 3, "overlapping ceilings: the slowest one holds");
+	uint32_t e = q.add(daemon, 1, qosNone, 0, 0);
+	check(e && q.clamp(0, 0) == 1 && q.clamp(3, 0) == 1, "a floor faster than a ceiling wins");
+
+	check(q.releaseOwner(other) == 1 && q.ceiling(0) == 2 && q.floor(0) == 1, "an owner going away takes only its holders");
+	check(q.releaseOwner(daemon) == 1 && q.releaseOwner(batch) == 1 && !q.holders(), "and everything it held");
+
+	printf("Expiry\n");
+	uint32_t t = q.add(daemon, 0, qosNone, 100, ms(1000));
+	check(t && q.floor(ms(1099)) == 0, "a timed floor holds until its time is up");
+	check(q.floor(ms(1100)) == qosNone && q.clamp(3, ms(1100)) == 3, "and not a moment longer");
+	check(q.add(daemon, 0, qosNone, 100, ms(1050)) == t && q.floor(ms(1100)) == 0 && q.floor(ms(1150)) == qosNone,
+	      "another reference extends it");
+	uint32_t fresh = q.add(daemon, 0, qosNone, 100, ms(1200));
+	check(fresh && fresh != t, "once expired the same request gets a new holder");
+	check(q.expire(ms(1200)) == 1 && q.holders() == 1, "expire() frees the old one only");
+	uint32_t forever = q.add(daemon, 0, qosNone, 0, ms(1250));
+	check(forever == fresh && q.floor(ms(100000)) == 0, "an untimed reference makes it untimed");
+	q.releaseOwner(daemon);
+
+	uint32_t shortOne = q.add(daemon, 3, qosNone, 50, 0), longOne = q.add(other, 1, qosNone, 200, 0);
+	check(shortOne && longOne && q.floor(ms(10)) == 1 && q.floor(ms(100)) == 1 && q.floor(ms(200)) == qosNone,
+	      "overlapping timed floors run out one after the other");
+	q.reset();
+
+	printf("Full table\n");
+	bool filled = true;
+	for (int i = 0; i < qosHolders; i++)
+		filled = filled && q.add(i + 10, 3, qosNone, i < 4 ? 10 : 0, 0);
+	check(filled && !q.add(daemon, 2, qosNone, 0, ms(5)), "no room once every holder is in use");
+	check(q.add(daemon, 2, qosNone, 0, ms(10)) != 0, "expired holders make room again");
+}
+
+/* Drives the controller on a constant load, like govstep's plant */
+static void run(ThrottleController* c, IOTimerEventSource* timer, unsigned demand, uint32_t forMS) {
+	uint64_t end = hostUptimeNS() + ms(forMS);
+	while (hostUptimeNS() < end) {
+		uint64_t wait = timer->deadline > hostUptimeNS() ? timer->deadline - hostUptimeNS() : 0;
+		hostAdvanceNS(wait);
+		long load = (long) demand * PStates[0].AcpiFreq / PStates[c->currentPState].AcpiFreq;
+		if (load > 1000) load = 1000;
+		c->timerEvent(1000 - load, 1000, timer);
+	}
+}
+
+static void controllerChecks() {
+	const uintptr_t daemon = 1, batch = 2;
+	char what[128];
+	ThrottleController c = ThrottleController();
+	IOTimerEventSource timer;
+	int slowest = NumberOfPStates - 1;
+	c.setDefaults();
+	c.reset();
+	timer.setTimeoutMS(c.quantumMS);
+
+	printf("Controller (%d P-States)\n", NumberOfPStates);
+	run(&c, &timer, 50, 3000);
+	snprintf(what, sizeof(what), "light load settles in the slowest state (P%d)", c.currentPState);
+	check(c.currentPState == slowest, what);
+
+	uint32_t floor = c.qos.add(daemon, 1, qosNone, 2000, hostUptimeNS());
+	check(c.applyLimits() && c.currentPState == 1, "a floor raises the speed right away");
+	run(&c, &timer, 50, 1500);
+	snprintf(what, sizeof(what), "and the governor stays at or above it (P%d, %llu samples clamped)",
+		 c.currentPState, (unsigned long long) c.qosClamped);
+	check(c.currentPState <= 1 && c.qosClamped > 0, what);
+	run(&c, &timer, 50, 3000);
+	snprintf(what, sizeof(what), "once it expires the governor goes back down (P%d)", c.currentPState);
+	check(c.currentPState == slowest && c.qos.holders() == 0, what);
+	check(!c.qos.release(daemon, floor), "an expired holder can't be released any more");
+
+	run(&c, &timer, 950, 2000);
+	check(c.currentPState == 0, "heavy load runs at P0");
+	uint32_t ceiling = c.qos.add(batch, qosNone, 2, 0, hostUptimeNS());
+	check(c.applyLimits() && c.currentPState == 2, "a ceiling slows it down right away");
+	run(&c, &timer, 950, 2000);
+	check(c.currentPState == 2, "and holds under full load");
+	floor = c.qos.add(daemon, 1, qosNone, 0, hostUptimeNS());
+	c.applyLimits();
+	run(&c, &timer, 950, 1000);
+	check(c.currentPState == 1, "a faster floor overrides the ceiling");
+	c.qos.releaseOwner(daemon);
+	run(&c, &timer, 950, 1000);
+	check(c.currentPState == 2, "the floor's owner going away leaves the ceiling");
+	c.qos.release(batch, ceiling);
+	run(&c, &timer, 950, 2000);
+	check(c.currentPState == 0, "releasing the ceiling lets it run at P0 again");
+
+	c.boostHoldMS = 300;
+	c.qos.add(batch, qosNone, 3, 0, hostUptimeNS());
+	c.applyLimits();
+	c.boost();
+	run(&c, &timer, 950, 100);
+	check(c.currentPState == 3, "a ceiling caps the boost as well");
+
+	// One change a second and no token left: changes wait in pendingPState
+	c.qos.releaseOwner(batch);
+	c.limiter.ratePerS = 1;
+	c.limiter.burst = 1;
+	c.limiter.reset();
+	c.limiter.take(hostUptimeNS());
+	c.qos.add(daemon, 0, qosNone, 500, hostUptimeNS());
+	c.applyLimits();
+	check(c.currentPState == 3 && c.deferredChanges == 1, "without a token a floor's change waits");
+	c.qos.add(batch, qosNone, 2, 0, hostUptimeNS());
+	hostAdvanceNS(ms(1100));
+	c.limiterEvent();
+	snprintf(what, sizeof(what), "and goes through within the limits as they are by then, floor expired and a ceiling added (P%d)",
+		 c.currentPState);
+	check(c.currentPState == 2, what);
+	c.limiter.take(hostUptimeNS());
+	c.qos.add(daemon, 0, qosNone, 0, hostUptimeNS());
+	c.applyLimits();
+	c.qos.releaseOwner(daemon);
+	c.applyLimits();
+	hostAdvanceNS(ms(1100));
+	c.limiterEvent();
+	check(c.currentPState == 2, "a floor released while its change waits takes the change with it");
+}
+
+static void usage() {
+	fprintf(stderr, "usage: qosreq [-p MHz:mV[:lat],...] [-v]\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	const char* table = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "p:v")) != -1) {
+		switch (ch) {
+			case 'p': table = optarg; break;
+			case 'v': DebugOn = true; break;
+			default: usage();
+		}
+	}
+
+	HostVirtualClock = true;
+	SimulatedCPU cpu(SimulatedCPU::MacBookAirRevA());
+	if (!hostSetupDriver(&cpu, table)) return 1;
+	if (NumberOfPStates < 4) {
+		fprintf(stderr, "Need at least 4 P-States\n");
+		return 1;
+	}
+
+	tableChecks();
+	controllerChecks();
+	return checkSummary();
+}
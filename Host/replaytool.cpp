@@ -0,0 +1,212 @@
+/*
+ * replay - runs a recorded (or synthesized) load trace through the
+ * auto-throttler on a virtual clock and reports what it did.
+ *
+ * -l, -q and -s take comma separated lists; every combination is replayed
+ * and summarized one per line, so settings can be compared directly.
+ */
+#include <unistd.h>
+
+#include "Replay.h"
+#include "Utility.h"
+
+static void usage() {
+	fprintf(stderr,
+		"usage: replay [-t trace|spec] [-d seconds] [-n cpus] [-c air|penryn] [-p MHz:mV[:lat[:mW]],...]\n"
+		"              [-l targetload%%,...] [-q quantum ms,...] [-s timeout scale,...]\n"
+		"              [-H up%%:down%%:dwell ms] [-g governor,...] [-r|-a] [-R reduction] [-x]\n"
+		"              [-T budget%%[:epoch s]] [-b pstate:hold ms] [-O flips[:window ms[:hold ms]]]\n"
+		"              [-L changes/s[:burst]] [-k air|R:C[:ambient]] [-K soft[:hard]] [-B limit[:boost ms]]\n"
+		"              [-m cpi:stall ns] [-i ipc] [-w save.trace] [-W save.temps] [-v]\n"
+		"  -r: full load while threads wait in the run queue (loadFromRunQueue)\n"
+		"  -a: load from C0 residency, MPERF / TSC (loadFromAPERF)\n"
+		"  -m: the work's CPI without stalls and its memory stall per instruction (default 1:0)\n"
+		"  -i: IPC under which a busy cpu is memory bound and capped, 0 = off (default 0.3)\n"
+		"  -R: per-CPU loads to one, max mean sum or second (default max)\n"
+		"  -T: tune the target load online, at most budget %% of the time saturated below P0\n"
+		"  -b: input at every load spike raises to the PStates[] index for hold ms\n"
+		"  -O: hold the fast end after flips changes alternating up and down, 0 = off (default 4:1200:2000)\n"
+		"  -L: at most burst P-State changes in a row, then changes/s, 0 = unlimited (default 10:10)\n"
+		"  -k: thermal stand-in, C/W and J/C from package to ambient (air = 4.5:6.7:35)\n"
+		"  -K: thermal cap from soft to hard degrees below TjMax, 0 = off (default 10:2)\n"
+		"  -B: thermal budget up to limit degrees below TjMax once the model is fitted, boosts of at least boost ms,\n"
+		"      0 = off (default 5:5000)\n"
+		"  -W: record what the thermal model was fed, for thermfit\n"
+		"  -x: don't skip transitions that cost more than they gain\n"
+		"  governors: proportional pid ondemand conservative markov energy race\n"
+		"  trace specs: steady:<permille> burst:<period>:<busy>:<permille> ramp:<period> mixed:<seed>\n");
+	exit(1);
+}
+
+static std::vector<unsigned> parseList(const char* s) {
+	std::vector<unsigned> v;
+	while (*s) {
+		v.push_back(strtoul(s, (char**) &s, 10));
+		if (*s == ',') s++;
+		else if (*s) usage();
+	}
+	return v;
+}
+
+static std::vector<const char*> parseNames(char* s) {
+	std::vector<const char*> v;
+	for (char* name = strtok(s, ","); name; name = strtok(0, ","))
+		v.push_back(name);
+	return v;
+}
+
+int main(int argc, char** argv) {
+	ReplayConfig cfg;
+	const char* source = "mixed:1";
+	const char* saveTo = 0;
+	const char* saveTempsTo = 0;
+	uint32_t seconds = 600;
+	int cpus = 2, ch;
+	std::vector<unsigned> loads(1, cfg.targetCPULoad / 10), quanta(1, cfg.quantumMS), scales(1, cfg.timeoutScale);
+	std::vector<const char*> governors(1, cfg.governor);
+
+	while ((ch = getopt(argc, argv, "t:d:n:c:p:l:q:s:H:g:raR:xm:i:T:b:O:L:k:K:B:w:W:v")) != -1) {
+		switch (ch) {
+			case 't': source = optarg; break;
+			case 'd': seconds = atoi(optarg); break;
+			case 'n': cpus = atoi(optarg); break;
+			case 'c':
+				if (!strcmp(optarg, "penryn"))	cfg.model = SimulatedCPU::PenrynP8600();
+				else if (strcmp(optarg, "air"))	usage();
+				break;
+			case 'p': cfg.pstates = optarg; break;
+			case 'l': loads = parseList(optarg); break;
+			case 'q': quanta = parseList(optarg); break;
+			case 's': scales = parseList(optarg); break;
+			case 'H': {
+				unsigned up, down, dwell;
+				if (sscanf(optarg, "%u:%u:%u", &up, &down, &dwell) != 3) usage();
+				cfg.upThreshold = up * 10; cfg.downThreshold = down * 10; cfg.minDwellMS = dwell;
+				break;
+			}
+			case 'g': governors = parseNames(optarg); break;
+			case 'm':
+				if (sscanf(optarg, "%lf:%lf", &cfg.coreCPI, &cfg.stallNS) != 2 || cfg.coreCPI <= 0) usage();
+				break;
+			case 'i': cfg.memBoundIPC = (uint16_t) (atof(optarg) * 1000); break;
+			case 'r': cfg.loadSource = loadFromRunQueue; break;
+			case 'a': cfg.loadSource = loadFromAPERF; break;
+			case 'R': {
+				const char* names[numberOfReductions] = { "max", "mean", "sum", "second" };
+				int i = 0;
+				while (i < numberOfReductions && strcmp(optarg, names[i])) i++;
+				if (i == numberOfReductions) usage();
+				cfg.reduction = i;
+				break;
+			}
+			case 'x': cfg.skipCostly = false; break;
+			case 'T': {
+				double budget;
+				unsigned epoch = cfg.tuner.epochMS / 1000;
+				if (sscanf(optarg, "%lf:%u", &budget, &epoch) < 1 || budget < 0 || !epoch) usage();
+				cfg.tuner.enabled = true;
+				cfg.tuner.missBudget = (uint16_t) (budget * 10);
+				cfg.tuner.epochMS = epoch * 1000;
+				break;
+			}
+			case 'b': {
+				unsigned pstate, hold;
+				if (sscanf(optarg, "%u:%u", &pstate, &hold) != 2 || pstate > 15) usage();
+				cfg.boostPState = pstate;
+				cfg.boostHoldMS = hold;
+				break;
+			}
+			case 'O': {
+				unsigned flips, window = cfg.damper.windowMS, hold = cfg.damper.holdMS;
+				if (sscanf(optarg, "%u:%u:%u", &flips, &window, &hold) < 1 || flips == 1 || flips > 255) usage();
+				cfg.damper.flips = flips;
+				cfg.damper.windowMS = window;
+				cfg.damper.holdMS = hold;
+				break;
+			}
+			case 'L': {
+				unsigned rate, burst = cfg.limiter.burst;
+				if (sscanf(optarg, "%u:%u", &rate, &burst) < 1 || rate > 65535 || burst < 1 || burst > 65535) usage();
+				cfg.limiter.ratePerS = rate;
+				cfg.limiter.burst = burst;
+				break;
+			}
+			case 'k': {
+				ThermalStandIn t = ThermalStandIn::MacBookAir();
+				if (strcmp(optarg, "air") && (sscanf(optarg, "%lf:%lf:%lf", &t.rCPerW, &t.cJPerC, &t.ambientC) < 2
+							      || t.rCPerW <= 0 || t.cJPerC <= 0))
+					usage();
+				cfg.thermal = t;
+				break;
+			}
+			case 'K': {
+				unsigned soft, hard = cfg.thermalHard;
+				if (sscanf(optarg, "%u:%u", &soft, &hard) < 1 || soft > 100 || (soft && hard >= soft)) usage();
+				cfg.thermalSoft = soft;
+				cfg.thermalHard = hard;
+				break;
+			}
+			case 'B': {
+				unsigned limit, boost = cfg.thermalBoostMinMS;
+				if (sscanf(optarg, "%u:%u", &limit, &boost) < 1 || limit > 100) usage();
+				cfg.thermalLimit = limit;
+				cfg.thermalBoostMinMS = boost;
+				break;
+			}
+			case 'w': saveTo = optarg; break;
+			case 'W': saveTempsTo = optarg; break;
+			case 'v': DebugOn = true; break;
+			default: usage();
+		}
+	}
+	if (cpus < 1 || cpus > 256 || loads.empty() || quanta.empty() || scales.empty() || governors.empty()) usage();
+
+	LoadTrace trace;
+	if (!trace.open(source, seconds * 1000, cpus)) return 1;
+	if (saveTo && !trace.save(saveTo)) {
+		fprintf(stderr, "Cannot write %s\n", saveTo);
+		return 1;
+	}
+
+	bool single = loads.size() == 1 && quanta.size() == 1 && scales.size() == 1 && governors.size() == 1;
+	TemperatureTrace temps;
+	if (saveTempsTo) {
+		if (!single || cfg.thermal.rCPerW <= 0) {
+			fprintf(stderr, "-W needs -k and a single run\n");
+			return 1;
+		}
+		temps.name = trace.name;
+		cfg.temperatures = &temps;
+	}
+	if (!single)
+		printf("%-13s %6s %8s %6s %10s %8s %12s %10s %10s %10s\n", "governor", "load%", "quantum", "scale", "energy J",
+		       "avg MHz", "transitions", "ramp ms", "ramp max", "missed ms");
+
+	for (size_t g = 0; g < governors.size(); g++) {
+		for (size_t l = 0; l < loads.size(); l++) {
+			for (size_t q = 0; q < quanta.size(); q++) {
+				for (size_t sc = 0; sc < scales.size(); sc++) {
+					ReplayResult r;
+					cfg.governor = governors[g];
+					cfg.targetCPULoad = loads[l] * 10;
+					cfg.quantumMS = quanta[q];
+					cfg.timeoutScale = scales[sc];
+					if (!runReplay(trace, cfg, &r)) return 1;
+					if (single) {
+						printReplayResult(stdout, trace, r);
+						if (saveTempsTo && !temps.save(saveTempsTo)) {
+							fprintf(stderr, "Cannot write %s\n", saveTempsTo);
+							return 1;
+						}
+						continue;
+					}
+					printf("%-13s %6u %8u %6u %10.2f %8.0f %12llu %10.1f %10.0f %10llu\n",
+					       governors[g], loads[l], quanta[q], scales[sc], r.energyJ, r.avgMHz,
+					       (unsigned long long) r.transitions, r.rampMeanMS, r.rampMaxMS,
+					       (unsigned long long) r.missedDemandMS);
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * rvbench - what throttleAllCPUs costs as the CPU count grows.
+ *
+ * Runs the real disableInterrupts/throttleCPU/enableInterrupts rendezvous
+ * against the simulated CPU, with one pinned thread per logical CPU (see
+ * Rendezvous.h), on the real clock. For 1, 2, 4 ... up to -m CPUs it reports
+ *   stall	 throttleAllCPUs from entry to return, i.e. rendezvous plus IODelay
+ *		 with Lock held
+ *   ipi	 until the last CPU entered the rendezvous
+ *   skew	 between the first and the last CPU starting its PERF_CTL write
+ *   ints off	 longest time a CPU had interrupts disabled
+ *
+ * Numbers are only meaningful while there are at least as many host CPUs as
+ * simulated ones; rows where the threads had to share are marked.
+ */
+#include <unistd.h>
+#include <algorithm>
+
+#include "HostSetup.h"
+#include "Rendezvous.h"
+#include "WorkPool.h"
+#include "Utility.h"
+
+struct Samples {
+	std::vector<uint64_t> ns;
+
+	void add(uint64_t v) { ns.push_back(v); }
+	double mean() const {
+		double sum = 0;
+		for (size_t i = 0; i < ns.size(); i++) sum += ns[i];
+		return ns.empty() ? 0 : sum / ns.size();
+	}
+	/* q in [0, 1]; sorts in place */
+	uint64_t quantile(double q) {
+		if (ns.empty()) return 0;
+		std::sort(ns.begin(), ns.end());
+		return ns[(size_t) (q * (ns.size() - 1))];
+	}
+};
+
+static void usage() {
+	fprintf(stderr, "usage: rvbench [-c air|penryn] [-p MHz:mV[:lat],...] [-n iterations] [-m max cpus] [-u]\n"
+			"  -u leaves the CPU threads unpinned\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	SimulatedCPU::Model model = SimulatedCPU::MacBookAirRevA();
+	const char* table = 0;
+	int iterations = 2000, maxCPUs = 64, ch;
+	bool pin = true;
+
+	while ((ch = getopt(argc, argv, "c:p:n:m:u")) != -1) {
+		switch (ch) {
+			case 'c':
+				if (!strcmp(optarg, "penryn"))	model = SimulatedCPU::PenrynP8600();
+				else if (strcmp(optarg, "air"))	usage();
+				break;
+			case 'p': table = optarg; break;
+			case 'n': iterations = atoi(optarg); break;
+			case 'm': maxCPUs = atoi(optarg); break;
+			case 'u': pin = false; break;
+			default: usage();
+		}
+	}
+	if (iterations < 1 || maxCPUs < 1 || maxCPUs > 256) usage();
+
+	HostVirtualClock = false;
+	printf("%s, %d host CPUs, %d rendezvous per row, %s threads\n\n", model.name,
+	       WorkStealingPool::hardwareThreads(), iterations, pin ? "pinned" : "unpinned");
+	printf("%5s %22s %22s %22s %22s\n", "", "stall usec", "ipi usec", "skew usec", "ints off usec");
+	printf("%5s", "cpus");
+	for (int i = 0; i < 4; i++) printf(" %7s %7s %6s", "mean", "p99", "max");
+	printf("\n");
+
+	std::vector<int> counts;
+	for (int n = 1; n < maxCPUs; n *= 2) counts.push_back(n);
+	counts.push_back(maxCPUs);
+
+	for (size_t c = 0; c < counts.size(); c++) {
+		int n = counts[c];
+		model.cores = n;
+		SimulatedCPU cpu(model);
+		if (!hostSetupDriver(&cpu, table)) return 1;
+
+		hostSetCPU(0);
+		ThreadedRendezvous rv(n, pin);
+		HostRendezvous = &rv;
+
+		Samples stall, ipi, skew, intsOff;
+		for (int i = -iterations / 10; i < iterations; i++) { // first tenth is warmup
+			PState* p = &PStates[(i & 1) ? NumberOfPStates - 1 : 0];
+			uint64_t start = hostUptimeNS();
+			throttleAllCPUs(p);
+			uint64_t end = hostUptimeNS();
+			if (i < 0) continue;
+
+			uint64_t firstAction = ~0ULL, lastAction = 0, lastArrive = 0, off = 0;
+			for (int k = 0; k < n; k++) {
+				const ThreadedRendezvous::Stamp& s = rv.stamp(k);
+				firstAction = s.action < firstAction ? s.action : firstAction;
+				lastAction  = s.action > lastAction  ? s.action : lastAction;
+				lastArrive  = s.arrive > lastArrive  ? s.arrive : lastArrive;
+				off = hostLastInterruptsOffNS(k) > off ? hostLastInterruptsOffNS(k) : off;
+			}
+			stall.add(end - start);
+			ipi.add(lastArrive - rv.posted());
+			skew.add(lastAction - firstAction);
+			intsOff.add(off);
+		}
+		HostRendezvous = 0;
+
+		Samples* all[] = { &stall, &ipi, &skew, &intsOff };
+		printf("%5d", n);
+		for (int i = 0; i < 4; i++)
+			printf(" %7.1f %7.1f %6.0f", all[i]->mean() / 1000.0, all[i]->quantile(0.99) / 1000.0,
+			       all[i]->quantile(1.0) / 1000.0);
+		printf("%s\n", rv.oversubscribed() ? "  (oversubscribed)" : "");
+	}
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * schedrun - runs an uploaded P-State schedule (Source/PStateSchedule.h)
+ * through ThrottleController::scheduleEvent() on the virtual clock and
+ * checks that every entry ran on time.
+ *
+ * The schedule timer wakes up late by a random 0..jitter usec, like a busy
+ * workloop would. After every wakeup PERF_CTL has to hold the entry that is
+ * due by then, and it has to have been switched no later than the jitter
+ * (plus the usec the timer rounds to) after its deadline. Because every
+ * deadline counts from the start the lateness must not grow over the rounds.
+ * For comparison the same schedule is also run the way a userspace loop of
+ * kern.cputhrottle_curfreq writes would: each wait starts after the previous
+ * switch is done, so the jitter and the transition time add up. Schedules
+ * with entries closer than a transition or a period under 1 ms have to be
+ * refused.
+ *
+ * Exits with 1 if any check fails.
+ */
+#include <unistd.h>
+#include <vector>
+
+#include "HostSetup.h"
+#include "ThrottleController.h"
+#include "Utility.h"
+
+static uint32_t jitterState = 1;
+
+static uint64_t jitterNS(uint32_t maxUS) {
+	if (!maxUS) return 0;
+	jitterState = jitterState * 1103515245 + 12345;
+	return (uint64_t) ((jitterState >> 8) % (maxUS * 1000 + 1));
+}
+
+static void usage() {
+	fprintf(stderr, "usage: schedrun [-c air|penryn] [-p MHz:mV[:lat],...] [-s schedule] [-r rounds] [-j jitter us] [-v]\n"
+			"  schedule: offset ms:pstate,...[@period ms], e.g. 0:0,0.5:3,2:1@20\n");
+	exit(1);
+}
+
+struct Expected {
+	uint64_t	deadlineNS;	// from the start
+	uint8_t		pstate;
+};
+
+int main(int argc, char** argv) {
+	SimulatedCPU::Model model = SimulatedCPU::MacBookAirRevA();
+	const char* table = 0;
+	const char* text = "0:0,0.5:3,2:1,2.25:2,10:0,12.5:3@20";
+	unsigned rounds = 50, jitterUS = 50;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:p:s:r:j:v")) != -1) {
+		switch (ch) {
+			case 'c':
+				if (!strcmp(optarg, "penryn"))	model = SimulatedCPU::PenrynP8600();
+				else if (strcmp(optarg, "air"))	usage();
+				break;
+			case 'p': table = optarg; break;
+			case 's': text = optarg; break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'j': jitterUS = atoi(optarg); break;
+			case 'v': DebugOn = true; break;
+			default: usage();
+		}
+	}
+	if (!rounds) usage();
+
+	HostVirtualClock = true;
+	SimulatedCPU cpu(model);
+	if (!hostSetupDriver(&cpu, table)) return 1;
+
+	unsigned wakeups = 0, failures = 0;
+	// Entries that would overtake each other, and periods that would swamp the workloop
+	const char* tooTight[] = { "0:0,0:3", "0:0,0.001:3", "0:0,0.001:3@0.002", "0:1@0.5", "0:0,19.999:3@20" };
+	for (size_t i = 0; i < sizeof(tooTight) / sizeof(tooTight[0]); i++) {
+		PStateSchedule s;
+		if (s.parse(tooTight[i])) {
+			printf("  schedule %s accepted\n", tooTight[i]);
+			failures++;
+		}
+	}
+
+	ThrottleController controller = ThrottleController();
+	controller.setDefaults();
+	controller.reset();
+	if (!controller.schedule.parse(text)) {
+		fprintf(stderr, "Bad schedule \"%s\" for %d P-States\n", text, NumberOfPStates);
+		return 1;
+	}
+	char printed[1024];
+	controller.schedule.print(printed, sizeof(printed));
+	uint32_t periodUS = controller.schedule.periodUS();
+	if (!periodUS) rounds = 1;
+
+	// What should happen, worked out independently of PStateSchedule
+	std::vector<Expected> expected;
+	for (unsigned r = 0; r < rounds; r++) {
+		const char* p = printed;
+		while (*p && *p != '@') {
+			double ms = strtod(p, (char**) &p);
+			Expected e = { (uint64_t) r * periodUS * 1000 + (uint64_t) (ms * 1000 + 0.5) * 1000,
+				       (uint8_t) strtoul(p + 1, (char**) &p, 10) };
+			expected.push_back(e);
+			if (*p == ',') p++;
+		}
+	}
+	uint64_t endNS = (uint64_t) rounds * periodUS * 1000;
+
+	printf("%s, %d P-States\nSchedule %s, %u round%s, timer late by up to %u usec\n\n", model.name, NumberOfPStates,
+	       printed, rounds, rounds == 1 ? "" : "s", jitterUS);
+
+	// The driver: absolute deadlines from PStateSchedule
+	IOTimerEventSource timer;
+	uint64_t start = hostUptimeNS(), wake = start;
+	size_t done = 0;
+	controller.startSchedule(&timer);
+	for (;;) {
+		// What is due by the time the timer woke up has to be in PERF_CTL now
+		uint64_t at = wake - start;
+		while (done < expected.size() && expected[done].deadlineNS <= at) done++;
+		if (done) {
+			const Expected& e = expected[done - 1];
+			uint64_t late = at - e.deadlineNS;
+			if (FID(MSR->read(INTEL_MSR_PERF_CTL)) != PStates[e.pstate].Frequency) {
+				printf("  at %.3f ms: PERF_CTL not at P%d\n", at / 1e6, e.pstate);
+				failures++;
+			}
+			if (late > jitterUS * 1000ULL + 1000) {
+				printf("  at %.3f ms: entry due at %.3f ms ran %.1f usec late\n", at / 1e6, e.deadlineNS / 1e6, late / 1e3);
+				failures++;
+			}
+		}
+		if (!timer.armed || (periodUS && timer.deadline - start >= endNS)) break;
+		wake = timer.deadline + jitterNS(jitterUS);
+		if (wake > hostUptimeNS()) hostAdvanceNS(wake - hostUptimeNS());
+		else wake = hostUptimeNS(); // still busy with the previous switch
+		timer.armed = false;
+		wakeups++;
+		controller.scheduleEvent(&timer);
+	}
+	if (done != expected.size()) {
+		printf("  only %zu of %zu entries came due\n", done, expected.size());
+		failures++;
+	}
+	controller.stopSchedule(&timer);
+
+	printf("Driver schedule:   %llu entries run, %llu overtaken, %u wakeups, late %.1f usec mean, %.1f max\n",
+	       (unsigned long long) controller.schedule.applied(), (unsigned long long) controller.schedule.skipped(),
+	       wakeups, controller.schedule.meanLateNS() / 1e3, controller.schedule.maxLateNS() / 1e3);
+
+	// A userspace loop: sleep until the next offset after the previous write returned
+	uint64_t chainStart = hostUptimeNS(), chainWorst = 0, chainSum = 0, chainLast = 0;
+	for (size_t i = 0; i < expected.size(); i++) {
+		uint64_t gap = i ? expected[i].deadlineNS - expected[i - 1].deadlineNS : 0;
+		hostAdvanceNS(gap + jitterNS(jitterUS));
+		uint64_t late = hostUptimeNS() - chainStart - expected[i].deadlineNS;
+		chainSum += late;
+		if (late > chainWorst) chainWorst = late;
+		chainLast = late;
+		throttleAllCPUs(&PStates[expected[i].pstate]);
+	}
+	printf("Chained writes:    %zu entries run, late %.1f usec mean, %.1f max, %.1f at the last one\n",
+	       expected.size(), expected.empty() ? 0 : chainSum / 1e3 / expected.size(), chainWorst / 1e3, chainLast / 1e3);
+
+	printf("\n%s: %u check%s failed\n", failures ? "FAIL" : "ok", failures, failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * sweep - replays a corpus of load traces under every combination of
+ * TargetCPULoad, ThrottleQuantum and TimeoutScale, in parallel on a
+ * work-stealing pool, ranks the settings by energy-delay product and prints
+ * the Pareto front as an Info.plist IOKitPersonalities fragment.
+ *
+ * Delay is the corpus length plus the time work sat queued (missed demand),
+ * so a setting that saves energy by falling behind pays for it.
+ *
+ * Built with -DIESS_HOST_TLS: every worker thread has its own driver state.
+ */
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "Replay.h"
+#include "WorkPool.h"
+#include "Utility.h"
+
+struct Setting {
+	uint16_t	targetLoad;	// percent
+	uint32_t	quantumMS;
+	uint16_t	timeoutScale;
+	double		energyJ;
+	double		delayS;
+	double		rampMS;		// mean over the corpus
+	uint64_t	transitions;
+	bool		failed;
+
+	double edp() const { return energyJ * delayS; }
+};
+
+struct Sweep {
+	ReplayConfig			base;
+	std::vector<LoadTrace>		traces;
+	std::vector<Setting>		settings;
+	std::vector<ReplayResult>	results;	// settings x traces
+};
+
+static void replayJob(void* context, size_t index) {
+	Sweep* sweep = (Sweep*) context;
+	size_t s = index / sweep->traces.size(), t = index % sweep->traces.size();
+	ReplayConfig cfg = sweep->base;
+	cfg.targetCPULoad = sweep->settings[s].targetLoad * 10;
+	cfg.quantumMS	  = sweep->settings[s].quantumMS;
+	cfg.timeoutScale  = sweep->settings[s].timeoutScale;
+	if (!runReplay(sweep->traces[t], cfg, &sweep->results[index]))
+		sweep->settings[s].failed = true;
+}
+
+static double wallSeconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool parseRange(const char* s, std::vector<unsigned>* v) {
+	unsigned lo, hi, step = 1;
+	int n = sscanf(s, "%u:%u:%u", &lo, &hi, &step);
+	if (n == 1) hi = lo;
+	else if (n < 2 || step == 0 || hi < lo) return false;
+	v->clear();
+	for (unsigned x = lo; x <= hi; x += step) v->push_back(x);
+	return true;
+}
+
+static bool byEDP(const Setting& a, const Setting& b) { return a.edp() < b.edp(); }
+static bool byEnergy(const Setting& a, const Setting& b) {
+	return a.energyJ < b.energyJ || (a.energyJ == b.energyJ && a.delayS < b.delayS);
+}
+
+static void printPersonality(FILE* out, const Setting& s, const char* indent) {
+	fprintf(out, "%s<key>TargetCPULoad</key>\n%s<integer>%u</integer>\n", indent, indent, s.targetLoad);
+	fprintf(out, "%s<key>ThrottleQuantum</key>\n%s<integer>%u</integer>\n", indent, indent, s.quantumMS);
+	fprintf(out, "%s<key>TimeoutScale</key>\n%s<integer>%u</integer>\n", indent, indent, s.timeoutScale);
+}
+
+static void writeFragment(FILE* out, const std::vector<Setting>& front) {
+	const Setting& best = front[0];
+	fprintf(out, "<!-- Pareto front of the sweep, lowest energy-delay product first.\n"
+		     "     Merge the keys into IOKitPersonalities/IntelEnhancedSpeedStep of Source/Info.plist. -->\n");
+	fprintf(out, "<key>IOKitPersonalities</key>\n<dict>\n\t<key>IntelEnhancedSpeedStep</key>\n\t<dict>\n");
+	fprintf(out, "\t\t<!-- %.2f J, %.2f s, EDP %.1f -->\n", best.energyJ, best.delayS, best.edp());
+	printPersonality(out, best, "\t\t");
+	for (size_t i = 1; i < front.size(); i++) {
+		fprintf(out, "\t\t<!-- alternative: %.2f J, %.2f s, EDP %.1f\n", front[i].energyJ, front[i].delayS, front[i].edp());
+		printPersonality(out, front[i], "\t\t");
+		fprintf(out, "\t\t-->\n");
+	}
+	fprintf(out, "\t</dict>\n</dict>\n");
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: sweep [-j threads] [-t trace|spec]... [-d seconds] [-n cpus] [-c air|penryn] [-p table]\n"
+		"             [-l lo:hi:step] [-q lo:hi:step] [-s lo:hi:step] [-k top] [-o fragment.plist] [-b]\n"
+		"  -l target load %%, -q quantum ms, -s timeout scale (x10); -b measures scaling from 1 to -j threads\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	Sweep sweep;
+	std::vector<const char*> sources;
+	std::vector<unsigned> loads, quanta, scales;
+	const char* fragment = 0;
+	uint32_t seconds = 120;
+	int cpus = 2, top = 10, threads = WorkStealingPool::hardwareThreads(), ch;
+	bool scaling = false;
+
+	parseRange("20:90:5", &loads);
+	parseRange("25:250:25", &quanta);
+	parseRange("0:30:5", &scales);
+
+	while ((ch = getopt(argc, argv, "j:t:d:n:c:p:l:q:s:k:o:b")) != -1) {
+		switch (ch) {
+			case 'j': threads = atoi(optarg); break;
+			case 't': sources.push_back(optarg); break;
+			case 'd': seconds = atoi(optarg); break;
+			case 'n': cpus = atoi(optarg); break;
+			case 'c':
+				if (!strcmp(optarg, "penryn"))	sweep.base.model = SimulatedCPU::PenrynP8600();
+				else if (strcmp(optarg, "air"))	usage();
+				break;
+			case 'p': sweep.base.pstates = optarg; break;
+			case 'l': if (!parseRange(optarg, &loads))  usage(); break;
+			case 'q': if (!parseRange(optarg, &quanta)) usage(); break;
+			case 's': if (!parseRange(optarg, &scales)) usage(); break;
+			case 'k': top = atoi(optarg); break;
+			case 'o': fragment = optarg; break;
+			case 'b': scaling = true; break;
+			default: usage();
+		}
+	}
+	if (threads < 1 || cpus < 1 || cpus > 256) usage();
+	if (sources.empty()) {
+		sources.push_back("mixed:1");
+		sources.push_back("mixed:2");
+		sources.push_back("burst:1000:200:900");
+		sources.push_back("ramp:4000");
+		sources.push_back("steady:250");
+	}
+
+	sweep.traces.resize(sources.size());
+	for (size_t i = 0; i < sources.size(); i++)
+		if (!sweep.traces[i].open(sources[i], seconds * 1000, cpus)) return 1;
+
+	for (size_t l = 0; l < loads.size(); l++)
+		for (size_t q = 0; q < quanta.size(); q++)
+			for (size_t s = 0; s < scales.size(); s++) {
+				Setting st = Setting();
+				st.targetLoad = loads[l]; st.quantumMS = quanta[q]; st.timeoutScale = scales[s];
+				sweep.settings.push_back(st);
+			}
+	size_t jobs = sweep.settings.size() * sweep.traces.size();
+	sweep.results.resize(jobs);
+
+	printf("%zu settings x %zu traces = %zu replays\n", sweep.settings.size(), sweep.traces.size(), jobs);
+
+	if (scaling) {
+		std::vector<int> counts;
+		for (int n = 1; n < threads; n *= 2) counts.push_back(n);
+		counts.push_back(threads);
+		double single = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			int n = counts[i];
+			WorkStealingPool pool(n);
+			double start = wallSeconds();
+			pool.run(jobs, replayJob, &sweep);
+			double took = wallSeconds() - start;
+			if (n == 1) single = took;
+			printf("%3d threads: %7.2f s, %8.1f replays/s, speedup %.2f, %zu steals\n",
+			       n, took, jobs / took, single / took, pool.steals());
+		}
+	} else {
+		WorkStealingPool pool(threads);
+		double start = wallSeconds();
+		pool.run(jobs, replayJob, &sweep);
+		double took = wallSeconds() - start;
+		printf("%d threads: %.2f s, %.1f replays/s, %zu steals\n", threads, took, jobs / took, pool.steals());
+	}
+
+	// Fold the corpus into one figure per setting
+	std::vector<Setting> ranked;
+	for (size_t s = 0; s < sweep.settings.size(); s++) {
+		Setting& st = sweep.settings[s];
+		if (st.failed) continue;
+		for (size_t t = 0; t < sweep.traces.size(); t++) {
+			const ReplayResult& r = sweep.results[s * sweep.traces.size() + t];
+			st.energyJ	+= r.energyJ;
+			st.delayS	+= (r.durationMS + r.missedDemandMS) / 1000.0;
+			st.rampMS	+= r.rampMeanMS / sweep.traces.size();
+			st.transitions	+= r.transitions;
+		}
+		ranked.push_back(st);
+	}
+	if (ranked.empty()) return 1;
+	std::stable_sort(ranked.begin(), ranked.end(), byEDP);
+
+	printf("\n%6s %8s %6s %10s %9s %10s %9s %12s\n", "load%", "quantum", "scale", "energy J", "delay s",
+	       "EDP", "ramp ms", "transitions");
+	for (int i = 0; i < top && i < (int) ranked.size(); i++)
+		printf("%6u %8u %6u %10.2f %9.2f %10.1f %9.1f %12llu\n", ranked[i].targetLoad, ranked[i].quantumMS,
+		       ranked[i].timeoutScale, ranked[i].energyJ, ranked[i].delayS, ranked[i].edp(),
+		       ranked[i].rampMS, (unsigned long long) ranked[i].transitions);
+
+	// Pareto front: walk by energy, keep whatever is faster than everything cheaper
+	std::vector<Setting> byCost = ranked, front;
+	std::stable_sort(byCost.begin(), byCost.end(), byEnergy);
+	for (size_t i = 0; i < byCost.size(); i++)
+		if (front.empty() || byCost[i].delayS < front.back().delayS)
+			front.push_back(byCost[i]);
+	std::stable_sort(front.begin(), front.end(), byEDP);
+	printf("\nPareto front: %zu settings\n\n", front.size());
+
+	FILE* out = stdout;
+	if (fragment && !(out = fopen(fragment, "w"))) {
+		fprintf(stderr, "Cannot write %s\n", fragment);
+		return 1;
+	}
+	writeFragment(out, front);
+	if (out != stdout) {
+		fclose(out);
+		printf("Info.plist fragment written to %s\n", fragment);
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * thermfit - fits the thermal model (Source/Thermal.h) to recorded
+ * temperature traces and checks how well it predicts them.
+ *
+ * Traces are the <interval ms> <mW> <C> samples of Host/Trace.h, from
+ * replay -W or a Mac. Each is fed to ThermalModel sample by sample the way
+ * the controller does; from halfway on, every step the fit so far predicts
+ * the temperature horizon seconds ahead from the power the trace actually
+ * drew, and that is compared with what the trace then read.
+ *
+ * Without trace arguments it records its own from the replay's thermal
+ * stand-in (the MacBook Air one) under a few load patterns, checks the fit
+ * against the stand-in's resistance, time constant and ambient, and then
+ * replays the same loads with the thermal budget on and off to check that
+ * it boosts past the soft cap without reaching PROCHOT. Every check prints
+ * a line; exits with 1 if any of them failed.
+ */
+#include <unistd.h>
+#include <math.h>
+
+#include "Checks.h"
+#include "Replay.h"
+#include "Utility.h"
+
+static void usage() {
+	fprintf(stderr, "usage: thermfit [-s step ms] [-m memory] [-h horizon s] [-d seconds] [-v] [trace.temps ...]\n"
+			"  memory: the fit forgets 1/2^memory every step (default %u)\n", defaultThermalMemory);
+	exit(1);
+}
+
+struct Step {
+	size_t		lastSample;	// the one that closed it
+	int		endC16;
+	uint32_t	powerMW;	// average over the step
+};
+
+struct FitResult {
+	bool		valid;
+	uint32_t	resistance;	// C/W x 1000
+	uint32_t	tauMS;
+	int		ambientC;
+	uint64_t	fits;
+	uint32_t	predictions;
+	double		meanErrorC;	// |predicted - read| horizon ahead
+	double		maxErrorC;
+};
+
+/* The steps ThermalModel::update() makes of the samples */
+static std::vector<Step> stepsOf(const TemperatureTrace& t, uint32_t stepMS) {
+	std::vector<Step> steps;
+	uint64_t energy = 0;
+	uint32_t elapsed = 0;
+	for (size_t i = 1; i < t.samples.size(); i++) { // the first one only primes it
+		const TemperatureSample& s = t.samples[i];
+		energy += (uint64_t) s.powerMW * s.intervalMS;
+		elapsed += s.intervalMS;
+		if (elapsed < stepMS) continue;
+		Step st = { i, s.tempC * 16, (uint32_t) (energy / elapsed) };
+		steps.push_back(st);
+		energy = 0;
+		elapsed = 0;
+	}
+	return steps;
+}
+
+/* Feed the trace to a fresh model; from halfway on, predict horizon steps ahead at every step */
+static FitResult fit(const TemperatureTrace& t, const ThermalModel& settings, int horizon) {
+	ThermalModel model = settings;
+	model.reset();
+	std::vector<Step> steps = stepsOf(t, model.stepMS);
+	std::vector<int> predicted(steps.size(), -1);
+	FitResult r;
+	bzero(&r, sizeof(r));
+	double errorSum = 0;
+	size_t k = 0;
+	for (size_t i = 0; i < t.samples.size() && k < steps.size(); i++) {
+		const TemperatureSample& s = t.samples[i];
+		model.update(s.tempC * 16, s.powerMW, s.intervalMS);
+		if (i != steps[k].lastSample) continue;
+		if (predicted[k] >= 0) {
+			double e = fabs(predicted[k] - steps[k].endC16) / 16.0;
+			errorSum += e;
+			if (e > r.maxErrorC) r.maxErrorC = e;
+			r.predictions++;
+		}
+		if (k * 2 >= steps.size() && model.valid() && k + horizon < steps.size()) {
+			int c16 = steps[k].endC16;
+			for (int h = 1; h <= horizon; h++)
+				c16 = model.step(c16, steps[k + h].powerMW, steps[k + h - 1].powerMW);
+			predicted[k + horizon] = c16;
+		}
+		k++;
+	}
+	r.valid		= model.valid();
+	r.resistance	= model.resistance();
+	r.tauMS		= model.tauMS();
+	r.ambientC	= model.ambient();
+	r.fits		= model.fits;
+	r.meanErrorC	= r.predictions ? errorSum / r.predictions : 0;
+	return r;
+}
+
+static void printFit(const char* name, const FitResult& r, int horizon) {
+	if (!r.valid) {
+		printf("%s: no fit\n", name);
+		return;
+	}
+	printf("%s: %.2f C/W, tau %.1f s, ambient %d C after %llu fits; %u s ahead off by %.2f C mean, %.1f C max (%u predictions)\n",
+	       name, r.resistance / 1000.0, r.tauMS / 1000.0, r.ambientC, (unsigned long long) r.fits,
+	       horizon, r.meanErrorC, r.maxErrorC, r.predictions);
+}
+
+/* Replays spec on the stand-in; temps gets what the model was fed if set */
+static bool replay(const char* spec, uint32_t seconds, uint8_t limit, TemperatureTrace* temps, ReplayResult* r) {
+	LoadTrace trace;
+	if (!trace.open(spec, seconds * 1000, 2)) return false;
+	ReplayConfig cfg;
+	cfg.thermal = ThermalStandIn::MacBookAir();
+	cfg.thermalLimit = limit;
+	cfg.temperatures = temps;
+	if (temps) temps->name = spec;
+	return runReplay(trace, cfg, r);
+}
+
+static void standInChecks(const ThermalModel& settings, int horizon, int horizonS, uint32_t seconds) {
+	const ThermalStandIn air = ThermalStandIn::MacBookAir();
+	const double tau = air.rCPerW * air.cJPerC;
+	const char* specs[] = { "mixed:1", "mixed:2", "burst:60000:20000:1000", "ramp:120000" };
+	char what[160];
+	ReplayResult r;
+
+	printf("Fit to the stand-in (%.1f C/W, tau %.1f s, ambient %.0f C)\n", air.rCPerW, tau, air.ambientC);
+	for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+		TemperatureTrace t;
+		if (!replay(specs[i], seconds, defaultThermalLimit, &t, &r)) exit(1);
+		FitResult f = fit(t, settings, horizon);
+		printFit(specs[i], f, horizonS);
+		// The _PSS power is short of what the cores draw at the voltage the kext sets, R only roughly matches
+		snprintf(what, sizeof(what), "%s: fitted, resistance within 0.8..1.3 x the stand-in's", specs[i]);
+		check(f.valid && f.resistance >= air.rCPerW * 800 && f.resistance <= air.rCPerW * 1300, what);
+		snprintf(what, sizeof(what), "%s: tau within 25%%, ambient within 6 C", specs[i]);
+		check(fabs(f.tauMS / 1000.0 - tau) <= tau / 4 && fabs(f.ambientC - air.ambientC) <= 6, what);
+		snprintf(what, sizeof(what), "%s: %d s ahead off by 2.5 C or less on average", specs[i], horizonS);
+		check(f.predictions > 0 && f.meanErrorC <= 2.5, what);
+	}
+
+	printf("Thermal budget against the soft cap alone\n");
+	ReplayResult capped, budget;
+	if (!replay("steady:1000", seconds, 0, 0, &capped) || !replay("steady:1000", seconds, defaultThermalLimit, 0, &budget)) exit(1);
+	printf("  steady:1000 soft cap: %.0f MHz, hottest %.1f C, %.0f P0-ms behind\n", capped.avgMHz, capped.maxTempC, capped.backlogMS);
+	printf("  steady:1000 budget:   %.0f MHz, hottest %.1f C, %.0f P0-ms behind, %llu boosts, %u MHz sustainable\n",
+	       budget.avgMHz, budget.maxTempC, budget.backlogMS, (unsigned long long) budget.thermalBoosts, budget.sustainableMHz);
+	check(budget.modelValid && budget.thermalBoosts > 0, "full load: boosts at P0 once the model is fitted");
+	check(budget.prochotMS == 0 && budget.maxTempC <= 100 - defaultThermalLimit + 1, "and stays within a degree of the limit, clear of PROCHOT");
+	check(budget.sustainableMHz < budget.stateMHz[0] && budget.sustainableMHz > budget.stateMHz[budget.states - 1],
+	      "settles on a state between the slowest and P0");
+	check(budget.avgMHz > capped.avgMHz && budget.backlogMS < capped.backlogMS, "gets more work done than the soft cap");
+
+	if (!replay("burst:60000:20000:1000", seconds, defaultThermalLimit, 0, &r)) exit(1);
+	check(r.thermalCapped == 0, "bursts that never get near the limit aren't capped");
+}
+
+int main(int argc, char** argv) {
+	ThermalModel settings;
+	settings.setDefaults();
+	int horizonS = 30, ch;
+	uint32_t seconds = 600;
+
+	while ((ch = getopt(argc, argv, "s:m:h:d:v")) != -1) {
+		switch (ch) {
+			case 's': settings.stepMS = atoi(optarg); break;
+			case 'm': settings.memory = atoi(optarg); break;
+			case 'h': horizonS = atoi(optarg); break;
+			case 'd': seconds = atoi(optarg); break;
+			case 'v': DebugOn = true; break;
+			default: usage();
+		}
+	}
+	if (!settings.stepMS || settings.memory < 1 || settings.memory > 10 || horizonS < 1) usage();
+	int horizon = (horizonS * 1000 + settings.stepMS - 1) / settings.stepMS;
+
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++) {
+			TemperatureTrace t;
+			if (!t.load(argv[i])) return 1;
+			printFit(argv[i], fit(t, settings, horizon), horizonS);
+		}
+		return 0;
+	}
+
+	standInChecks(settings, horizon, horizonS, seconds);
+	return checkSummary();
+}
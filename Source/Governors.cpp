@@ -0,0 +1,297 @@
+#include "Governors.h"
+#include "ThrottleController.h"
+#include "Utility.h"
+
+/**************************************************************************************************/
+/* proportional */
+
+int ProportionalGovernor::step(const ThrottleController& c, long used, long sustained, int from, uint32_t dwellMS) const {
+	uint32_t wantspeed;
+	int wantstep;
+
+	// If used > 95% we can't really guess how much is needed, so step to highest speed
+	if (used >= 950)
+		return 0;
+
+	// Otherwise wantspeed is the ideal frequency to maintain idle % target
+	wantspeed = (PStates[from].AcpiFreq * (used + 1)) / c.targetCPULoad;
+	wantstep = FindClosestPState(wantspeed);
+
+	// Hysteresis: only move when the load is clearly off target, and not too often
+	if (wantstep < from && used <= c.targetCPULoad + c.upThreshold)
+		wantstep = from;
+	if (wantstep > from && used + c.downThreshold >= c.targetCPULoad)
+		wantstep = from;
+	if (wantstep > from) {
+		int floor = FindClosestPState(PStates[0].AcpiFreq * (sustained + 1) / c.targetCPULoad);
+		if (wantstep > floor) wantstep = floor > from ? floor : from;
+	}
+	if (dwellMS < c.minDwellMS)
+		wantstep = from;
+	return wantstep;
+}
+
+int ProportionalGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	int wantstep = step(c, s.used, s.longDemand, s.pstate, s.dwellMS);
+	*timeoutMS = c.timeoutFor(wantstep); // Make the delay until the next check proportional to the speed we picked
+	return wantstep;
+}
+
+/**************************************************************************************************/
+/* pid */
+
+void PIDGovernor::start(const ThrottleController& c, int pstate) {
+	reset(pstateToLevel(pstate)); // bumpless
+}
+
+int PIDGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	*timeoutMS = c.quantumMS; // the gains assume a fixed sample period
+	return levelToPState(update(c.targetCPULoad, s.used));
+}
+
+/**************************************************************************************************/
+/* ondemand */
+
+void OndemandGovernor::setDefaults() {
+	upThreshold	= defaultOndemandUp;
+	samplingDown	= defaultSamplingDown;
+	downStep	= defaultDownStep;
+}
+
+void OndemandGovernor::start(const ThrottleController& c, int pstate) {
+	lowSamples = 0;
+}
+
+int OndemandGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	*timeoutMS = c.quantumMS;
+
+	if (s.used > upThreshold) { // jump, don't walk
+		lowSamples = 0;
+		return 0;
+	}
+
+	int slower = s.pstate + (downStep ? downStep : 1);
+	if (slower > NumberOfPStates - 1) slower = NumberOfPStates - 1;
+	if (slower == s.pstate) return s.pstate;
+
+	// Would this load stay under the threshold at the slower speed too?
+	if (s.used * PStates[s.pstate].AcpiFreq / PStates[slower].AcpiFreq < upThreshold) {
+		if (++lowSamples >= samplingDown) {
+			lowSamples = 0;
+			return slower;
+		}
+	} else {
+		lowSamples = 0;
+	}
+	return s.pstate;
+}
+
+/**************************************************************************************************/
+/* conservative */
+
+void ConservativeGovernor::setDefaults() {
+	freqStep	= defaultFreqStep;
+	rateMS		= defaultConservativeRate;
+}
+
+void ConservativeGovernor::start(const ThrottleController& c, int pstate) {
+	targetMHz = PStates[pstate].AcpiFreq;
+}
+
+int ConservativeGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	uint32_t step = PStates[0].AcpiFreq * freqStep / 100;
+	uint32_t fastest = PStates[0].AcpiFreq, slowest = PStates[NumberOfPStates - 1].AcpiFreq;
+	*timeoutMS = rateMS;
+
+	if (s.used > c.targetCPULoad + c.upThreshold)
+		targetMHz = targetMHz + step < fastest ? targetMHz + step : fastest;
+	else if (s.used + c.downThreshold < c.targetCPULoad)
+		targetMHz = targetMHz > slowest + step ? targetMHz - step : slowest;
+
+	// Never more than one entry per sample
+	int wantstep = FindClosestPState(targetMHz);
+	if (wantstep < s.pstate) return s.pstate - 1;
+	if (wantstep > s.pstate) return s.pstate + 1;
+	return s.pstate;
+}
+
+/**************************************************************************************************/
+/* markov */
+
+#define markovRowLimit	256	// halve a row when it has seen this many transitions
+#define markovMinRow	4	// transitions before a row is trusted
+
+void MarkovGovernor::setDefaults() {
+	quantile = defaultMarkovQuantile;
+	forget();
+}
+
+void MarkovGovernor::forget() {
+	bzero(counts, sizeof(counts));
+	bzero(rowTotal, sizeof(rowTotal));
+	lastBucket = -1;
+}
+
+void MarkovGovernor::start(const ThrottleController& c, int pstate) {
+	lastBucket = -1; // the learned matrix stays, only the chain restarts
+}
+
+int MarkovGovernor::predict(int bucket) const {
+	if (rowTotal[bucket] < markovMinRow) return -1;
+	// Walk the row up to the quantile, answer with the top of that bucket
+	uint32_t want = (rowTotal[bucket] * quantile + 99) / 100, seen = 0;
+	for (int j = 0; j < markovBuckets; j++) {
+		seen += counts[bucket][j];
+		if (seen >= want) return (j + 1) * 1000 / markovBuckets;
+	}
+	return 1000;
+}
+
+int MarkovGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	*timeoutMS = c.quantumMS;
+
+	// What the load would have been at P0
+	long demand = s.used * PStates[s.pstate].AcpiFreq / PStates[0].AcpiFreq;
+	int bucket = demand * markovBuckets / 1000;
+	if (bucket >= markovBuckets) bucket = markovBuckets - 1;
+
+	if (lastBucket >= 0) {
+		counts[lastBucket][bucket]++;
+		if (++rowTotal[lastBucket] >= markovRowLimit) {
+			rowTotal[lastBucket] = 0;
+			for (int j = 0; j < markovBuckets; j++) {
+				counts[lastBucket][j] /= 2;
+				rowTotal[lastBucket] += counts[lastBucket][j];
+			}
+		}
+	}
+	lastBucket = bucket;
+
+	// Saturated: the real demand could be anything above this
+	if (s.used >= 950)
+		return 0;
+
+	int predicted = predict(bucket);
+	if (predicted < 0) predicted = demand;
+
+	// Slowest state that keeps the predicted demand at or under the target
+	uint32_t wantspeed = PStates[0].AcpiFreq * predicted / c.targetCPULoad;
+	int wantstep = 0;
+	for (int i = NumberOfPStates - 1; i > 0; i--) {
+		if (PStates[i].AcpiFreq >= wantspeed) {
+			wantstep = i;
+			break;
+		}
+	}
+	return wantstep;
+}
+
+/**************************************************************************************************/
+/* energy */
+
+void EnergyGovernor::setDefaults() {
+	idlePower = defaultIdlePower;
+}
+
+#define energyMargin	16	// another state has to be 1/energyMargin cheaper to leave this one
+
+int EnergyGovernor::cheapest(const ThrottleController& c, long demand, int from) const {
+	bool known = true;
+	for (int i = 0; i < NumberOfPStates; i++)
+		if (PStates[i].Power == 0) known = false;
+
+	if (!known) { // the slowest state that keeps up
+		for (int i = NumberOfPStates - 1; i > 0; i--)
+			if ((uint64_t) demand * PStates[0].AcpiFreq / PStates[i].AcpiFreq <= c.targetCPULoad)
+				return i;
+		return 0;
+	}
+
+	int best = 0;
+	uint64_t bestCost = ~0ULL, fromCost = ~0ULL;
+	for (int i = 0; i < NumberOfPStates; i++) {
+		uint64_t busy = (uint64_t) demand * PStates[0].AcpiFreq / PStates[i].AcpiFreq; // permille
+		if (busy > c.targetCPULoad) continue;
+		uint64_t cost = busy * (PStates[i].Power > idlePower ? PStates[i].Power - idlePower : 0);
+		if (i == from) fromCost = cost;
+		if (cost < bestCost || (cost == bestCost && i > best)) { // ties go to the slower one
+			bestCost = cost;
+			best = i;
+		}
+	}
+	if (fromCost != ~0ULL && fromCost - fromCost / energyMargin <= bestCost)
+		return from;
+	return best;
+}
+
+int EnergyGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	*timeoutMS = c.quantumMS;
+
+	if (s.used >= 950)
+		return 0;
+
+	long demand = s.used * PStates[s.pstate].AcpiFreq / PStates[0].AcpiFreq;
+	int wantstep = cheapest(c, demand, s.pstate);
+	if (wantstep > s.pstate && s.dwellMS < c.minDwellMS)
+		return s.pstate;
+	return wantstep;
+}
+
+/**************************************************************************************************/
+/* race */
+
+#define raceHistory	32	// samples, the bits in RaceGovernor::busy
+#define raceMinHistory	8	// before it believes the shape
+#define raceIdlePolls	4	// samples per quantum while idle between bursts
+#define raceMinPollMS	20	// but no shorter than two ticks
+
+static int bitsSet(uint32_t x) {
+	int n = 0;
+	for (; x; x &= x - 1) n++;
+	return n;
+}
+
+void RaceGovernor::setDefaults() {
+	idleLoad	= defaultRaceIdle;
+	maxSpell	= defaultRaceSpell;
+}
+
+void RaceGovernor::start(const ThrottleController& c, int pstate) {
+	busy = 0;
+	seen = 0;
+	pendingBusy = false;
+	pendingMS = 0;
+}
+
+bool RaceGovernor::bursty() const {
+	if (seen < raceMinHistory) return false;
+	uint32_t mask = seen >= raceHistory ? ~0U : (1U << seen) - 1;
+	int busySamples = bitsSet(busy & mask);
+	int spells = bitsSet(busy & ~(busy >> 1) & mask); // a busy sample after an idle (or older than the history) one
+	return (seen - busySamples) * 4 >= seen && spells >= 2 && busySamples <= spells * (maxSpell ? maxSpell : 1);
+}
+
+int RaceGovernor::sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) {
+	*timeoutMS = c.quantumMS;
+
+	// One bit per quantum, however often it looked in between
+	bool wasBusy = s.used > idleLoad;
+	pendingBusy |= wasBusy;
+	pendingMS += s.intervalMS;
+	if (pendingMS >= c.quantumMS) {
+		busy = (busy << 1) | pendingBusy;
+		if (seen < raceHistory) seen++;
+		pendingBusy = false;
+		pendingMS = 0;
+	}
+
+	if (s.used >= 950)
+		return 0;
+	if (bursty()) {
+		if (wasBusy) return 0;
+		// Idle at the bottom: look more often, so the next burst gets P0 from near its start
+		*timeoutMS = c.quantumMS / raceIdlePolls > raceMinPollMS ? c.quantumMS / raceIdlePolls : raceMinPollMS;
+		return NumberOfPStates - 1;
+	}
+	return c.proportional.step(c, s.used, s.longDemand, s.pstate, s.dwellMS);
+}
@@ -0,0 +1,206 @@
+#ifndef _GOVERNORS_H
+#define _GOVERNORS_H
+
+#include "Throttling.h"
+#include "PIDController.h"
+
+class ThrottleController;
+
+const uint16_t defaultOndemandUp	= 800; // percent x 10, ondemand jumps to P0 above this
+const uint16_t defaultSamplingDown	= 4;   // low samples before ondemand steps down
+const uint8_t  defaultDownStep		= 1;   // PStates per ondemand step down
+const uint8_t  defaultFreqStep		= 5;   // percent of P0, conservative target move per sample
+const uint32_t defaultConservativeRate	= 200; // ms between conservative samples
+const uint8_t  defaultMarkovQuantile	= 90;  // percent, how pessimistic the markov prediction is
+const uint32_t defaultIdlePower		= 400; // mW per core halted in C1E/C2
+const uint16_t defaultRaceIdle		= 100; // percent x 10, a sample at or under this was idle
+const uint8_t  defaultRaceSpell		= 5;   // samples a busy spell may last on average and still be a burst
+
+#define markovBuckets	10	// demand buckets of 10% of P0 each
+
+/* What a governor gets to decide on, once per perfTimer event */
+struct LoadSample {
+	long		used;		// percent x 10, busiest CPU
+	uint8_t		pstate;		// PStates[] index running now
+	uint32_t	dwellMS;	// time spent in it so far
+	uint32_t	intervalMS;	// the load was measured over this long
+	long		shortDemand;	// permille of P0, short average across the CPUs (LoadAggregator)
+	long		longDemand;	// permille of P0, long average
+};
+
+/*
+ * A policy for the auto-throttler. ThrottleController hands the active one
+ * every load sample; it returns the PStates[] index for the next interval and
+ * sets *timeoutMS to the delay until the next sample. The shared tunables
+ * (targetCPULoad, thresholds, quantum) live in the controller, everything
+ * specific to one governor lives in the governor.
+ *
+ * start() is called whenever a governor takes over, so it can continue from
+ * the state the previous one left the CPU in.
+ */
+class Governor {
+public:
+	virtual const char*	name() const = 0;
+	virtual void		start(const ThrottleController& c, int pstate) {}
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS) = 0;
+	/* Whether the oscillation damper may hold its changes back */
+	virtual bool		damped() const { return true; }
+};
+
+/*
+ * The original TurboEIST rule: the frequency that would have kept the load at
+ * the target, cur_MHz * (used+1) / target, or P0 if the load is over 95%, with
+ * up/down thresholds and a minimum dwell against flapping. Steps down no
+ * further than the long average demand needs, so a short lull in sustained
+ * work doesn't cost two transitions. Waits longer between samples the faster
+ * it runs (ThrottleController::timeoutFor()).
+ */
+class ProportionalGovernor : public Governor {
+public:
+	virtual const char*	name() const { return "proportional"; }
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+
+	/* The state it would pick coming from the given one, sustained being the long average demand */
+	int	step(const ThrottleController& c, long used, long sustained, int from, uint32_t dwellMS) const;
+};
+
+/* PID on the load, see PIDController.h. Samples every quantumMS. */
+class PIDGovernor : public Governor, public PIDController {
+public:
+	virtual const char*	name() const { return "pid"; }
+	virtual void		start(const ThrottleController& c, int pstate);
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+};
+
+/*
+ * Straight to P0 once the load crosses upThreshold, then down downStep states
+ * at a time after samplingDown samples in a row whose load would still be
+ * under upThreshold at the slower speed. Samples every quantumMS.
+ */
+class OndemandGovernor : public Governor {
+public:
+	uint16_t	upThreshold;	// percent x 10
+	uint16_t	samplingDown;	// consecutive low samples before stepping down
+	uint8_t		downStep;	// PStates per step down
+
+	void			setDefaults();
+	virtual const char*	name() const { return "ondemand"; }
+	virtual void		start(const ThrottleController& c, int pstate);
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+
+private:
+	uint16_t	lowSamples;
+};
+
+/*
+ * Moves a target frequency by freqStep % of P0 per sample while the load is
+ * outside the controller's up/down thresholds, and follows it one PState at
+ * a time, so every sample costs at most one transition.
+ */
+class ConservativeGovernor : public Governor {
+public:
+	uint8_t		freqStep;	// percent of P0
+	uint32_t	rateMS;		// sampling period
+
+	void			setDefaults();
+	virtual const char*	name() const { return "conservative"; }
+	virtual void		start(const ThrottleController& c, int pstate);
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+
+private:
+	uint32_t	targetMHz;
+};
+
+/*
+ * Predicts the next interval instead of reacting to the last one. The load is
+ * turned into demand (what it would be at P0) and put into one of
+ * markovBuckets buckets; every sample counts a transition from the previous
+ * bucket to this one. The next state is the slowest one that would keep the
+ * quantile-th percentile of the demand expected after the current bucket at
+ * or under the target. Rows are halved once they reach markovRowLimit, so old
+ * behaviour fades out. Until a row has seen a few transitions the current
+ * demand is used as the prediction. Fixed size, no allocation; samples every
+ * quantumMS so all transitions span the same time.
+ */
+class MarkovGovernor : public Governor {
+public:
+	uint8_t		quantile;	// percent
+
+	void			setDefaults();
+	virtual const char*	name() const { return "markov"; }
+	virtual void		start(const ThrottleController& c, int pstate);
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+
+	/* Demand (permille of P0) expected after the given bucket, -1 if the row is too sparse */
+	int		predict(int bucket) const;
+	void		forget();
+
+private:
+	uint16_t	counts[markovBuckets][markovBuckets];
+	uint16_t	rowTotal[markovBuckets];
+	int8_t		lastBucket;	// -1 until there is one
+};
+
+/*
+ * Picks the state that does the work for the least energy. The load is turned
+ * into the throughput needed (demand at P0); over one interval a state that
+ * is busy b of the time costs b * Power + (1 - b) * idlePower, so the one
+ * with the smallest b * (Power - idlePower) wins among the states that keep
+ * b at or under the target. When leakage makes the slow states expensive per
+ * cycle, that is a faster one: it finishes sooner and idles the rest.
+ *
+ * Power comes from _PSS. If any state lacks it, there is nothing to weigh and
+ * it simply takes the slowest state that keeps up. Goes up at once, down only
+ * after minDwellMS, and with _PSS power only for a saving of more than 1/16.
+ * Samples every quantumMS.
+ */
+class EnergyGovernor : public Governor {
+public:
+	uint32_t	idlePower;	// mW
+
+	void			setDefaults();
+	virtual const char*	name() const { return "energy"; }
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+
+	/*
+	 * Cheapest state serving demand (permille of P0) within the target, P0 if
+	 * none does. Stays at from while that is within 1/16 of the cheapest.
+	 * Without _PSS power, the slowest state within the target.
+	 */
+	int	cheapest(const ThrottleController& c, long demand, int from) const;
+};
+
+/*
+ * Race to idle. Keeps the last 32 quanta as one bit each, busy or idle
+ * (no sample over idleLoad). The demand is burst shaped when at least a
+ * quarter of them were idle and the busy ones came in at least two spells
+ * of at most maxSpell quanta on average. Then a busy sample goes to P0 and
+ * an idle one straight to the slowest state: the burst is over sooner and
+ * the cores halt for the rest, which pays where _PSS says the fast states
+ * cost less per cycle than they draw above idle. Idle at the bottom it
+ * samples four times a quantum, so the next burst gets P0 from near its
+ * start. Any other load gets the proportional rule every quantumMS. Its
+ * flips are on purpose, the damper leaves them alone.
+ */
+class RaceGovernor : public Governor {
+public:
+	uint16_t	idleLoad;	// percent x 10
+	uint8_t		maxSpell;	// samples
+
+	void			setDefaults();
+	virtual const char*	name() const { return "race"; }
+	virtual void		start(const ThrottleController& c, int pstate);
+	virtual int		sample(const ThrottleController& c, const LoadSample& s, uint32_t* timeoutMS);
+	virtual bool		damped() const { return false; }
+
+	/* Whether the history looks like bursts */
+	bool	bursty() const;
+
+private:
+	uint32_t	busy;		// newest sample in bit 0
+	uint8_t		seen;		// quanta in it, up to 32
+	bool		pendingBusy;	// any sample busy since the last bit
+	uint32_t	pendingMS;	// time sampled since the last bit
+};
+
+#endif // _GOVERNORS_H
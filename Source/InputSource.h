@@ -0,0 +1,28 @@
+#ifndef _INPUTSOURCE_H
+#define _INPUTSOURCE_H
+
+/*
+ * Where user input activity comes from, for the interactive boost. The kext
+ * watches IOHIDSystem (HIDIdleInputSource), the host tools fire events
+ * themselves (Host/HostInputSource.h). Either way the handler runs in the
+ * context that serializes with the perfTimer, so it may call
+ * ThrottleController::boost() directly.
+ */
+typedef void (*InputHandler)(void* owner);
+
+class InputSource {
+public:
+	InputSource() : handler(0), owner(0) {}
+	void	setHandler(InputHandler h, void* o) { handler = h; owner = o; }
+
+	virtual bool	start() = 0;
+	virtual void	stop() = 0;
+
+protected:
+	void	notify() { if (handler) handler(owner); }
+
+	InputHandler	handler;
+	void*		owner;
+};
+
+#endif // _INPUTSOURCE_H
@@ -10,10 +10,16 @@ extern "C" {
 
 OSDefineMetaClassAndStructors(com_reidburke_air_IntelEnhancedSpeedStep, IOService)
 OSDefineMetaClassAndStructors(AutoThrottler, OSObject)
+OSDefineMetaClassAndStructors(com_reidburke_air_IntelEnhancedSpeedStepUserClient, IOUserClient)
 
 /**********************************************************************************/
 /* sysctl interface for compatibility with Niall Douglas' ACPICPUThrottle.kext    */
 
+/* Fastest PStates[] index a manual setting may use: the auto-throttler's thermal ceiling once it is set up */
+static int manualCeiling() {
+	return Throttler && Throttler->setupDone ? Throttler->controller.thermalCeiling() : 0;
+}
+
 static int iess_handle_curfreq SYSCTL_HANDLER_ARGS
 {
 	int err = 0;
@@ -27,9 +33,17 @@ static int iess_handle_curfreq SYSCTL_HANDLER_ARGS
 			pstate = wantedFreq;
 		else // freq in MHz is given, find closest pstate
 			pstate = FindClosestPState(wantedFreq);
+		if (pstate < manualCeiling()) {
+			warn("Too hot for %d MHz, throttling to %d MHz\n", PStates[pstate].AcpiFreq, PStates[manualCeiling()].AcpiFreq);
+			pstate = manualCeiling();
+		}
 		
 		dbg("Throttling to PState %d\n", pstate);
 		throttleAllCPUs(&PStates[pstate]);
+		if (Throttler) {
+			Throttler->controller.throttledElsewhere();
+			Throttler->watchManual();
+		}
 
 	} else { // just reading
 		int MHz = PStates[FindClosestPState(getCurrentFrequency())].AcpiFreq;
@@ -56,6 +70,7 @@ static int iess_handle_curvolt SYSCTL_HANDLER_ARGS
 		dbg("Changing voltage of current PState %d to %d mV\n", pstate, wantedvolt);
 		PStates[pstate].Voltage = mV_to_VID(wantedvolt);
 		throttleAllCPUs(&PStates[pstate]);
+		if (Throttler) Throttler->controller.throttledElsewhere();
 	
 	} else { // just reading
 		int volt = getCurrentVoltage();
@@ -78,10 +93,18 @@ static int iess_handle_ctl SYSCTL_HANDLER_ARGS
 		dbg("Manual stepping to %xh\n", ctl);
 		
 		PState p; p.Frequency = FID(ctl); p.Voltage = VID(ctl);
+		if (FID_to_MHz(p.Frequency) > PStates[manualCeiling()].AcpiFreq) {
+			warn("Too hot for CTL %xh, throttling to %d MHz\n", ctl, PStates[manualCeiling()].AcpiFreq);
+			p = PStates[manualCeiling()];
+		}
 		throttleAllCPUs(&p);
+		if (Throttler) {
+			Throttler->controller.throttledElsewhere();
+			Throttler->watchManual();
+		}
 		
 	} else {
-		int ctl = rdmsr64(INTEL_MSR_PERF_STS);
+		int ctl = MSR->read(INTEL_MSR_PERF_STS);
 		ctl &= 0xffff; // only last 32 bits
 		err = SYSCTL_OUT(req, &ctl, sizeof(int));
 	}
@@ -99,6 +122,7 @@ static int iess_handle_auto SYSCTL_HANDLER_ARGS
 		if (!Throttler) {
 			Throttler = new AutoThrottler;
 			if (!Throttler) return kIOReturnError;
+			Throttler->controller.setDefaults();
 		}
 		// If setup was not done yet, do so.
 		if (Throttler->setupDone == false) {
@@ -162,6 +186,7 @@ SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_curfreq,	CTLTYPE_INT | CTLFLAG_RW, 0,
 SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_curvolt,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_curvolt, "I", "Current CPU voltage");
 SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_ctl,		CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_ctl,     "I", "Current MSR status");
 SYSCTL_STRING(_kern, OID_AUTO, cputhrottle_freqs,	CTLFLAG_RD, frequencyList, 0, "CPU frequencies supported");
+SYSCTL_STRING(_kern, OID_AUTO, cputhrottle_latency,	CTLFLAG_RD, transitionLatencies, 0, "Measured transition time in usec, from (rows) to (columns) each frequency");
 SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_usage,	CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_usage,"A", "CPU frequency usage pattern");
 SYSCTL_STRING(_kern, OID_AUTO, cputhrottle_factoryvolts,CTLFLAG_RD, originalVoltages, 0, "Factory default voltages for each frequency");
 SYSCTL_QUAD  (_kern, OID_AUTO, cputhrottle_totalthrottles, CTLFLAG_RD, &totalThrottles, "Total number of frequency throttles made");
@@ -187,6 +212,21 @@ char* getFreqList() {
 	return freqs;
 }
 
+/* One line per from-frequency, slowest first like the frequency list: "from: usec to each state" */
+char* getLatencyMatrix() {
+	int size = 1 + NumberOfPStates * (7 + 11 * NumberOfPStates);
+	char* matrix = new char[size];
+	int c = 0;
+	for (int from = NumberOfPStates-1; from >= 0; from--) {
+		c += snprintf(matrix + c, size - c, "%d:", PStates[from].AcpiFreq);
+		for (int to = NumberOfPStates-1; to >= 0; to--)
+			c += snprintf(matrix + c, size - c, " %u", TransitionLatency[from][to]);
+		c += snprintf(matrix + c, size - c, "\n");
+	}
+	matrix[c ? c - 1 : 0] = '\0'; // no newline after the last one
+	return matrix;
+}
+
 /* Return null terminated list of voltages */
 char* getVoltageList(bool originals) {
 	char* volts = new char[5 * NumberOfPStates];
@@ -205,22 +245,6 @@ char* getVoltageList(bool originals) {
 	return volts;
 }
 
-int FindClosestPState(int wantedFreq) {
-	// assume P0 is best
-	int bestpstate = 0;
-	int bestdiff   = abs(PStates[0].AcpiFreq - wantedFreq);
-	
-	// now iterate over others and find the best
-	for (int i = 1; i < NumberOfPStates; i++) {
-		if (abs(PStates[i].AcpiFreq - wantedFreq) < bestdiff) {
-			bestpstate = i;
-			bestdiff = abs(PStates[i].AcpiFreq - wantedFreq);
-		}
-	}
-	
-	return bestpstate;
-}
-
 
 /***************************************************************************************************/
 
@@ -282,11 +306,185 @@ bool com_reidburke_air_IntelEnhancedSpeedStep::init(OSDictionary* dict) {
 	Throttler = new AutoThrottler;
 	if (Throttler) {
 		dbg("Throttler instantiated.\n");
+		Throttler->controller.setDefaults();
 		OSNumber* targetload = (OSNumber*) dict->getObject("TargetCPULoad");
 		if (targetload != 0)
-			Throttler->targetCPULoad = (targetload->unsigned16BitValue()) * 10;
+			Throttler->controller.targetCPULoad = (targetload->unsigned16BitValue()) * 10;
 		else
-			Throttler->targetCPULoad = 300;
+			Throttler->controller.targetCPULoad = 300;
+		
+		OSNumber* quantum = (OSNumber*) dict->getObject("ThrottleQuantum");
+		if (quantum != 0 && quantum->unsigned32BitValue() >= 10)
+			Throttler->controller.quantumMS = quantum->unsigned32BitValue();
+		
+		OSNumber* timeoutScale = (OSNumber*) dict->getObject("TimeoutScale");
+		if (timeoutScale != 0)
+			Throttler->controller.timeoutScale = timeoutScale->unsigned16BitValue();
+		
+		OSNumber* upThreshold = (OSNumber*) dict->getObject("UpThreshold");
+		if (upThreshold != 0)
+			Throttler->controller.upThreshold = (upThreshold->unsigned16BitValue()) * 10;
+		
+		OSNumber* downThreshold = (OSNumber*) dict->getObject("DownThreshold");
+		if (downThreshold != 0)
+			Throttler->controller.downThreshold = (downThreshold->unsigned16BitValue()) * 10;
+		
+		OSNumber* minDwell = (OSNumber*) dict->getObject("MinDwell");
+		if (minDwell != 0)
+			Throttler->controller.minDwellMS = minDwell->unsigned32BitValue();
+		
+		OSNumber* loadSource = (OSNumber*) dict->getObject("LoadSource");
+		if (loadSource != 0 && loadSource->unsigned8BitValue() <= loadFromAPERF)
+			Throttler->controller.loadSource = loadSource->unsigned8BitValue();
+		
+		OSBoolean* autoTune = (OSBoolean*) dict->getObject("AutoTune");
+		if (autoTune != 0)
+			Throttler->controller.tuner.enabled = autoTune->getValue();
+		
+		OSNumber* tuneEpoch = (OSNumber*) dict->getObject("TuneEpoch");
+		if (tuneEpoch != 0 && tuneEpoch->unsigned32BitValue() >= 1000)
+			Throttler->controller.tuner.epochMS = tuneEpoch->unsigned32BitValue();
+		
+		OSNumber* missBudget = (OSNumber*) dict->getObject("MissBudget");
+		if (missBudget != 0 && missBudget->unsigned16BitValue() <= 1000)
+			Throttler->controller.tuner.missBudget = missBudget->unsigned16BitValue();
+		Throttler->controller.tuner.reset(Throttler->controller.targetCPULoad);
+		
+		OSNumber* reduction = (OSNumber*) dict->getObject("LoadReduction");
+		if (reduction != 0 && reduction->unsigned8BitValue() < numberOfReductions)
+			Throttler->controller.loads.reduction = reduction->unsigned8BitValue();
+		
+		OSNumber* shortAverage = (OSNumber*) dict->getObject("ShortAverage");
+		if (shortAverage != 0 && shortAverage->unsigned8BitValue() >= 1 && shortAverage->unsigned8BitValue() <= 8)
+			Throttler->controller.loads.shortShift = shortAverage->unsigned8BitValue();
+		
+		OSNumber* longAverage = (OSNumber*) dict->getObject("LongAverage");
+		if (longAverage != 0 && longAverage->unsigned8BitValue() >= 1 && longAverage->unsigned8BitValue() <= 8)
+			Throttler->controller.loads.longShift = longAverage->unsigned8BitValue();
+		
+		OSNumber* memBoundIPC = (OSNumber*) dict->getObject("MemBoundIPC");
+		if (memBoundIPC != 0)
+			Throttler->controller.memBoundIPC = memBoundIPC->unsigned16BitValue();
+		
+		OSNumber* memBoundLoss = (OSNumber*) dict->getObject("MemBoundLoss");
+		if (memBoundLoss != 0 && memBoundLoss->unsigned8BitValue() < 100)
+			Throttler->controller.memBoundLoss = memBoundLoss->unsigned8BitValue();
+		
+		OSNumber* boostPState = (OSNumber*) dict->getObject("BoostPState");
+		if (boostPState != 0)
+			Throttler->controller.boostPState = boostPState->unsigned8BitValue();
+		
+		OSNumber* boostHold = (OSNumber*) dict->getObject("BoostHold");
+		if (boostHold != 0)
+			Throttler->controller.boostHoldMS = boostHold->unsigned32BitValue();
+		
+		OSNumber* boostPoll = (OSNumber*) dict->getObject("BoostPoll");
+		if (boostPoll != 0 && boostPoll->unsigned32BitValue() >= 10)
+			Throttler->setBoostPoll(boostPoll->unsigned32BitValue());
+		
+		OSNumber* oscFlips = (OSNumber*) dict->getObject("OscillationFlips");
+		if (oscFlips != 0 && oscFlips->unsigned8BitValue() != 1)
+			Throttler->controller.damper.flips = oscFlips->unsigned8BitValue();
+		
+		OSNumber* oscWindow = (OSNumber*) dict->getObject("OscillationWindow");
+		if (oscWindow != 0 && oscWindow->unsigned32BitValue() > 0)
+			Throttler->controller.damper.windowMS = oscWindow->unsigned32BitValue();
+		
+		OSNumber* oscHold = (OSNumber*) dict->getObject("OscillationHold");
+		if (oscHold != 0)
+			Throttler->controller.damper.holdMS = oscHold->unsigned32BitValue();
+		
+		OSNumber* transitionRate = (OSNumber*) dict->getObject("TransitionRate");
+		if (transitionRate != 0)
+			Throttler->controller.limiter.ratePerS = transitionRate->unsigned16BitValue();
+		
+		OSNumber* transitionBurst = (OSNumber*) dict->getObject("TransitionBurst");
+		if (transitionBurst != 0 && transitionBurst->unsigned16BitValue() >= 1)
+			Throttler->controller.limiter.burst = transitionBurst->unsigned16BitValue();
+		
+		OSNumber* tjMax = (OSNumber*) dict->getObject("TjMax");
+		if (tjMax != 0 && tjMax->unsigned8BitValue() > 0 && tjMax->unsigned8BitValue() <= 127)
+			Throttler->controller.thermal.tjMax = tjMax->unsigned8BitValue();
+		
+		OSNumber* thermalSoft = (OSNumber*) dict->getObject("ThermalSoft");
+		OSNumber* thermalHard = (OSNumber*) dict->getObject("ThermalHard");
+		if (thermalSoft != 0 && thermalHard != 0 && (thermalSoft->unsigned8BitValue() == 0
+		    || thermalHard->unsigned8BitValue() < thermalSoft->unsigned8BitValue())) {
+			Throttler->controller.thermal.softMargin = thermalSoft->unsigned8BitValue();
+			Throttler->controller.thermal.hardMargin = thermalHard->unsigned8BitValue();
+		}
+		
+		OSNumber* thermalLimit = (OSNumber*) dict->getObject("ThermalLimit");
+		if (thermalLimit != 0 && thermalLimit->unsigned8BitValue() <= 127)
+			Throttler->controller.thermalBudget.limitMargin = thermalLimit->unsigned8BitValue();
+		
+		OSNumber* thermalBoostMin = (OSNumber*) dict->getObject("ThermalBoostMin");
+		if (thermalBoostMin != 0)
+			Throttler->controller.thermalBudget.boostMinMS = thermalBoostMin->unsigned32BitValue();
+		
+		OSBoolean* skipCostly = (OSBoolean*) dict->getObject("SkipCostlyTransitions");
+		if (skipCostly != 0)
+			Throttler->controller.skipCostly = skipCostly->getValue();
+		
+		OSString* governor = (OSString*) dict->getObject("Governor");
+		if (governor != 0 && !Throttler->controller.selectGovernor(governor->getCStringNoCopy()))
+			warn("Unknown governor %s, using %s\n", governor->getCStringNoCopy(), Throttler->controller.governorName());
+		
+		OSNumber* pidKp = (OSNumber*) dict->getObject("PIDKp");
+		if (pidKp != 0)
+			Throttler->controller.pid.kp = pidKp->unsigned16BitValue();
+		
+		OSNumber* pidKi = (OSNumber*) dict->getObject("PIDKi");
+		if (pidKi != 0)
+			Throttler->controller.pid.ki = pidKi->unsigned16BitValue();
+		
+		OSNumber* pidKd = (OSNumber*) dict->getObject("PIDKd");
+		if (pidKd != 0)
+			Throttler->controller.pid.kd = pidKd->unsigned16BitValue();
+		
+		OSNumber* pidFilter = (OSNumber*) dict->getObject("PIDFilter");
+		if (pidFilter != 0 && pidFilter->unsigned16BitValue() >= 1 && pidFilter->unsigned16BitValue() <= 256)
+			Throttler->controller.pid.dFilter = pidFilter->unsigned16BitValue();
+		
+		OSNumber* pidDeadband = (OSNumber*) dict->getObject("PIDDeadband");
+		if (pidDeadband != 0)
+			Throttler->controller.pid.deadband = (pidDeadband->unsigned16BitValue()) * 10;
+		
+		OSNumber* ondemandUp = (OSNumber*) dict->getObject("OndemandUpThreshold");
+		if (ondemandUp != 0 && ondemandUp->unsigned16BitValue() <= 100)
+			Throttler->controller.ondemand.upThreshold = (ondemandUp->unsigned16BitValue()) * 10;
+		
+		OSNumber* samplingDown = (OSNumber*) dict->getObject("OndemandSamplingDownFactor");
+		if (samplingDown != 0 && samplingDown->unsigned16BitValue() >= 1)
+			Throttler->controller.ondemand.samplingDown = samplingDown->unsigned16BitValue();
+		
+		OSNumber* downStep = (OSNumber*) dict->getObject("OndemandDownStep");
+		if (downStep != 0 && downStep->unsigned8BitValue() >= 1)
+			Throttler->controller.ondemand.downStep = downStep->unsigned8BitValue();
+		
+		OSNumber* freqStep = (OSNumber*) dict->getObject("FreqStep");
+		if (freqStep != 0 && freqStep->unsigned8BitValue() >= 1 && freqStep->unsigned8BitValue() <= 100)
+			Throttler->controller.conservative.freqStep = freqStep->unsigned8BitValue();
+		
+		OSNumber* conservativeRate = (OSNumber*) dict->getObject("ConservativeRate");
+		if (conservativeRate != 0 && conservativeRate->unsigned32BitValue() >= 10)
+			Throttler->controller.conservative.rateMS = conservativeRate->unsigned32BitValue();
+		
+		OSNumber* markovQuantile = (OSNumber*) dict->getObject("MarkovQuantile");
+		if (markovQuantile != 0 && markovQuantile->unsigned8BitValue() >= 50 && markovQuantile->unsigned8BitValue() <= 100)
+			Throttler->controller.markov.quantile = markovQuantile->unsigned8BitValue();
+		
+		OSNumber* idlePower = (OSNumber*) dict->getObject("IdlePower");
+		if (idlePower != 0)
+			Throttler->controller.energy.idlePower = idlePower->unsigned32BitValue();
+		
+		OSNumber* raceIdle = (OSNumber*) dict->getObject("RaceIdle");
+		if (raceIdle != 0 && raceIdle->unsigned16BitValue() < 1000)
+			Throttler->controller.race.idleLoad = raceIdle->unsigned16BitValue();
+		
+		OSNumber* raceSpell = (OSNumber*) dict->getObject("RaceSpell");
+		if (raceSpell != 0 && raceSpell->unsigned8BitValue() >= 1)
+			Throttler->controller.race.maxSpell = raceSpell->unsigned8BitValue();
 	}
 	
 	totalThrottles = 0;
@@ -353,10 +551,16 @@ bool com_reidburke_air_IntelEnhancedSpeedStep::start(IOService *provider) {
 	strcpy(originalVoltages, voltageList);
 	delete[] voltageList;
 	
+	// What every switch really costs, for the auto-throttler
+	calibrateTransitions();
+	char* latencyMatrix = getLatencyMatrix();
+	strlcpy(transitionLatencies, latencyMatrix, sizeof(transitionLatencies));
+	delete[] latencyMatrix;
 	
 	sysctl_register_oid(&sysctl__kern_cputhrottle_curfreq); 
 	sysctl_register_oid(&sysctl__kern_cputhrottle_curvolt);
 	sysctl_register_oid(&sysctl__kern_cputhrottle_freqs);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_latency);
 	sysctl_register_oid(&sysctl__kern_cputhrottle_usage);
 	sysctl_register_oid(&sysctl__kern_cputhrottle_avgfreq);
 	sysctl_register_oid(&sysctl__kern_cputhrottle_factoryvolts);
@@ -369,6 +573,11 @@ bool com_reidburke_air_IntelEnhancedSpeedStep::start(IOService *provider) {
 		throttleAllCPUs(&PStates[DefaultPState]); // then throttle to that value
 	}
 	
+	// Pick up what the target tuner learned before a reload
+	OSData* tunerState = OSDynamicCast(OSData, provider->getProperty(tunerStateKey));
+	if (tunerState && Throttler->controller.tuner.restore(tunerState->getBytesNoCopy(), tunerState->getLength()))
+		dbg("Auto-tune state restored, target %d%%\n", Throttler->controller.tuner.target() / 10);
+	
 	// Now turn on our auto-throttler
 	if (Throttler->setup((OSObject*) Throttler) == false)
 		warn("Auto-throttler could not be setup, start it manually later.\n");
@@ -382,11 +591,20 @@ void com_reidburke_air_IntelEnhancedSpeedStep::stop(IOService *provider) {
 	dbg("Shutting down\n");
 	if (Throttler) {
 		Throttler->destruct();
+		// Leave what the target tuner learned on the provider, it outlives us
+		TunerState state;
+		Throttler->controller.tuner.save(&state);
+		OSData* tunerState = OSData::withBytes(&state, sizeof(state));
+		if (tunerState) {
+			provider->setProperty(tunerStateKey, tunerState);
+			tunerState->release();
+		}
 		Throttler->release();
 		Throttler = 0;
 	}
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_curfreq); 
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_freqs);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_latency);
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_curvolt);
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_avgfreq);
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_factoryvolts);
@@ -413,67 +631,41 @@ bool isConstantTSC() {
 		return true;
 }
 
-void checkForPenryn() {
-	uint8_t cpumodel = (cpuid_info()->cpuid_extmodel << 4) + cpuid_info()->cpuid_model;
-	Is45nmPenryn = (cpuid_info()->cpuid_family == 6) && (cpumodel >= 0x17);
-	if (Is45nmPenryn)
-		dbg("On your processor, voltages can be changed in 12.5 mV steps\n");
-	else
-		dbg("On your processor, voltages can be changed in 16 mV steps\n");
-}
-
-void checkForNby2Ratio() {
-	uint64_t sts;
-	sts = rdmsr64(INTEL_MSR_PERF_STS);
-	Nby2Ratio = (sts & (1ULL << 46)); // bit 46 is set
+bool hasFixedCounters() {
+	/* CPUID leaf 0xA, Intel SDM vol. 3B 18.2 */
+	uint32_t reg[4];
+	do_cpuid(0, reg);
+	if (reg[eax] < 0xa) return false;
+	do_cpuid(0xa, reg);
+	uint8_t version = reg[eax] & 0xff;
+	uint8_t fixed = reg[edx] & 0x1f;
+	dbg("Performance monitoring version %d, %d fixed counters\n", version, fixed);
+	return version >= 2 && fixed >= 2;
 }
 
-uint16_t getCurrentVoltage() {
-	// Apple recommends not to return cached value, but to read it from the processor
-	uint64_t msr = rdmsr64(INTEL_MSR_PERF_STS);
-	return VID_to_mV(VID(msr));
+bool hasDTS() {
+	uint32_t reg[4];
+	do_cpuid(0, reg);
+	if (reg[eax] < 6) return false;
+	do_cpuid(6, reg);
+	return reg[eax] & 1;
 }
 
-uint16_t getCurrentFrequency() {
-	uint64_t msr = rdmsr64(INTEL_MSR_PERF_STS);
-	return FID_to_MHz(FID(msr));
-}
-
-uint16_t VID_to_mV(uint8_t VID) {
-	if (Is45nmPenryn)
-		return (((int)VID * 125) + 7125) / 10; // to avoid using float
-	else
-		return (((int)VID * 16) + 700);
+bool hasAPERF() {
+	uint32_t reg[4];
+	do_cpuid(0, reg);
+	if (reg[eax] < 6) return false;
+	do_cpuid(6, reg);
+	return reg[ecx] & 1;
 }
 
-uint8_t mV_to_VID(uint16_t mv) {
+void checkForPenryn() {
+	uint8_t cpumodel = (cpuid_info()->cpuid_extmodel << 4) + cpuid_info()->cpuid_model;
+	Is45nmPenryn = (cpuid_info()->cpuid_family == 6) && (cpumodel >= 0x17);
 	if (Is45nmPenryn)
-		return ((mv * 10) - 7125) / 125;
+		dbg("On your processor, voltages can be changed in 12.5 mV steps\n");
 	else
-		return (mv - 700) / 16;
-}
-
-inline uint16_t FID_to_MHz(uint8_t x) {
-	bool nby2 = x & 0x80;
-	uint8_t realfid = x & 0x7f; // removes the bit from 0x80
-	if (nby2)
-		realfid /= 2;
-	return realfid * (FSB / 1000000ULL);
-}
-
-static inline uint32_t FID_to_Hz(uint8_t x) {
-	bool nby2 = x & 0x80;
-	uint8_t realfid = x & 0x7f;
-	if (nby2)
-		realfid /= 2;
-	return realfid * FSB;
-}
-
-inline uint8_t MHz_to_FID(uint16_t x) {
-	uint8_t realfid = x / (FSB / 1000000ULL);
-	if (Nby2Ratio && x < 1000) // FIXME: use n/2 for only <1ghz frequencies?
-		realfid = (realfid*2) | 0x80;
-	return realfid;
+		dbg("On your processor, voltages can be changed in 16 mV steps\n");
 }
 
 void loadPStateOverride(OSArray* dict) {
@@ -485,8 +677,9 @@ void loadPStateOverride(OSArray* dict) {
 		PStates[i].Frequency		= MHz_to_FID(PStates[i].AcpiFreq); // this accounts for N/2 automatically
 		PStates[i].OriginalVoltage	= mV_to_VID(((OSNumber*) onePstate->getObject(1))->unsigned16BitValue());
 		PStates[i].Voltage		= PStates[i].OriginalVoltage;
+		PStates[i].Power		= onePstate->getCount() > 2 ? ((OSNumber*) onePstate->getObject(2))->unsigned32BitValue() : 0;
 		PStates[i].TimesChosen		= 0;
-		dbg("P-State %d: %d MHz at %d mV\n", i, PStates[i].AcpiFreq, VID_to_mV(PStates[i].OriginalVoltage));
+		dbg("P-State %d: %d MHz at %d mV, %d mW\n", i, PStates[i].AcpiFreq, VID_to_mV(PStates[i].OriginalVoltage), PStates[i].Power);
 	}
 	info("Loaded %d PStates from Info.plist\n", NumberOfPStates);
 }
@@ -551,6 +744,7 @@ bool createPStateTable(PState* pS, unsigned int* numStates) {
 			PStates[i].OriginalVoltage	= maxVID - (i*((maxVID - minVID) / NumberOfPStates));
 			PStates[i].Voltage		= PStates[i].OriginalVoltage;
 			PStates[i].Latency		= 110;
+			PStates[i].Power		= 0;
 			PStates[i].TimesChosen		= 0;
 		}
 		
@@ -559,6 +753,7 @@ bool createPStateTable(PState* pS, unsigned int* numStates) {
 		PStates[0].OriginalVoltage	= maxVID;
 		PStates[0].Voltage		= PStates[0].OriginalVoltage;
 		PStates[0].Latency		= 110;
+		PStates[0].Power		= 0;
 		PStates[0].TimesChosen		= 0;
 		MaxLatency			= PStates[0].Latency;
 		info("Using %d PStates (auto-created, may not be optimal).\n", NumberOfPStates);
@@ -598,6 +793,7 @@ bool createPStateTable(PState* pS, unsigned int* numStates) {
 		PStates[i].OriginalVoltage	= VID(ctl);
 		PStates[i].Voltage		= PStates[i].OriginalVoltage; // initially same
 		PStates[i].Latency		= latency;
+		PStates[i].Power		= power;
 		PStates[i].TimesChosen		= 0;
 		
 		if (latency > MaxLatency) MaxLatency = latency;
@@ -614,54 +810,6 @@ bool createPStateTable(PState* pS, unsigned int* numStates) {
 	return true;
 }
 
-/**************************************************************************************************/
-/* Throttling functions */
-
-void throttleAllCPUs(PState* p) {
-	dbg("Starting throttle with CTL 0x%x\n", CTL(p->Frequency, p->Voltage));
-	IOSimpleLockLock(Lock);
-	
-	mp_rendezvous(disableInterrupts, throttleCPU, enableInterrupts, p);
-	IODelay(p->Latency); // maybe wait longer?
-	
-	totalThrottles++;
-	
-	IOSimpleLockUnlock(Lock);
-	dbg("Throttle done.\n");
-}
-
-void throttleCPU(void *t) {
-	uint64_t msr;
-	PState p;
-	uint32_t newfreq, oldfreq;
-
-	bcopy(t,&p,sizeof(PState)); // get the ctl we want
-	
-	msr = rdmsr64(INTEL_MSR_PERF_STS); // read current MSR
-	
-	// For clock recalibration
-	oldfreq = FID_to_Hz(FID(msr));
-	// blank out last 32 bits and put our ctl there
-	msr = (msr & 0xffffffffffff0000ULL) | CTL(p.Frequency, mV_to_VID(1000));
-	newfreq = FID_to_Hz(FID(msr)); // after setting ctl in msr
-	
-	if (RtcFixKernel && !ConstantTSC) {
-		rtc_clock_stepping(newfreq, oldfreq);
-	}
-	
-	wrmsr64(INTEL_MSR_PERF_CTL, msr); // and write it to the processor
-	
-	if (RtcFixKernel && !ConstantTSC)
-		rtc_clock_stepped(newfreq, oldfreq);
-}
-
-void disableInterrupts(__unused void *t) {
-	InterruptsEnabled = ml_set_interrupts_enabled(false);
-}
-
-void enableInterrupts(__unused void *t) {
-	ml_set_interrupts_enabled(InterruptsEnabled);
-}
 
 
 
@@ -680,11 +828,15 @@ static int iess_handle_targetload SYSCTL_HANDLER_ARGS
 		if (!Throttler) return kIOReturnError;
 		if (target > 95) return kIOReturnError;
 		dbg("Setting autothrottle target to %d\n", target*10);
-		Throttler->targetCPULoad = target * 10;
+		if (Throttler->controller.tuner.enabled) {
+			dbg("Auto-tuning of the target turned off\n");
+			Throttler->controller.tuner.enabled = false;
+		}
+		Throttler->controller.targetCPULoad = target * 10;
 		
 	} else {
 		if (!Throttler) return kIOReturnError;
-		int target = Throttler->targetCPULoad / 10;
+		int target = Throttler->controller.targetCPULoad / 10;
 		err = SYSCTL_OUT(req, &target, sizeof(int));
 	}
 	return err;
@@ -692,6 +844,628 @@ static int iess_handle_targetload SYSCTL_HANDLER_ARGS
 
 SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_targetload,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_targetload,    "I", "Auto-throttle target CPU load");
 
+/* arg2: 0 = on/off, 1 = epoch in ms, 2 = missed demand budget in permille */
+static int iess_handle_autotune SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	TargetTuner& tuner = Throttler->controller.tuner;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0 ? (value != 0 && value != 1) : arg2 == 1 ? value < 1000 : (value < 0 || value > 1000))
+			return kIOReturnError;
+		dbg("Setting auto-tune %s to %d\n", arg2 == 0 ? "state" : arg2 == 1 ? "epoch" : "budget", value);
+		if (arg2 == 0) {
+			if (value && !tuner.enabled) Throttler->controller.targetCPULoad = tuner.target();
+			tuner.enabled = value;
+		} else if (arg2 == 1) {
+			tuner.epochMS = value;
+		} else {
+			tuner.missBudget = value;
+		}
+	} else {
+		int value = arg2 == 0 ? tuner.enabled : arg2 == 1 ? tuner.epochMS : tuner.missBudget;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/* One line per candidate target: target %, cost in mW per core of P0 work, missed permille, epochs */
+static int iess_handle_tunerstats SYSCTL_HANDLER_ARGS
+{
+	char list[48 * tunerArms];
+	int pos = 0;
+	if (!Throttler || req->newptr) return kIOReturnError;
+	const TargetTuner& tuner = Throttler->controller.tuner;
+	list[0] = '\0';
+	for (int i = 0; i < tunerArms && pos < (int) sizeof(list); i++)
+		pos += snprintf(list + pos, sizeof(list) - pos, "%d: %u %u %u\n", tunerTargets[i] / 10,
+				tuner.stats(i).cost, tuner.stats(i).miss, tuner.stats(i).epochs);
+	return SYSCTL_OUT(req, list, strlen(list) + 1);
+}
+
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_autotune,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_autotune, "I", "Tune the target CPU load online");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_tune_epoch,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_autotune, "I", "Auto-tune: ms spent on each candidate target");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_tune_budget,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_autotune, "I", "Auto-tune: time saturated below max allowed, permille");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_tune_stats,	CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_tunerstats, "A", "Auto-tune: target, mW per core of work, missed permille, epochs");
+
+static void setThreshold(ThrottleController& c, int which, int value) {
+	if (which) c.downThreshold = value;
+	else c.upThreshold = value;
+}
+
+static int iess_handle_threshold SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	uint16_t* threshold = arg2 ? &Throttler->controller.downThreshold : &Throttler->controller.upThreshold;
+	if (req->newptr) {
+		int percent;
+		err = SYSCTL_IN(req, &percent, sizeof(int));
+		if (err) return err;
+		if (percent < 0 || percent > 95) return kIOReturnError;
+		dbg("Setting autothrottle %s threshold to %d\n", arg2 ? "down" : "up", percent*10);
+		if (!Throttler->setTunable(&setThreshold, arg2, percent * 10)) return kIOReturnError;
+	} else {
+		int percent = *threshold / 10;
+		err = SYSCTL_OUT(req, &percent, sizeof(int));
+	}
+	return err;
+}
+
+static int iess_handle_mindwell SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	if (req->newptr) {
+		int dwell;
+		err = SYSCTL_IN(req, &dwell, sizeof(int));
+		if (err) return err;
+		if (dwell < 0) return kIOReturnError;
+		dbg("Setting autothrottle minimum dwell to %d ms\n", dwell);
+		Throttler->controller.minDwellMS = dwell;
+	} else {
+		int dwell = Throttler->controller.minDwellMS;
+		err = SYSCTL_OUT(req, &dwell, sizeof(int));
+	}
+	return err;
+}
+
+static void setLoadSource(ThrottleController& c, int, int value) {
+	c.runQueue.reset();
+	c.c0.reset(); // only read while it is the source
+	c.loadSource = value;
+}
+
+/* 0 = ticks only, 1 = ticks plus the scheduler's run queue, 2 = C0 residency from MPERF */
+static int iess_handle_loadsource SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	if (req->newptr) {
+		int source;
+		err = SYSCTL_IN(req, &source, sizeof(int));
+		if (err) return err;
+		if (source != loadFromTicks && source != loadFromRunQueue && source != loadFromAPERF) return kIOReturnError;
+		if (source == loadFromAPERF && !Throttler->clockCountersAvailable()) return kIOReturnError;
+		dbg("Setting autothrottle load source to %d\n", source);
+		if (!Throttler->setTunable(&setLoadSource, 0, source)) return kIOReturnError;
+	} else {
+		int source = Throttler->controller.loadSource;
+		err = SYSCTL_OUT(req, &source, sizeof(int));
+	}
+	return err;
+}
+
+/* arg2: 0 = reduction across CPUs, 1 = short average shift, 2 = long average shift */
+static int iess_handle_loadavg SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	LoadAggregator& loads = Throttler->controller.loads;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0 ? (value < 0 || value >= numberOfReductions) : (value < 1 || value > 8)) return kIOReturnError;
+		dbg("Setting load %s to %d\n", arg2 == 0 ? "reduction" : arg2 == 1 ? "short average" : "long average", value);
+		if (arg2 == 0)		loads.reduction = value;
+		else if (arg2 == 1)	loads.shortShift = value;
+		else			loads.longShift = value;
+	} else {
+		int value = arg2 == 0 ? loads.reduction : arg2 == 1 ? loads.shortShift : loads.longShift;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/*
+ * Writing "offset ms:pstate,...[@period ms]" runs that schedule from now on,
+ * an empty string stops it. Reading gives the schedule, whether it runs and
+ * how late its entries were.
+ */
+static int iess_handle_schedule SYSCTL_HANDLER_ARGS
+{
+	static char text[1024]; // too big for the kernel stack
+	int err = 0;
+	if (!Throttler || !Throttler->setupDone) return kIOReturnError;
+	if (req->newptr) {
+		text[0] = '\0';
+		err = sysctl_handle_string(oidp, text, sizeof(text), req);
+		if (err) return err;
+		dbg("Setting P-State schedule to \"%s\"\n", text);
+		return Throttler->runSchedule(text[0] ? text : 0) ? 0 : kIOReturnError;
+	}
+	const PStateSchedule& sched = Throttler->controller.schedule;
+	int pos = sched.print(text, sizeof(text));
+	if (pos < (int) sizeof(text))
+		snprintf(text + pos, sizeof(text) - pos, "\n%s, %llu run, %llu overtaken, late %llu usec mean, %llu max",
+			 sched.running() ? "running" : "stopped", sched.applied(), sched.skipped(),
+			 sched.meanLateNS() / 1000, sched.maxLateNS() / 1000);
+	return SYSCTL_OUT(req, text, strlen(text) + 1);
+}
+
+/* The QoS limits in force, then one line per holder: handle, floor, ceiling, references, ms left (0 = untimed) */
+static int iess_handle_qos SYSCTL_HANDLER_ARGS
+{
+	static char list[64 * (qosHolders + 1)];
+	uint64_t now;
+	int pos;
+	if (!Throttler || req->newptr) return kIOReturnError;
+	const QoSRequests& qos = Throttler->controller.qos;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &now);
+	pos = snprintf(list, sizeof(list), "floor %d ceiling %d\n", qos.floor(now), qos.ceiling(now));
+	for (int i = 0; i < qosHolders && pos < (int) sizeof(list); i++) {
+		const QoSHolder& h = qos.holder(i);
+		if (!h.handle || (h.expiresNS && h.expiresNS <= now)) continue;
+		pos += snprintf(list + pos, sizeof(list) - pos, "%u: %d %d %u %llu\n", h.handle, h.floor, h.ceiling, h.refs,
+				h.expiresNS ? (h.expiresNS - now) / 1000000 : 0);
+	}
+	return SYSCTL_OUT(req, list, strlen(list) + 1);
+}
+
+static void setBoost(ThrottleController& c, int which, int value) {
+	if (which == 0) c.boostPState = value;
+	else c.boostHoldMS = value;
+}
+
+/* arg2: 0 = P-State input raises to, 1 = hold in ms (0 = off), 2 = HIDIdleTime poll in ms */
+static int iess_handle_boost SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	ThrottleController& c = Throttler->controller;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0 ? (value < 0 || value >= NumberOfPStates) : arg2 == 1 ? value < 0 : value < 10)
+			return kIOReturnError;
+		dbg("Setting boost %s to %d\n", arg2 == 0 ? "P-State" : arg2 == 1 ? "hold" : "poll", value);
+		if (arg2 == 0) {
+			if (!Throttler->setTunable(&setBoost, 0, value)) return kIOReturnError;
+		} else if (arg2 == 1) {
+			if (value && !c.boostHoldMS && Throttler->setupDone && !Throttler->startInput())
+				return kIOReturnError;
+			if (!value) Throttler->stopInput();
+			if (!Throttler->setTunable(&setBoost, 1, value)) return kIOReturnError;
+		} else {
+			Throttler->setBoostPoll(value);
+		}
+	} else {
+		int value = arg2 == 0 ? c.boostPState : arg2 == 1 ? c.boostHoldMS : Throttler->boostPoll();
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static void setOscillation(ThrottleController& c, int which, int value) {
+	if (which == 0) c.damper.flips = value;
+	else if (which == 1) c.damper.windowMS = value;
+	else c.damper.holdMS = value;
+	c.damper.reset();
+}
+
+/* arg2: 0 = alternating changes that make an oscillation (0 = off), 1 = window in ms, 2 = hold in ms */
+static int iess_handle_oscillation SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	OscillationDamper& d = Throttler->controller.damper;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0 ? (value < 0 || value == 1 || value > 100) : arg2 == 1 ? value <= 0 : value < 0)
+			return kIOReturnError;
+		dbg("Setting oscillation %s to %d\n", arg2 == 0 ? "flips" : arg2 == 1 ? "window" : "hold", value);
+		if (!Throttler->setTunable(&setOscillation, arg2, value)) return kIOReturnError;
+	} else {
+		int value = arg2 == 0 ? d.flips : arg2 == 1 ? d.windowMS : d.holdMS;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static void setLimiter(ThrottleController& c, int which, int value) {
+	if (which == 0) c.limiter.ratePerS = value;
+	else c.limiter.burst = value;
+	c.limiter.reset();
+}
+
+/* arg2: 0 = P-State changes per second (0 = unlimited), 1 = changes in a row */
+static int iess_handle_limiter SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	TransitionLimiter& l = Throttler->controller.limiter;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < (arg2 == 0 ? 0 : 1) || value > 65535)
+			return kIOReturnError;
+		dbg("Setting transition %s to %d\n", arg2 == 0 ? "rate" : "burst", value);
+		if (!Throttler->setTunable(&setLimiter, arg2, value)) return kIOReturnError;
+	} else {
+		int value = arg2 == 0 ? l.ratePerS : l.burst;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static void setMemBound(ThrottleController& c, int which, int value) {
+	if (which == 0) {
+		c.ipc.reset();
+		c.memBoundIPC = value;
+	} else {
+		c.memBoundLoss = value;
+	}
+}
+
+/* arg2: 0 = IPC threshold (x1000, 0 = off), 1 = throughput loss budget (%) */
+static int iess_handle_membound SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < 0 || (arg2 == 0 && value > 0xffff) || (arg2 == 1 && value >= 100)) return kIOReturnError;
+		if (arg2 == 0 && value && !Throttler->countersAvailable()) return kIOReturnError;
+		dbg("Setting memory bound %s to %d\n", arg2 == 0 ? "IPC" : "loss", value);
+		if (!Throttler->setTunable(&setMemBound, arg2, value)) return kIOReturnError;
+	} else {
+		int value = arg2 == 0 ? Throttler->controller.memBoundIPC : Throttler->controller.memBoundLoss;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/*
+ * Average MHz each CPU ran at while busy in the last sample, after the requested one.
+ * Unless the load comes from APERF, the counters are only read for this, over effectiveSampleMS.
+ */
+static int iess_handle_effective SYSCTL_HANDLER_ARGS
+{
+	char list[16 * (max_cpus + 1)];
+	int pos = 0;
+	if (!Throttler || !Throttler->setupDone || req->newptr) return kIOReturnError;
+	const C0Tracker* measured = Throttler->measureEffective();
+	if (!measured) return kIOReturnError;
+	const C0Tracker& c0 = *measured;
+	pos += snprintf(list, sizeof(list), "%d", PStates[Throttler->controller.currentPState].AcpiFreq);
+	for (int i = 0; i < c0.cpus() && pos < (int) sizeof(list); i++)
+		pos += snprintf(list + pos, sizeof(list) - pos, " %d", c0.effectiveMHz(i));
+	return SYSCTL_OUT(req, list, strlen(list) + 1);
+}
+
+static int iess_handle_temperature SYSCTL_HANDLER_ARGS
+{
+	char list[8 * (max_cpus + 2)];
+	int pos = 0;
+	if (!Throttler || req->newptr) return kIOReturnError;
+	const ThermalCap& t = Throttler->controller.thermal;
+	pos += snprintf(list, sizeof(list), "%d", PStates[t.cap()].AcpiFreq);
+	for (int i = 0; i < t.cpus() && pos < (int) sizeof(list); i++)
+		pos += snprintf(list + pos, sizeof(list) - pos, " %d", t.temperature(i));
+	return SYSCTL_OUT(req, list, strlen(list) + 1);
+}
+
+static int iess_handle_thermal_model SYSCTL_HANDLER_ARGS
+{
+	char list[96];
+	if (!Throttler || req->newptr) return kIOReturnError;
+	const ThrottleController& c = Throttler->controller;
+	const ThermalModel& m = c.thermalBudget.model;
+	snprintf(list, sizeof(list), "%u %d %u %u %d %d %u", m.power(),
+		 c.thermal.valid() ? c.thermal.tjMax - c.thermal.margin() : -1,
+		 m.resistance(), m.tauMS(), m.ambient(),
+		 c.thermalBudget.active() ? PStates[c.thermalBudget.sustainable()].AcpiFreq : 0,
+		 c.thermalBudget.active() ? c.thermalBudget.boostLeftMS() : 0);
+	return SYSCTL_OUT(req, list, strlen(list) + 1);
+}
+
+/* arg2: 0 = TjMax, 1 = margin where the cap starts (0 = off), 2 = margin where only the slowest state is left,
+   3 = margin the budget plans up to (0 = off), 4 = ms at P0 the model has to promise before a boost */
+static int iess_handle_thermal SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	ThermalCap& t = Throttler->controller.thermal;
+	ThermalBudget& b = Throttler->controller.thermalBudget;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < 0 || (arg2 != 4 && value > 127)) return kIOReturnError;
+		if (arg2 == 1 && value && value <= t.hardMargin) return kIOReturnError;
+		if (arg2 == 2 && t.softMargin && value >= t.softMargin) return kIOReturnError;
+		dbg("Setting thermal %s to %d\n", arg2 == 0 ? "TjMax" : arg2 == 1 ? "soft margin" : arg2 == 2 ? "hard margin"
+		    : arg2 == 3 ? "budget limit" : "minimum boost", value);
+		if (arg2 == 0) t.tjMax = value;
+		else if (arg2 == 1) t.softMargin = value;
+		else if (arg2 == 2) t.hardMargin = value;
+		else if (arg2 == 3) b.limitMargin = value;
+		else b.boostMinMS = value;
+	} else {
+		int value = arg2 == 0 ? t.tjMax : arg2 == 1 ? t.softMargin : arg2 == 2 ? t.hardMargin
+			  : arg2 == 3 ? b.limitMargin : b.boostMinMS;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static int iess_handle_ipc SYSCTL_HANDLER_ARGS
+{
+	if (!Throttler || req->newptr) return kIOReturnError;
+	int value = Throttler->controller.ipc.ipc();
+	return SYSCTL_OUT(req, &value, sizeof(int));
+}
+
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_upthreshold,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_threshold, "I", "Load above target (%) before stepping up");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_downthreshold,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_threshold, "I", "Load below target (%) before stepping down");
+static int iess_handle_governor SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	char name[32];
+	if (!Throttler) return kIOReturnError;
+	strlcpy(name, Throttler->controller.governorName(), sizeof(name));
+	err = sysctl_handle_string(oidp, name, sizeof(name), req);
+	if (err || !req->newptr) return err;
+	if (!Throttler->controller.selectGovernor(name)) return kIOReturnError;
+	dbg("Auto-throttle governor %s selected\n", name);
+	return 0;
+}
+
+static int iess_handle_governors SYSCTL_HANDLER_ARGS
+{
+	char list[128];
+	int pos = 0;
+	if (!Throttler || req->newptr) return kIOReturnError;
+	for (int i = 0; i < numberOfGovernors; i++)
+		pos += snprintf(list + pos, sizeof(list) - pos, i ? " %s" : "%s", Throttler->controller.governor(i)->name());
+	return SYSCTL_OUT(req, list, pos + 1);
+}
+
+/* arg2: 0 = up_threshold in %, 1 = sampling_down_factor, 2 = down step */
+static int iess_handle_ondemand SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	OndemandGovernor& c = Throttler->controller.ondemand;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		switch (arg2) {
+			case 0:
+				if (value < 1 || value > 100) return kIOReturnError;
+				c.upThreshold = value * 10;
+				break;
+			case 1:
+				if (value < 1 || value > 1000) return kIOReturnError;
+				c.samplingDown = value;
+				break;
+			default:
+				if (value < 1 || value > 15) return kIOReturnError;
+				c.downStep = value;
+		}
+	} else {
+		int value = arg2 == 0 ? c.upThreshold / 10 : (arg2 == 1 ? c.samplingDown : c.downStep);
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/* arg2: 0 = kp, 1 = ki, 2 = kd, 3 = derivative filter, all in 1/256; 4 = deadband in % */
+static void setPIDGain(ThrottleController& c, int which, int value) {
+	int32_t* gains[] = { &c.pid.kp, &c.pid.ki, &c.pid.kd, &c.pid.dFilter, &c.pid.deadband };
+	*gains[which] = value;
+}
+
+static int iess_handle_pidgain SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	PIDController& pid = Throttler->controller.pid;
+	int32_t* gains[] = { &pid.kp, &pid.ki, &pid.kd, &pid.dFilter, &pid.deadband };
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < 0 || value > 4096) return kIOReturnError;
+		if (arg2 == 3 && (value < 1 || value > 256)) return kIOReturnError;
+		if (arg2 == 4) value *= 10;
+		if (!Throttler->setTunable(&setPIDGain, arg2, value)) return kIOReturnError;
+	} else {
+		int value = *gains[arg2];
+		if (arg2 == 4) value /= 10;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_governor,	CTLTYPE_STRING | CTLFLAG_RW, 0, 0, &iess_handle_governor,  "A", "Auto-throttle governor");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_governors,	CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_governors, "A", "Available auto-throttle governors");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_pid_kp,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_pidgain, "I", "PID proportional gain (1/256)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_pid_ki,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_pidgain, "I", "PID integral gain (1/256)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_pid_kd,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_pidgain, "I", "PID derivative gain (1/256)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_pid_filter,	CTLTYPE_INT | CTLFLAG_RW, 0, 3, &iess_handle_pidgain, "I", "PID derivative filter (1/256, 256 = off)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_pid_deadband,	CTLTYPE_INT | CTLFLAG_RW, 0, 4, &iess_handle_pidgain, "I", "PID error deadband (%)");
+/* arg2: 0 = freq_step in % of P0, 1 = sampling rate in ms */
+static int iess_handle_conservative SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	ConservativeGovernor& c = Throttler->controller.conservative;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0) {
+			if (value < 1 || value > 100) return kIOReturnError;
+			c.freqStep = value;
+		} else {
+			if (value < 10) return kIOReturnError;
+			c.rateMS = value;
+		}
+	} else {
+		int value = arg2 == 0 ? c.freqStep : c.rateMS;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static int iess_handle_markov SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	MarkovGovernor& m = Throttler->controller.markov;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < 50 || value > 100) return kIOReturnError;
+		m.quantile = value;
+	} else {
+		int value = m.quantile;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+static int iess_handle_idlepower SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	EnergyGovernor& e = Throttler->controller.energy;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (value < 0) return kIOReturnError;
+		e.idlePower = value;
+	} else {
+		int value = e.idlePower;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/* arg2: 0 = load (percent x 10) at or under which a sample was idle, 1 = longest mean busy spell in quanta */
+static int iess_handle_race SYSCTL_HANDLER_ARGS
+{
+	int err = 0;
+	if (!Throttler) return kIOReturnError;
+	RaceGovernor& r = Throttler->controller.race;
+	if (req->newptr) {
+		int value;
+		err = SYSCTL_IN(req, &value, sizeof(int));
+		if (err) return err;
+		if (arg2 == 0 ? (value < 0 || value >= 1000) : (value < 1 || value > 32)) return kIOReturnError;
+		if (arg2 == 0) r.idleLoad = value;
+		else r.maxSpell = value;
+	} else {
+		int value = arg2 == 0 ? r.idleLoad : r.maxSpell;
+		err = SYSCTL_OUT(req, &value, sizeof(int));
+	}
+	return err;
+}
+
+/* arg2: 0 = P-State changes, 1 = changes avoided compared to the proportional governor, 2 = skipped as too costly, 3 = boosts, 4 = QoS clamps,
+   5 = oscillations, 6 = changes damped, 7 = deferred by the limiter, 8 = of those coalesced,
+   9 = held back by the thermal cap, 10 = samples with a core at PROCHOT, 11 = thermal budget boosts */
+static int iess_handle_transitions SYSCTL_HANDLER_ARGS
+{
+	if (!Throttler || req->newptr) return kIOReturnError;
+	int64_t value = arg2 == 0 ? (int64_t) Throttler->controller.stateChanges
+		      : arg2 == 1 ? Throttler->controller.transitionsAvoided()
+		      : arg2 == 2 ? (int64_t) Throttler->controller.skippedChanges
+		      : arg2 == 3 ? (int64_t) Throttler->controller.boosts
+		      : arg2 == 4 ? (int64_t) Throttler->controller.qosClamped
+		      : arg2 == 5 ? (int64_t) Throttler->controller.damper.oscillations
+		      : arg2 == 6 ? (int64_t) Throttler->controller.damper.damped
+		      : arg2 == 7 ? (int64_t) Throttler->controller.deferredChanges
+		      : arg2 == 8 ? (int64_t) Throttler->controller.coalescedChanges
+		      : arg2 == 9 ? (int64_t) Throttler->controller.thermalCapped
+		      : arg2 == 10 ? (int64_t) Throttler->controller.thermal.hotUpdates
+				  : (int64_t) Throttler->controller.thermalBudget.boosts;
+	return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_freq_step,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_conservative, "I", "Conservative: target step per sample (% of max)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_conservative_rate, CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_conservative, "I", "Conservative: sampling period in ms");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_markov_quantile, CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_markov, "I", "Markov: percentile of the predicted load to provision for");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_race_idle,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_race, "I", "Race: load (% x 10) at or under which a sample counts as idle");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_race_spell,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_race, "I", "Race: longest mean busy spell in quanta that is still a burst");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_idle_power,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_idlepower, "I", "Energy: power of an idle core in mW");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transitions,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 0, &iess_handle_transitions, "Q", "P-State changes made by the auto-throttler");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transitions_avoided, CTLTYPE_QUAD | CTLFLAG_RD, 0, 1, &iess_handle_transitions, "Q", "P-State changes saved compared to the proportional governor");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transitions_skipped, CTLTYPE_QUAD | CTLFLAG_RD, 0, 2, &iess_handle_transitions, "Q", "P-State changes skipped as costing more than they gain");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transitions_deferred, CTLTYPE_QUAD | CTLFLAG_RD, 0, 7, &iess_handle_transitions, "Q", "P-State changes that waited for the rate limiter");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transitions_coalesced, CTLTYPE_QUAD | CTLFLAG_RD, 0, 8, &iess_handle_transitions, "Q", "Deferred P-State changes replaced by a later one");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_qos_clamped,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 4, &iess_handle_transitions, "Q", "Samples where client floors or ceilings overrode the governor");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_oscillations,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 5, &iess_handle_transitions, "Q", "Oscillations between P-States noticed");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_osc_damped,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 6, &iess_handle_transitions, "Q", "P-State changes dropped to hold an oscillation at the fast end");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_boosts,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 3, &iess_handle_transitions, "Q", "Input events that raised the speed");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_ondemand_up_threshold,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_ondemand, "I", "Ondemand: load (%) that jumps to P0");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_ondemand_sampling_down_factor, CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_ondemand, "I", "Ondemand: low samples before stepping down");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_ondemand_down_step,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_ondemand, "I", "Ondemand: P-States per step down");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_mindwell,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_mindwell,  "I", "Minimum time in a P-State in ms");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_loadsource,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_loadsource, "I", "Load input: 0 = CPU ticks, 1 = ticks and run queue, 2 = APERF/MPERF");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_reduction,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_loadavg, "I", "Per-CPU loads to one: 0 = max, 1 = mean, 2 = sum, 3 = second highest");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_short_average, CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_loadavg, "I", "Short load average moves 1/2^n of the way per sample");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_long_average, CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_loadavg, "I", "Long load average moves 1/2^n of the way per sample");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_qos,		CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_qos, "A", "Client floor and ceiling, then handle floor ceiling refs ms-left per holder");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_schedule,	CTLTYPE_STRING | CTLFLAG_RW, 0, 0, &iess_handle_schedule, "A", "Timed P-States: offset ms:pstate,...[@period ms], empty stops");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_boost_pstate,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_boost, "I", "Boost: P-State user input raises to at least");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_boost_hold,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_boost, "I", "Boost: ms held after input, 0 = off");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_boost_poll,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_boost, "I", "Boost: ms between looks for input");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transition_rate, CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_limiter, "I", "Limiter: P-State changes per second, 0 = unlimited");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_transition_burst, CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_limiter, "I", "Limiter: P-State changes let through in a row");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_osc_flips,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_oscillation, "I", "Oscillation: alternating changes in a row that make one, 0 = off");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_osc_window,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_oscillation, "I", "Oscillation: ms at most between the changes");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_osc_hold,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_oscillation, "I", "Oscillation: ms the fast end is held after the last busy spell");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_membound_ipc,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_membound, "I", "IPC x 1000 under which the speed is capped as memory bound, 0 = off");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_membound_loss,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_membound, "I", "Throughput (% of max) the memory bound cap may cost");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_curfreq_effective, CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_effective, "A", "Requested MHz, then the MHz each CPU delivered while busy (APERF/MPERF)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_temperature,	CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_temperature, "A", "Fastest MHz the thermal cap allows, then each CPU's temperature in C (-1 = no reading)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_tjmax,	CTLTYPE_INT | CTLFLAG_RW, 0, 0, &iess_handle_thermal, "I", "Thermal: TjMax in C the sensor readouts count down from");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_soft,	CTLTYPE_INT | CTLFLAG_RW, 0, 1, &iess_handle_thermal, "I", "Thermal: C below TjMax where the speed cap starts, 0 = off");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_hard,	CTLTYPE_INT | CTLFLAG_RW, 0, 2, &iess_handle_thermal, "I", "Thermal: C below TjMax where only the slowest state is left");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_limit,	CTLTYPE_INT | CTLFLAG_RW, 0, 3, &iess_handle_thermal, "I", "Thermal: C below TjMax the budget boosts up to once the model is fitted, 0 = off");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_boost_min, CTLTYPE_INT | CTLFLAG_RW, 0, 4, &iess_handle_thermal, "I", "Thermal: ms at P0 the model has to promise before a boost starts");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_model,	CTLTYPE_STRING | CTLFLAG_RD, 0, 0, &iess_handle_thermal_model, "A", "mW and hottest C of the last sample, the fit's C/W x 1000, tau ms and ambient C, sustainable MHz and ms left at P0 (0 while not fitted)");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_boosts,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 11, &iess_handle_transitions, "Q", "Times the thermal budget let P0 run past the sustainable state");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_thermal_capped, CTLTYPE_QUAD | CTLFLAG_RD, 0, 9, &iess_handle_transitions, "Q", "Throttles the thermal cap held below the speed asked for");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_prochot,	CTLTYPE_QUAD | CTLFLAG_RD, 0, 10, &iess_handle_transitions, "Q", "Samples that found a core at PROCHOT");
+SYSCTL_PROC  (_kern, OID_AUTO, cputhrottle_ipc,		CTLTYPE_INT | CTLFLAG_RD, 0, 0, &iess_handle_ipc, "I", "Instructions per cycle x 1000 of the busiest CPU in the last sample");
+
 bool AutoThrottler::setup(OSObject* owner) {
 	if (setupDone) return true;
 	
@@ -730,13 +1504,99 @@ bool AutoThrottler::setup(OSObject* owner) {
 		mach_cpu[cpu_count] = cpu->getMachProcessor();
 		if (cpu_count++ > max_cpus) break;
 	}
+	// Fixed counters on every one of them for the memory bound cap
+	countersEnabled = hasFixedCounters();
+	if (countersEnabled) {
+		mp_rendezvous(0, enableFixedCounters, 0, 0);
+		mp_rendezvous(0, readFixedCounters, 0, fixedCounters);
+		controller.ipc.reset();
+		controller.ipc.update(fixedCounters, cpu_count);
+	} else if (controller.memBoundIPC) {
+		warn("No fixed performance counters, memory bound detection disabled\n");
+		controller.memBoundIPC = 0;
+	}
+	hasClockCounters = hasAPERF();
+	if (!hasClockCounters && controller.loadSource == loadFromAPERF) {
+		warn("No APERF/MPERF, taking the load from the CPU ticks\n");
+		controller.loadSource = loadFromTicks;
+	}
+	hasThermalSensor = hasDTS();
+	if (!hasThermalSensor && controller.thermal.softMargin)
+		warn("No digital thermal sensor, the speed is not capped by temperature\n");
 	selfHost = host_priv_self();
 	if (workLoop->addEventSource(perfTimer) != kIOReturnSuccess) return false;
-	currentPState = NumberOfPStates - 1;
-	perfTimer->setTimeoutMS(throttleQuantum * (1 + currentPState));
+	if (!input.init(owner, (IOTimerEventSource::Action) &inputPollWrapper, workLoop)) return false;
+	scheduleTimer = IOTimerEventSource::timerEventSource(owner, (IOTimerEventSource::Action) &scheduleWrapper);
+	if (scheduleTimer == 0 || workLoop->addEventSource(scheduleTimer) != kIOReturnSuccess) return false;
+	limiterTimer = IOTimerEventSource::timerEventSource(owner, (IOTimerEventSource::Action) &limiterWrapper);
+	if (limiterTimer == 0 || workLoop->addEventSource(limiterTimer) != kIOReturnSuccess) return false;
+	controller.limiterTimer = limiterTimer;
+	if (controller.boostHoldMS && !startInput())
+		controller.boostHoldMS = 0;
+	controller.reset();
+	perfTimer->setTimeoutMS(controller.quantumMS * (1 + controller.currentPState));
 	clock_get_uptime(&lastTime);
-	if (!targetCPULoad) targetCPULoad = defaultTargetLoad; // % x10
 	sysctl_register_oid(&sysctl__kern_cputhrottle_targetload);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_autotune);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_tune_epoch);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_tune_budget);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_tune_stats);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_upthreshold);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_downthreshold);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_mindwell);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_loadsource);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_reduction);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_short_average);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_long_average);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_qos);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_schedule);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_boost_pstate);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_boost_hold);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_boost_poll);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transition_rate);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transition_burst);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_osc_flips);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_osc_window);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_osc_hold);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_membound_ipc);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_membound_loss);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_ipc);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_curfreq_effective);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_temperature);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_tjmax);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_soft);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_hard);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_limit);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_boost_min);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_model);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_boosts);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_thermal_capped);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_prochot);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_governor);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_governors);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_ondemand_up_threshold);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_ondemand_sampling_down_factor);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_ondemand_down_step);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_freq_step);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_conservative_rate);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_markov_quantile);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_idle_power);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_race_idle);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_race_spell);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transitions);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transitions_avoided);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transitions_skipped);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_boosts);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_oscillations);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_osc_damped);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_qos_clamped);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transitions_deferred);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_transitions_coalesced);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_pid_kp);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_pid_ki);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_pid_kd);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_pid_filter);
+	sysctl_register_oid(&sysctl__kern_cputhrottle_pid_deadband);
 	sysctl_register_oid(&sysctl__kern_cputhrottle_auto);
 	setupDone = true;
 	return true;
@@ -747,8 +1607,21 @@ void AutoThrottler::stop() {
 	enabled = false;
 	perfTimer->cancelTimeout();
 	perfTimer->disable();
+	stopInput();
+	runSchedule(0);
 	// Settle time in case we were just stepping
 	IOSleep(1024);
+	input.free();
+	if (scheduleTimer) {
+		workLoop->removeEventSource(scheduleTimer);
+		releaseObj(scheduleTimer);
+	}
+	controller.limiterTimer = 0;
+	if (limiterTimer) {
+		limiterTimer->cancelTimeout();
+		workLoop->removeEventSource(limiterTimer);
+		releaseObj(limiterTimer);
+	}
 	if (workLoop) workLoop->removeEventSource(perfTimer);	// Remove our event sources
 	dbg("Autothrottler stopped.\n");
 	setupDone = false;
@@ -758,9 +1631,15 @@ void AutoThrottler::setEnabled(bool _enabled) {
 	if (_enabled) {
 		// asked to turn on
 		perfTimer->enable();
+		perfTimer->setTimeoutMS(controller.quantumMS);
 	} else {
+		enabled = false; // first, so a limiterTimer that fires meanwhile does nothing
 		perfTimer->cancelTimeout();
-		perfTimer->disable();
+		controller.cancelPending();
+		if (hasThermalSensor && setupDone)	// keeps an eye on the temperature for manual settings
+			watchManual();
+		else
+			perfTimer->disable();
 	}
 	enabled = _enabled;
 }
@@ -772,7 +1651,71 @@ bool AutoThrottler::getEnabled() {
 void AutoThrottler::destruct() {
 	if (enabled) enabled = false;
 	if (setupDone) stop();
+	if (countersEnabled) {
+		mp_rendezvous(0, disableFixedCounters, 0, 0);
+		countersEnabled = false;
+	}
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_targetload);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_autotune);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_tune_epoch);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_tune_budget);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_tune_stats);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_upthreshold);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_downthreshold);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_mindwell);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_loadsource);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_reduction);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_short_average);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_long_average);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_qos);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_schedule);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_boost_pstate);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_boost_hold);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_boost_poll);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transition_rate);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transition_burst);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_osc_flips);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_osc_window);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_osc_hold);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_membound_ipc);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_membound_loss);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_ipc);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_curfreq_effective);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_temperature);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_tjmax);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_soft);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_hard);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_limit);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_boost_min);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_model);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_boosts);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_thermal_capped);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_prochot);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_governor);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_governors);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_ondemand_up_threshold);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_ondemand_sampling_down_factor);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_ondemand_down_step);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_freq_step);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_conservative_rate);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_markov_quantile);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_idle_power);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_race_idle);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_race_spell);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transitions);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transitions_avoided);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transitions_skipped);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_boosts);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_oscillations);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_osc_damped);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_qos_clamped);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transitions_deferred);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_transitions_coalesced);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_pid_kp);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_pid_ki);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_pid_kd);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_pid_filter);
+	sysctl_unregister_oid(&sysctl__kern_cputhrottle_pid_deadband);
 	sysctl_unregister_oid(&sysctl__kern_cputhrottle_auto);
 	if (perfTimer) {
 		perfTimer->release();
@@ -788,13 +1731,10 @@ void AutoThrottler::destruct() {
 
 void AutoThrottler::GetCPUTicks(long* idle, long* total) {
 	mach_msg_type_number_t cpu_count_type;
-	unsigned int cpu_maxload = 0;
-	/* Superhai method */
-	unsigned int temp_ticks = 0;
-	for (int i = 0; i < cpu_count; i++)
+	int i;
+	for (i = 0; i < cpu_count; i++)
 	{
 		cpu_count_type = PROCESSOR_CPU_LOAD_INFO_COUNT;
-		total_ticks[i] = 0;
 		kern_return_t kret = processor_info(mach_cpu[i], PROCESSOR_CPU_LOAD_INFO, &selfHost,
 						    (processor_info_t) &cpu_load[i], &cpu_count_type);
 		if (kret != KERN_SUCCESS)
@@ -802,28 +1742,282 @@ void AutoThrottler::GetCPUTicks(long* idle, long* total) {
 			dbg("Error when reading cpu load on cpu %d (%x)", i, kret);
 			break;
 		}
-		cpu_load_temp[i] = cpu_load[i];
-		for (int t = 0; t < CPU_STATE_MAX; t++)
-		{
-			(cpu_load_temp[i].cpu_ticks[t]) -= (cpu_load_last[i].cpu_ticks[t]);
-			total_ticks[i] += (cpu_load_temp[i].cpu_ticks[t]);
-		}
-		load_ticks[i] = total_ticks[i] - cpu_load_temp[i].cpu_ticks[CPU_STATE_IDLE];
-		if ((load_ticks[i]) > temp_ticks)
-		{
-			temp_ticks = load_ticks[i];
-			cpu_maxload = i;
-		}
-		cpu_load_last[i] = cpu_load[i];
 	}
+	controller.ticks.update(cpu_load, i, idle, total);
 	
-	*total = total_ticks[cpu_maxload];
-	*idle  = *total - load_ticks[cpu_maxload];
-	
-	dbg("Autothrottle: CPU load %d /10 pc\n", (1000 * (*total - *idle)) / *total);
+	if (*total) dbg("Autothrottle: CPU load %d /10 pc\n", (1000 * (*total - *idle)) / *total);
+}
+
+void AutoThrottler::GetRunQueue() {
+	host_load_info_data_t loadinfo;
+	mach_msg_type_number_t count = HOST_LOAD_INFO_COUNT;
+	kern_return_t kret = host_statistics(selfHost, HOST_LOAD_INFO, (host_info_t) &loadinfo, &count);
+	if (kret != KERN_SUCCESS) {
+		dbg("Error when reading the load average (%x)", kret);
+		return;
+	}
+	controller.runQueue.update(&loadinfo, cpu_count);
+}
+
+void AutoThrottler::GetCounters() {
+	CounterReads reads = { 0, 0, 0 };
+	if (hasClockCounters && controller.loadSource == loadFromAPERF)
+		reads.clocks = clockCounters;
+	if (controller.memBoundIPC)
+		reads.fixed = fixedCounters;
+	if (hasThermalSensor)
+		reads.thermal = thermalStatus;
+	if (!reads.clocks && !reads.fixed && !reads.thermal) return;
+	mp_rendezvous(0, readCounters, 0, &reads);
+	if (reads.clocks) {
+		controller.c0.update(clockCounters, cpu_count);
+		if (controller.c0.valid())
+			dbg("Autothrottle: C0 load %d /10 pc, %d MHz\n", controller.c0.load(), controller.c0.effectiveMHz(0));
+	}
+	if (reads.fixed) {
+		controller.ipc.update(fixedCounters, cpu_count);
+		dbg("Autothrottle: IPC %d /1000\n", controller.ipc.ipc());
+	}
+	if (reads.thermal)
+		controller.thermal.update(thermalStatus, cpu_count);
+}
+
+void AutoThrottler::GetThermal() {
+	mp_rendezvous(0, readThermalStatus, 0, thermalStatus);
+	controller.thermal.update(thermalStatus, cpu_count);
 }
 
+void AutoThrottler::watchManual() {
+	if (enabled || !setupDone) return;
+	if (hasThermalSensor && FindClosestPState(getCurrentFrequency()) < (int) NumberOfPStates - 1)
+		perfTimer->setTimeoutMS(thermalGuardMS);
+	else
+		perfTimer->cancelTimeout(); // the slowest state can't be too fast
+}
+
+void AutoThrottler::guardManual() {
+	GetThermal();
+	int ceiling = controller.thermalCeiling();
+	if (FindClosestPState(getCurrentFrequency()) >= ceiling) return;
+	warn("Too hot for the manual setting, throttling to %d MHz\n", PStates[ceiling].AcpiFreq);
+	throttleAllCPUs(&PStates[ceiling]);
+	controller.thermalCapped++;
+	controller.throttledElsewhere();
+}
 
+const C0Tracker* AutoThrottler::measureEffective() {
+	if (!hasClockCounters) return 0;
+	if (controller.loadSource == loadFromAPERF) return &controller.c0; // kept up to date every sample
+	effective.reset();
+	mp_rendezvous(0, readClockCounters, 0, effectiveCounters);
+	effective.update(effectiveCounters, cpu_count);
+	IOSleep(effectiveSampleMS);
+	mp_rendezvous(0, readClockCounters, 0, effectiveCounters);
+	effective.update(effectiveCounters, cpu_count);
+	return &effective;
+}
+
+
+
+bool HIDIdleInputSource::init(OSObject* owner, IOTimerEventSource::Action action, IOWorkLoop* loop) {
+	if (!pollMS) pollMS = defaultBoostPoll;
+	workLoop = loop;
+	hidSystem = 0;
+	timer = IOTimerEventSource::timerEventSource(owner, action);
+	if (timer == 0) return false;
+	if (workLoop->addEventSource(timer) != kIOReturnSuccess) {
+		timer->release();
+		timer = 0;
+		return false;
+	}
+	return true;
+}
+
+void HIDIdleInputSource::free() {
+	stop();
+	if (timer) {
+		workLoop->removeEventSource(timer);
+		timer->release();
+		timer = 0;
+	}
+}
+
+bool HIDIdleInputSource::start() {
+	if (running()) return true;
+	if (!timer) return false;
+	OSIterator* iterator = IOService::getMatchingServices(IOService::serviceMatching(hidSystemClass));
+	if (iterator) {
+		hidSystem = OSDynamicCast(IORegistryEntry, iterator->getNextObject());
+		if (hidSystem) hidSystem->retain();
+		iterator->release();
+	}
+	if (!hidSystem || !lastEvent(&lastEventNS)) {
+		warn("No %s to watch for input, interactive boost disabled\n", hidSystemClass);
+		if (hidSystem) hidSystem->release();
+		hidSystem = 0;
+		return false;
+	}
+	timer->enable();
+	timer->setTimeoutMS(pollMS);
+	dbg("Watching %s every %d ms for input\n", hidSystemClass, pollMS);
+	return true;
+}
+
+void HIDIdleInputSource::stop() {
+	if (!running()) return;
+	timer->cancelTimeout();
+	timer->disable();
+	hidSystem->release();
+	hidSystem = 0;
+}
+
+bool HIDIdleInputSource::lastEvent(uint64_t* ns) {
+	uint64_t now, idle;
+	OSObject* property = hidSystem->copyProperty(hidIdleTimeKey);
+	if (!property) return false;
+	OSNumber* number = OSDynamicCast(OSNumber, property);
+	OSData* data = OSDynamicCast(OSData, property);
+	if (number)
+		idle = number->unsigned64BitValue();
+	else if (data && data->getLength() == sizeof(idle))
+		idle = *(const uint64_t*) data->getBytesNoCopy();
+	else {
+		property->release();
+		return false;
+	}
+	property->release();
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &now);
+	*ns = now > idle ? now - idle : 0;
+	return true;
+}
+
+void HIDIdleInputSource::poll() {
+	uint64_t ns;
+	if (!running()) return;
+	// Idle time only grows between events, so an event moves the last one on
+	if (lastEvent(&ns) && ns > lastEventNS + 1000000) {
+		lastEventNS = ns;
+		notify();
+	}
+	timer->setTimeoutMS(pollMS);
+}
+
+bool AutoThrottler::startInput() {
+	input.setHandler(inputEvent, this);
+	return input.start();
+}
+
+void AutoThrottler::stopInput() {
+	input.stop();
+}
+
+void AutoThrottler::inputEvent(void* owner) {
+	AutoThrottler* throttler = (AutoThrottler*) owner;
+	if (!throttler->enabled || !throttler->setupDone) return;
+	if (throttler->controller.boost())
+		dbg("Autothrottle: input, boosted to %d MHz\n", PStates[throttler->controller.currentPState].AcpiFreq);
+}
+
+void AutoThrottler::inputPollWrapper(OSObject* owner, IOTimerEventSource* src) {
+	((AutoThrottler*) owner)->input.poll();
+}
+
+bool AutoThrottler::runSchedule(const char* text) {
+	if (!setupDone) return false;
+	return workLoop->runAction(&scheduleAction, this, (void*) text) == kIOReturnSuccess;
+}
+
+IOReturn AutoThrottler::scheduleAction(OSObject* owner, void* text, void*, void*, void*) {
+	AutoThrottler* throttler = (AutoThrottler*) owner;
+	ThrottleController& c = throttler->controller;
+	c.stopSchedule(throttler->scheduleTimer);
+	if (!text) return kIOReturnSuccess;
+	if (!c.schedule.parse((const char*) text)) return kIOReturnError;
+	c.startSchedule(throttler->scheduleTimer);
+	return kIOReturnSuccess;
+}
+
+void AutoThrottler::scheduleWrapper(OSObject* owner, IOTimerEventSource* src) {
+	((AutoThrottler*) owner)->controller.scheduleEvent(src);
+}
+
+void AutoThrottler::limiterWrapper(OSObject* owner, IOTimerEventSource* src) {
+	AutoThrottler* throttler = (AutoThrottler*) owner;
+	if (!throttler->enabled || !throttler->setupDone) return;
+	throttler->controller.limiterEvent();
+}
+
+enum { qosCallAdd, qosCallRelease, qosCallReleaseOwner };
+
+struct QoSCall {
+	int		op;
+	uintptr_t	owner;
+	int		floor, ceiling;
+	uint32_t	timeoutMS;
+	uint32_t	handle;		// in for release, out for add
+};
+
+IOReturn AutoThrottler::qosAction(OSObject* owner, void* arg, void*, void*, void*) {
+	AutoThrottler* throttler = (AutoThrottler*) owner;
+	ThrottleController& c = throttler->controller;
+	QoSCall* call = (QoSCall*) arg;
+	uint64_t now;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &now);
+	switch (call->op) {
+		case qosCallAdd:
+			call->handle = c.qos.add(call->owner, call->floor, call->ceiling, call->timeoutMS, now);
+			if (!call->handle) return kIOReturnError;
+			break;
+		case qosCallRelease:
+			if (!c.qos.release(call->owner, call->handle)) return kIOReturnError;
+			break;
+		default:
+			c.qos.releaseOwner(call->owner);
+	}
+	// While auto-throttle is off the speed is the user's, the limits apply once it is back on
+	if (throttler->enabled && c.applyLimits())
+		dbg("QoS limits moved the CPU to %d MHz\n", PStates[c.currentPState].AcpiFreq);
+	return kIOReturnSuccess;
+}
+
+uint32_t AutoThrottler::qosAdd(uintptr_t owner, int floor, int ceiling, uint32_t timeoutMS) {
+	QoSCall call = { qosCallAdd, owner, floor, ceiling, timeoutMS, 0 };
+	if (!setupDone || workLoop->runAction(&qosAction, this, &call) != kIOReturnSuccess) return 0;
+	return call.handle;
+}
+
+bool AutoThrottler::qosRelease(uintptr_t owner, uint32_t handle) {
+	QoSCall call = { qosCallRelease, owner, 0, 0, 0, handle };
+	return setupDone && workLoop->runAction(&qosAction, this, &call) == kIOReturnSuccess;
+}
+
+void AutoThrottler::qosReleaseOwner(uintptr_t owner) {
+	QoSCall call = { qosCallReleaseOwner, owner, 0, 0, 0, 0 };
+	if (setupDone) workLoop->runAction(&qosAction, this, &call);
+	else controller.qos.releaseOwner(owner);
+}
+
+struct TunableCall {
+	TunableSetter	set;
+	int		which, value;
+};
+
+bool AutoThrottler::setTunable(TunableSetter set, int which, int value) {
+	if (!setupDone) { // no workloop, nothing running
+		set(controller, which, value);
+		return true;
+	}
+	TunableCall call = { set, which, value };
+	return workLoop->runAction(&tunableAction, this, &call) == kIOReturnSuccess;
+}
+
+IOReturn AutoThrottler::tunableAction(OSObject* owner, void* arg, void*, void*, void*) {
+	TunableCall* call = (TunableCall*) arg;
+	call->set(((AutoThrottler*) owner)->controller, call->which, call->value);
+	return kIOReturnSuccess;
+}
 
 bool perfTimerWrapper(OSObject* owner, IOTimerEventSource* src, int count) {
 	register AutoThrottler* objDriver = (AutoThrottler*) owner;
@@ -832,54 +2026,74 @@ bool perfTimerWrapper(OSObject* owner, IOTimerEventSource* src, int count) {
 
 
 bool AutoThrottler::perfTimerEvent(IOTimerEventSource* src, int count) {
-	uint32_t wantspeed,wantstep;
-	long idle, used, total;
-	uint64_t msr;
-	
-	msr = rdmsr64(INTEL_MSR_PERF_STS); // read current MSR
-	// For clock recalibration
-	
-
-	
+	long idle, total;
 	
-	if (!enabled || !setupDone) return false;
-	
-	// gather stats
-	PStates[currentPState].TimesChosen++;
-	totalTimerEvents++;
+	if (!setupDone) return false;
+	if (!enabled) {
+		if (!hasThermalSensor) return false;
+		guardManual();
+		watchManual();
+		return true;
+	}
 	
 	GetCPUTicks(&idle, &total);
-	
-	// Used = % used x 10
-	used = ((total - idle) * 1000) / total;
-	
-	// If used > 95% we can't really guess how much is needed, so step to highest speed
+	if (controller.loadSource == loadFromRunQueue)
+		GetRunQueue();
+	GetCounters();
+	controller.timerEvent(idle, total, perfTimer);
+	return true;
+}
 
-	if (FID(msr) ==! PStates[0].Frequency);
-	{
-		wantspeed = PStates[0].AcpiFreq;
-	}
-	wantstep = FindClosestPState(wantspeed);
-	if (VID(msr) == 975) goto check_soon;	
-	currentPState = wantstep; // Assume we got the one we wanted
-	if(VID(msr) ==! mV_to_VID(975));
-	{
-		PStates[currentPState].Voltage = mV_to_VID(975);
-	}
-	
-//
-		// blank out last 32 bits and put our ctl there
 
-//		
-	
-	throttleAllCPUs(&PStates[currentPState]);
-	
-	perfTimer->setTimeoutMS(throttleQuantum * (NumberOfPStates - wantstep)); // Make the delay until the next check proportional to the speed we picked
+/**********************************************************************************/
+/* User client                                                                    */
+
+#undef super
+#define super IOUserClient
+
+bool com_reidburke_air_IntelEnhancedSpeedStepUserClient::initWithTask(task_t task, void* securityID, UInt32 type) {
+	if (!super::initWithTask(task, securityID, type)) return false;
+	owningTask = task;
+	privileged = clientHasPrivilege(task, kIOClientPrivilegeAdministrator) == kIOReturnSuccess;
 	return true;
-	
-check_soon:
-	perfTimer->setTimeoutMS(throttleQuantum);
+}
+
+bool com_reidburke_air_IntelEnhancedSpeedStepUserClient::start(IOService* provider) {
+	if (!super::start(provider)) return false;
+	IOExternalMethod add = { 0, (IOMethod) &com_reidburke_air_IntelEnhancedSpeedStepUserClient::qosAdd,
+				 kIOUCScalarIScalarO, 3, 1 };
+	IOExternalMethod release = { 0, (IOMethod) &com_reidburke_air_IntelEnhancedSpeedStepUserClient::qosRelease,
+				     kIOUCScalarIScalarO, 1, 0 };
+	methods[kIESSQoSAdd] = add;
+	methods[kIESSQoSRelease] = release;
 	return true;
 }
 
+/* Also what clientDied() ends up in when the task goes away */
+IOReturn com_reidburke_air_IntelEnhancedSpeedStepUserClient::clientClose() {
+	if (Throttler) Throttler->qosReleaseOwner((uintptr_t) this);
+	terminate();
+	return kIOReturnSuccess;
+}
+
+IOExternalMethod* com_reidburke_air_IntelEnhancedSpeedStepUserClient::getTargetAndMethodForIndex(IOService** target, UInt32 index) {
+	if (index >= kIESSNumberOfMethods) return 0;
+	*target = this;
+	return &methods[index];
+}
 
+IOReturn com_reidburke_air_IntelEnhancedSpeedStepUserClient::qosAdd(void* floor, void* ceiling, void* timeoutMS, void* handle, void*, void*) {
+	int f = (int) (intptr_t) floor, c = (int) (intptr_t) ceiling;
+	if (!Throttler) return kIOReturnNotReady;
+	if (!privileged) return kIOReturnNotPrivileged; // a ceiling slows everyone else down just as much
+	uint32_t h = Throttler->qosAdd((uintptr_t) this, f, c, (uint32_t) (uintptr_t) timeoutMS);
+	if (!h) return kIOReturnError;
+	*(uint32_t*) handle = h;
+	dbg("QoS: floor %d ceiling %d for %d ms, handle %u\n", f, c, (int) (uintptr_t) timeoutMS, h);
+	return kIOReturnSuccess;
+}
+
+IOReturn com_reidburke_air_IntelEnhancedSpeedStepUserClient::qosRelease(void* handle, void*, void*, void*, void*, void*) {
+	if (!Throttler) return kIOReturnNotReady;
+	return Throttler->qosRelease((uintptr_t) this, (uint32_t) (uintptr_t) handle) ? kIOReturnSuccess : kIOReturnBadArgument;
+}
@@ -8,7 +8,12 @@
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOUserClient.h>
 #include "IOCPU.h" // This is not in Kernel IOKit framework, so have to redefine.
+#include "Throttling.h"
+#include "ThrottleController.h"
+#include "InputSource.h"
+#include "UserClientMethods.h"
 
 #include <i386/proc_reg.h>
 #include <i386/cpuid.h>
@@ -27,19 +32,46 @@
 #include <mach/processor.h>
 #include <mach/processor_info.h>
 
+/* Provider property the target tuner's TunerState is kept in across reloads */
+#define tunerStateKey	"IESSTunerState"
+
+/* Provider of the HIDIdleTime property the boost watches */
+#define hidSystemClass	"IOHIDSystem"
+#define hidIdleTimeKey	"HIDIdleTime"
+
+const uint32_t defaultBoostPoll = 50; // ms between looks at HIDIdleTime
+const uint32_t thermalGuardMS = 1000; // ms between temperature checks of a manual setting while auto-throttle is off
+const uint32_t effectiveSampleMS = 20; // ms kern.cputhrottle_effective measures over, unless the load is from APERF
+
 /*
- * This class holds information about each throttle state
+ * User input for the interactive boost. xnu has no in-kernel HID event hook
+ * a third party kext can register with, so this polls the HIDIdleTime
+ * property of IOHIDSystem (ns since the last event) every pollMS on the
+ * throttler's workloop, and reports an event whenever it went back since
+ * the last look. The timer calls poll() through the action given to init().
  */
-class PState {
+class HIDIdleInputSource : public InputSource {
 public:
-	uint16_t Frequency;		// processor clock speed (FID, not MHz)
-uint16_t AcpiFreq;		// as reported by ACPI (nice rounded) for display purposes
-	uint16_t Voltage;		// wanted voltage ID while on AC
-	uint16_t OriginalVoltage;	// The factory default voltage ID for this frequency
-	uint32_t Latency;		// how long to wait after writing to msr
-	uint64_t TimesChosen;		// how many times this Pstate was chosen to switch to
+	uint32_t	pollMS;
+
+	bool		init(OSObject* owner, IOTimerEventSource::Action action, IOWorkLoop* loop);
+	void		free();
+	virtual bool	start();
+	virtual void	stop();
+	void		poll();
+	bool		running() { return hidSystem != 0; }
+
+private:
+	bool		lastEvent(uint64_t* ns);	// uptime of the last input, from HIDIdleTime
+
+	IOWorkLoop*		workLoop;
+	IOTimerEventSource*	timer;
+	IORegistryEntry*	hidSystem;	// retained while running
+	uint64_t		lastEventNS;
 };
 
+/* Changes one of the controller's tunables, see AutoThrottler::setTunable() */
+typedef void (*TunableSetter)(ThrottleController& c, int which, int value);
 
 /*
  * Our auto-throttle controller
@@ -50,22 +82,26 @@ private:
 	IOWorkLoop*		workLoop;
 	IOTimerEventSource*	perfTimer;
 	bool			enabled;	// driver is autothrottling
-	uint8_t			currentPState;
 	uint64_t		lastTime;
 	host_t			selfHost;
-#define max_cpus 32
 	processor_t		mach_cpu[max_cpus];
 	uint8_t			cpu_count;
-	uint32_t		total_ticks[max_cpus];
-	uint32_t		load_ticks[max_cpus];
-	uint32_t		current_cpuload;
 	processor_cpu_load_info	cpu_load[max_cpus];
-	processor_cpu_load_info	cpu_load_temp[max_cpus];
-	processor_cpu_load_info	cpu_load_last[max_cpus];
+	FixedCounters		fixedCounters[max_cpus];
+	bool			countersEnabled;	// we switched the fixed counters on
+	ClockCounters		clockCounters[max_cpus];
+	bool			hasClockCounters;	// APERF/MPERF are there
+	C0Tracker		effective;		// kern.cputhrottle_effective's own, while c0 isn't kept up
+	ClockCounters		effectiveCounters[max_cpus];
+	uint64_t		thermalStatus[max_cpus];
+	bool			hasThermalSensor;	// feeds controller.thermal
+	HIDIdleInputSource	input;		// boosts the controller on user input
+	IOTimerEventSource*	scheduleTimer;	// runs controller.schedule
+	IOTimerEventSource*	limiterTimer;	// makes changes controller.limiter held back
 
 public:
 	bool setupDone;	// setup has been done, ready to throttle
-	uint16_t targetCPULoad;
+	ThrottleController controller;	// the actual policy, see ThrottleController.h
 	bool setup(OSObject* owner); // Initialize the throttler
 	void stop();
 	void setEnabled(bool _enabled);
@@ -73,66 +109,72 @@ public:
 	void destruct();
 	
 	void GetCPUTicks(long* idle, long* total);
+	void GetRunQueue();	// feeds controller.runQueue from the scheduler's load average
+	/*
+	 * One rendezvous for what this sample needs: controller.c0 from TSC, MPERF
+	 * and APERF with loadFromAPERF, controller.ipc from the fixed counters with
+	 * memBoundIPC, controller.thermal from IA32_THERM_STATUS with a DTS
+	 */
+	void GetCounters();
+	void GetThermal();	// just controller.thermal
+	/* Per CPU effective clock: controller.c0, or measured over effectiveSampleMS now; 0 without APERF */
+	const C0Tracker* measureEffective();
+	void guardManual();	// while disabled: GetThermal() and hold the speed to controller.thermalCeiling()
+	/* While disabled: arm perfTimer for guardManual() in thermalGuardMS if the speed is above the slowest state */
+	void watchManual();
+	bool countersAvailable() { return countersEnabled; }
+	bool clockCountersAvailable() { return hasClockCounters; }
 	bool perfTimerEvent(IOTimerEventSource* src, int count);
+	void setBoostPoll(uint32_t ms) { input.pollMS = ms; }
+	uint32_t boostPoll() { return input.pollMS ? input.pollMS : defaultBoostPoll; }
+	bool startInput();	// watch for input while the boost is on
+	void stopInput();
+	static void inputEvent(void* owner);
+	static void inputPollWrapper(OSObject* owner, IOTimerEventSource* src);
+	/* Parse and start a schedule (0 stops it), on the workloop */
+	bool runSchedule(const char* text);
+	static IOReturn scheduleAction(OSObject* owner, void* text, void*, void*, void*);
+	static void scheduleWrapper(OSObject* owner, IOTimerEventSource* src);
+	static void limiterWrapper(OSObject* owner, IOTimerEventSource* src);
+	/* controller.qos from the user clients, on the workloop */
+	uint32_t qosAdd(uintptr_t owner, int floor, int ceiling, uint32_t timeoutMS);
+	bool qosRelease(uintptr_t owner, uint32_t handle);
+	void qosReleaseOwner(uintptr_t owner);
+	static IOReturn qosAction(OSObject* owner, void* call, void*, void*, void*);
+	/* set(controller, which, value) on the workloop, so it never lands in the middle of a sample */
+	bool setTunable(TunableSetter set, int which, int value);
+	static IOReturn tunableAction(OSObject* owner, void* call, void*, void*, void*);
 };
 
-const uint32_t throttleQuantum		= 100; // ms
-const uint32_t defaultTargetLoad	= 400; // percent x 10
-
 bool perfTimerWrapper(OSObject* owner, IOTimerEventSource* src, int count);
 
-/*********************************************************************************************************
-/*
- * The following is used with mp_rendezvous to throttle all CPUs
- */
-void disableInterrupts	(__unused void* t);
-void enableInterrupts	(__unused void* t);
-void throttleCPU	(void* fidvid);
-
-/*
- * Rendezvous
- */
-extern "C" void mp_rendezvous(	void (*setup_func) (void *),
-			void (*action_func) (void *),
-			void (*teardown_func) (void *),
-			void *arg);
-
 /*
- * For timer fix
+ * The following is our magic function for kernel feature autodetect
  */
 __BEGIN_DECLS
-/* The next 2 functions are used for clock recalibration on non-constant tsc */
-extern void rtc_clock_stepping(uint32_t new_frequency, uint32_t old_frequency);
-extern void rtc_clock_stepped (uint32_t new_frequency, uint32_t old_frequency);
-/* The following is our magic function for kernel feature autodetect */
 extern void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result);
 __END_DECLS
 
 /*
- * The main throttling function. This sets up mp_rendezvous and provides
- * the proper fid/vid for the given P-State.
- */
-void throttleAllCPUs(PState* p);
-
-/*
- * Gets the current core voltage. Only current processor is read
+ * Check heuristically whether constant_tsc is supported
  */
-uint16_t getCurrentVoltage();
+bool isConstantTSC();
 
 /*
- * Returns the current operating frequency in MHz
+ * Check for architectural perfmon v2 with the instructions retired and
+ * unhalted core cycles fixed counters
  */
-uint16_t getCurrentFrequency();
+bool hasFixedCounters();
 
 /*
- * Check heuristically whether constant_tsc is supported
+ * Check for IA32_APERF/IA32_MPERF (CPUID.06H:ECX[0])
  */
-bool isConstantTSC();
+bool hasAPERF();
 
 /*
- * Check whether CPU supports N/2 fsb ratios
+ * Check for the digital thermal sensor (CPUID.06H:EAX[0])
  */
-void checkForNby2Ratio();
+bool hasDTS();
 
 /*
  * Create the PState table by getting info from ACPI
@@ -148,22 +190,6 @@ bool getFSB();
  */
 void loadPStateOverride(OSArray* dict);
 
-/*
- * Convert VID to mV
- */
-uint16_t VID_to_mV(uint8_t VID);
-
-/*
- * Convert mV to VID
- */
-uint8_t mV_to_VID(uint16_t mv);
-
-/*
- * FID to Mhz and vice versa
- */
-uint8_t  MHz_to_FID(uint16_t mhz);
-uint16_t FID_to_MHz(uint8_t fid);
-
 /*
  * Check if we are running on newer core2duo
  */
@@ -172,31 +198,43 @@ void checkForPenryn();
 /* Sysctl stuff */
 char*	getFreqList();
 char*	getVoltageList(bool original);
-int	FindClosestPState(int wantedFreq);
+char*	getLatencyMatrix();
 char	frequencyList		[1024] = "";
 char	originalVoltages	[1024] = "";
-uint64_t totalThrottles, totalTimerEvents;
 char	frequencyUsage		[1024] = "";
+char	transitionLatencies	[4096] = "";
 
 
 /*
  * Certain (pseudo)global variables
  */
-PState		PStates[16];		// 16 states max
 AutoThrottler*	Throttler;		// Our autothrottle controller
-unsigned int	NumberOfPStates;	// How many this processor supports
-IOSimpleLock*	Lock;			// lock to use while throttling
-bool		InterruptsEnabled;	// to save state of interrupts before throttling
-bool		Is45nmPenryn;		// so that we can use proper VID -> mV calculation
-bool		RtcFixKernel;		// to indicate if this kernel has rtc fix
 bool		Below1Ghz;		// whether kernel is patched to support < 1Ghz freqs
-bool		ConstantTSC;		// whether processor supports constant tsc
-bool		Nby2Ratio;		// Whether cpu supports N/2 fsb ratio
-bool		DebugOn;		// whether to print debug messages
-uint64_t	FSB;			// as reported by EFI
-uint32_t	MaxLatency;		// how long to wait after switching pstate
 int		DefaultPState;		// set at startup
 int		NumberOfProcessors;	// # of cores/ACPI cpus actually
+/*
+ * What userspace opens on the driver (IOUserClientClass), see
+ * UserClientMethods.h. The connection is the owner of its QoS holders, so
+ * they go when it closes, including when its task dies.
+ */
+class com_reidburke_air_IntelEnhancedSpeedStepUserClient : public IOUserClient {
+OSDeclareDefaultStructors(com_reidburke_air_IntelEnhancedSpeedStepUserClient)
+
+private:
+	task_t		owningTask;
+	bool		privileged;	// may add floors and ceilings
+	IOExternalMethod	methods[kIESSNumberOfMethods];
+
+public:
+	virtual bool		initWithTask(task_t owningTask, void* securityID, UInt32 type);
+	virtual bool		start(IOService* provider);
+	virtual IOReturn	clientClose();
+	virtual IOExternalMethod*	getTargetAndMethodForIndex(IOService** target, UInt32 index);
+
+	IOReturn	qosAdd(void* floor, void* ceiling, void* timeoutMS, void* handle, void*, void*);
+	IOReturn	qosRelease(void* handle, void*, void*, void*, void*, void*);
+};
+
 /*
  * The IOKit driver class
  */
@@ -0,0 +1,31 @@
+#ifndef _MSRACCESS_H
+#define _MSRACCESS_H
+
+/*
+ * All model specific register traffic of the driver goes through an MSRBackend,
+ * so the throttling logic can run against the real processor inside the kernel,
+ * or against a simulated CPU model when built on the host (see Host/SimulatedCPU.h).
+ */
+class MSRBackend {
+public:
+	virtual uint64_t read	(uint32_t msr) = 0;
+	virtual void	 write	(uint32_t msr, uint64_t value) = 0;
+};
+
+#ifndef IESS_HOST
+/*
+ * Kernel implementation, reads and writes the MSR of the CPU we're running on
+ */
+class KernelMSR : public MSRBackend {
+public:
+	virtual uint64_t read	(uint32_t msr)			{ return rdmsr64(msr); }
+	virtual void	 write	(uint32_t msr, uint64_t value)	{ wrmsr64(msr, value); }
+};
+#endif
+
+/*
+ * The backend in use. Always valid, defaults to KernelMSR in the kext.
+ */
+extern IESS_TLS MSRBackend* MSR;
+
+#endif // _MSRACCESS_H
@@ -0,0 +1,56 @@
+#include "PIDController.h"
+#include "Utility.h"
+
+static inline int32_t clamp(int64_t x, int32_t lo, int32_t hi) {
+	return x < lo ? lo : (x > hi ? hi : (int32_t) x);
+}
+
+void PIDController::setDefaults() {
+	kp	= defaultPIDKp;
+	ki	= defaultPIDKi;
+	kd	= defaultPIDKd;
+	dFilter	= defaultPIDFilter;
+	deadband = defaultPIDDeadband;
+}
+
+void PIDController::reset(int32_t level) {
+	integral	= clamp(level, 0, pidLevelMax) << 8;
+	derivative	= 0;
+	lastMeasured	= 0;
+	primed		= false;
+}
+
+int32_t PIDController::update(int32_t setpoint, int32_t measured) {
+	int32_t error = measured - setpoint;
+	if (abs(error) <= deadband) error = 0;
+	else error += error > 0 ? -deadband : deadband;
+
+	// Low-passed derivative of the measurement
+	if (primed) {
+		int64_t d = (int64_t) (measured - lastMeasured) << 8;
+		derivative += (int32_t) ((d - derivative) * clamp(dFilter, 1, 256) / 256);
+	}
+	lastMeasured = measured;
+	primed = true;
+
+	int64_t p = (int64_t) kp * error;
+	int64_t d = (int64_t) kd * derivative / 256;
+	int64_t out = (p + integral + d) >> 8;
+
+	// Integrate unless that would push further into saturation
+	if (!((out >= pidLevelMax && error > 0) || (out <= 0 && error < 0)))
+		integral = clamp(integral + (int64_t) ki * error, 0, pidLevelMax << 8);
+
+	return clamp((p + integral + d) >> 8, 0, pidLevelMax);
+}
+
+int PIDController::levelToPState(int32_t level) {
+	int slow = PStates[NumberOfPStates - 1].AcpiFreq, fast = PStates[0].AcpiFreq;
+	return FindClosestPState(slow + (fast - slow) * clamp(level, 0, pidLevelMax) / pidLevelMax);
+}
+
+int32_t PIDController::pstateToLevel(int pstate) {
+	int slow = PStates[NumberOfPStates - 1].AcpiFreq, fast = PStates[0].AcpiFreq;
+	if (fast == slow) return pidLevelMax;
+	return clamp((int64_t) (PStates[pstate].AcpiFreq - slow) * pidLevelMax / (fast - slow), 0, pidLevelMax);
+}
@@ -0,0 +1,57 @@
+#ifndef _PIDCONTROLLER_H
+#define _PIDCONTROLLER_H
+
+#include "Throttling.h"
+
+/*
+ * Fixed-point PID controller, no floating point in the kernel.
+ *
+ * Gains are in 1/256 units (256 = 1.0). The measured value and the setpoint
+ * are load in percent x 10; the output is a performance level from 0 (the
+ * slowest PState) to pidLevelMax (P0). The error is measured - setpoint, so
+ * more load than wanted asks for more speed.
+ *
+ * Anti-windup: the integral is clamped to the output range and stops
+ * integrating while the output is saturated in the direction of the error.
+ * The derivative is taken on the measurement, not the error, so moving the
+ * setpoint doesn't kick the output, and runs through a first order low-pass
+ * with coefficient dFilter/256 (256 = unfiltered).
+ *
+ * The output only has as many steps as there are PStates, so an error within
+ * +-deadband counts as none; otherwise the integral keeps hunting between two
+ * neighbouring states when the setpoint lies between them.
+ */
+const int32_t pidLevelMax	= 1000;
+
+const int32_t defaultPIDKp	= 32;	// 0.125
+const int32_t defaultPIDKi	= 160;	// 0.625 per sample
+const int32_t defaultPIDKd	= 16;	// 0.0625
+const int32_t defaultPIDFilter	= 96;	// 0.375
+const int32_t defaultPIDDeadband	= 50;	// percent x 10
+
+class PIDController {
+public:
+	int32_t		kp, ki, kd;	// 1/256 units
+	int32_t		dFilter;	// 1/256 units, 1..256
+	int32_t		deadband;	// percent x 10
+
+	void	setDefaults();
+
+	/* Forget the history, continue bumpless from the given output level */
+	void	reset(int32_t level);
+
+	/* One sample, returns the new level 0..pidLevelMax */
+	int32_t	update(int32_t setpoint, int32_t measured);
+
+	/* PStates[] index closest to a level, and back */
+	static int	levelToPState(int32_t level);
+	static int32_t	pstateToLevel(int pstate);
+
+private:
+	int32_t		integral;	// level << 8
+	int32_t		derivative;	// filtered d(measured)/sample << 8
+	int32_t		lastMeasured;
+	bool		primed;		// lastMeasured is valid
+};
+
+#endif // _PIDCONTROLLER_H
@@ -0,0 +1,125 @@
+#include "PStateSchedule.h"
+#include "Utility.h"
+
+/* ms with up to three decimals to usec; false if there is no number */
+static bool parseMS(const char** text, uint32_t* us) {
+	const char* p = *text;
+	uint64_t value = 0;
+	int decimals = -1;
+	for (; (*p >= '0' && *p <= '9') || (*p == '.' && decimals < 0); p++) {
+		if (*p == '.') { decimals = 0; continue; }
+		if (decimals >= 3) return false;
+		if (decimals >= 0) decimals++;
+		value = value * 10 + (*p - '0');
+		if (value > 0xffffffffULL) return false;
+	}
+	if (p == *text || p[-1] == '.') return false;
+	for (int d = decimals < 0 ? 0 : decimals; d < 3; d++) value *= 10;
+	if (value > 0xffffffffULL) return false;
+	*us = (uint32_t) value;
+	*text = p;
+	return true;
+}
+
+/* The slowest switch between any two states: entries closer than that would overtake each other */
+static uint32_t slowestTransitionUS() {
+	uint32_t slowest = 0;
+	for (int from = 0; from < NumberOfPStates; from++)
+		for (int to = 0; to < NumberOfPStates; to++)
+			if (transitionLatency(from, to) > slowest) slowest = transitionLatency(from, to);
+	return slowest;
+}
+
+bool PStateSchedule::parse(const char* text) {
+	ScheduleEntry parsed[scheduleEntries];
+	int n = 0;
+	uint32_t every = 0, pstate, gap = slowestTransitionUS();
+
+	while (*text && *text != '@') {
+		if (n == scheduleEntries) return false;
+		if (!parseMS(&text, &parsed[n].offsetUS) || *text++ != ':') return false;
+		const char* digits = text;
+		for (pstate = 0; *text >= '0' && *text <= '9' && pstate < 16; text++)
+			pstate = pstate * 10 + (*text - '0');
+		if (text == digits || pstate >= NumberOfPStates) return false;
+		if (n && parsed[n].offsetUS < (uint64_t) parsed[n - 1].offsetUS + gap) return false;
+		parsed[n++].pstate = pstate;
+		if (*text == ',') text++;
+		else if (*text && *text != '@') return false;
+	}
+	if (*text == '@') {
+		text++;
+		if (!parseMS(&text, &every) || *text || !n || every < scheduleMinPeriodUS) return false;
+		// The first entry of the next round has to keep its distance from the last one as well
+		if ((uint64_t) every + parsed[0].offsetUS < (uint64_t) parsed[n - 1].offsetUS + gap || every <= parsed[n - 1].offsetUS)
+			return false;
+	}
+	if (!n) return false;
+
+	active = false;
+	memcpy(entry, parsed, n * sizeof(ScheduleEntry));
+	count = n;
+	period = every;
+	return true;
+}
+
+int PStateSchedule::print(char* buf, int len) const {
+	int pos = 0;
+	if (len > 0) buf[0] = '\0';
+	for (int i = 0; i < count && pos < len; i++)
+		pos += snprintf(buf + pos, len - pos, "%s%u.%03u:%u", i ? "," : "",
+				entry[i].offsetUS / 1000, entry[i].offsetUS % 1000, entry[i].pstate);
+	if (period && pos < len)
+		pos += snprintf(buf + pos, len - pos, "@%u.%03u", period / 1000, period % 1000);
+	return pos;
+}
+
+void PStateSchedule::start(uint64_t nowNS) {
+	active = count > 0;
+	startNS = nowNS;
+	round = 0;
+	next = 0;
+	fired = missed = 0;
+	worstLate = totalLate = 0;
+}
+
+int PStateSchedule::due(uint64_t nowNS, uint64_t* waitNS) {
+	*waitNS = 0;
+	if (!active) return -1;
+
+	uint64_t elapsed = nowNS - startNS, periodNS = (uint64_t) period * 1000;
+	int pstate = -1;
+	uint64_t deadline = 0;
+	for (;;) {
+		if (next == count) {
+			if (!period) {
+				active = false;
+				break;
+			}
+			next = 0;
+			round++;
+		}
+		// Whole rounds behind: only the last one before now still matters
+		if (next == 0 && period && elapsed >= (round + 2) * periodNS) {
+			uint64_t behind = elapsed / periodNS - 1 - round;
+			missed += behind * count;
+			round += behind;
+		}
+		uint64_t at = round * periodNS + (uint64_t) entry[next].offsetUS * 1000;
+		if (at > elapsed) {
+			*waitNS = at - elapsed;
+			break;
+		}
+		if (pstate >= 0) missed++;
+		pstate = entry[next].pstate;
+		deadline = at;
+		next++;
+	}
+	if (pstate >= 0) {
+		uint64_t late = elapsed - deadline;
+		fired++;
+		totalLate += late;
+		if (late > worstLate) worstLate = late;
+	}
+	return pstate;
+}
@@ -0,0 +1,70 @@
+#ifndef _PSTATESCHEDULE_H
+#define _PSTATESCHEDULE_H
+
+#include "Throttling.h"
+
+/*
+ * A timed list of P-States uploaded in one go, e.g. for a benchmark or a
+ * batch job that runs at known times. Written as
+ *
+ *	offset:pstate,offset:pstate,...[@period]
+ *
+ * with the offsets in ms from the start (up to three decimals, so usec) in
+ * ascending order and pstate a PStates[] index. With @period it starts over
+ * every period ms until cancelled; the period has to be longer than the
+ * last offset, and at least scheduleMinPeriodUS. Entries, also across the
+ * end of a period, have to be at least the slowest transitionLatency()
+ * apart, or they would overtake each other.
+ *
+ * Every deadline is counted from start(), not from the previous entry, so a
+ * late timer doesn't push the rest of the schedule back. due() tells what
+ * to run now and how long until the next entry; if it was called late it
+ * returns the newest entry that is due and skips the ones before it, and a
+ * periodic schedule that fell whole rounds behind picks up in the current
+ * round. Fixed size, no allocation, so it can live in the controller.
+ */
+#define scheduleEntries	64
+#define scheduleMinPeriodUS	1000	// a shorter one would keep the workloop busy with nothing but the schedule
+
+struct ScheduleEntry {
+	uint32_t	offsetUS;
+	uint8_t		pstate;
+};
+
+class PStateSchedule {
+public:
+	/* Replaces the schedule if text is valid, leaves it alone if not */
+	bool	parse(const char* text);
+	/* The schedule in the form parse() takes */
+	int	print(char* buf, int len) const;
+
+	void	start(uint64_t nowNS);
+	void	cancel()		{ active = false; }
+	bool	running() const		{ return active; }
+
+	/*
+	 * PStates[] index to switch to now, -1 if nothing is due. *waitNS is
+	 * the time until the next entry, 0 once a one-shot schedule is done.
+	 */
+	int	due(uint64_t nowNS, uint64_t* waitNS);
+
+	int		entries() const		{ return count; }
+	uint32_t	periodUS() const	{ return period; }
+	uint64_t	applied() const		{ return fired; }	// entries run since start()
+	uint64_t	skipped() const		{ return missed; }	// overtaken by a later one before they ran
+	uint64_t	maxLateNS() const	{ return worstLate; }
+	uint64_t	meanLateNS() const	{ return fired ? totalLate / fired : 0; }
+
+private:
+	ScheduleEntry	entry[scheduleEntries];
+	int		count;
+	uint32_t	period;		// usec, 0 = run once
+	bool		active;
+	uint64_t	startNS;
+	uint64_t	round;		// of a periodic schedule
+	int		next;		// entry[] index
+	uint64_t	fired, missed;
+	uint64_t	worstLate, totalLate;
+};
+
+#endif // _PSTATESCHEDULE_H
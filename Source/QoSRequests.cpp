@@ -0,0 +1,103 @@
+#include "QoSRequests.h"
+#include "Utility.h"
+
+void QoSRequests::reset() {
+	bzero(slot, sizeof(slot));
+	lastHandle = 0;
+}
+
+uint32_t QoSRequests::add(uintptr_t owner, int floor, int ceiling, uint32_t timeoutMS, uint64_t nowNS) {
+	if (floor < qosNone || floor >= (int) NumberOfPStates || ceiling < qosNone || ceiling >= (int) NumberOfPStates) return 0;
+	if (floor == qosNone && ceiling == qosNone) return 0;
+	uint64_t expires = timeoutMS ? nowNS + (uint64_t) timeoutMS * 1000000 : 0;
+
+	QoSHolder* free = 0;
+	for (int i = 0; i < qosHolders; i++) {
+		QoSHolder& h = slot[i];
+		if (!h.handle) {
+			if (!free) free = &h;
+			continue;
+		}
+		if (h.owner != owner || h.floor != floor || h.ceiling != ceiling || !live(h, nowNS)) continue;
+		if (h.refs == 0xffff) return 0;
+		h.refs++;
+		// Another reference keeps it for at least as long as it asks for
+		if (!expires || !h.expiresNS) h.expiresNS = 0;
+		else if (expires > h.expiresNS) h.expiresNS = expires;
+		return h.handle;
+	}
+	if (!free) {
+		expire(nowNS);
+		for (int i = 0; i < qosHolders && !free; i++)
+			if (!slot[i].handle) free = &slot[i];
+		if (!free) return 0;
+	}
+	if (++lastHandle == 0) lastHandle = 1;
+	free->handle	= lastHandle;
+	free->owner	= owner;
+	free->floor	= floor;
+	free->ceiling	= ceiling;
+	free->refs	= 1;
+	free->expiresNS	= expires;
+	return free->handle;
+}
+
+bool QoSRequests::release(uintptr_t owner, uint32_t handle) {
+	for (int i = 0; i < qosHolders; i++) {
+		QoSHolder& h = slot[i];
+		if (!handle || h.handle != handle || h.owner != owner) continue;
+		if (--h.refs == 0) bzero(&h, sizeof(h));
+		return true;
+	}
+	return false;
+}
+
+int QoSRequests::releaseOwner(uintptr_t owner) {
+	int n = 0;
+	for (int i = 0; i < qosHolders; i++) {
+		if (!slot[i].handle || slot[i].owner != owner) continue;
+		bzero(&slot[i], sizeof(slot[i]));
+		n++;
+	}
+	return n;
+}
+
+int QoSRequests::expire(uint64_t nowNS) {
+	int n = 0;
+	for (int i = 0; i < qosHolders; i++) {
+		if (!slot[i].handle || live(slot[i], nowNS)) continue;
+		bzero(&slot[i], sizeof(slot[i]));
+		n++;
+	}
+	return n;
+}
+
+int QoSRequests::floor(uint64_t nowNS) const {
+	int f = qosNone;
+	for (int i = 0; i < qosHolders; i++)
+		if (live(slot[i], nowNS) && slot[i].floor != qosNone && (f == qosNone || slot[i].floor < f))
+			f = slot[i].floor;
+	return f;
+}
+
+int QoSRequests::ceiling(uint64_t nowNS) const {
+	int c = qosNone;
+	for (int i = 0; i < qosHolders; i++)
+		if (live(slot[i], nowNS) && slot[i].ceiling > c)
+			c = slot[i].ceiling;
+	return c;
+}
+
+int QoSRequests::clamp(int pstate, uint64_t nowNS) const {
+	int c = ceiling(nowNS), f = floor(nowNS);
+	if (c != qosNone && pstate < c) pstate = c;
+	if (f != qosNone && pstate > f) pstate = f;
+	return pstate;
+}
+
+int QoSRequests::holders() const {
+	int n = 0;
+	for (int i = 0; i < qosHolders; i++)
+		if (slot[i].handle) n++;
+	return n;
+}
@@ -0,0 +1,63 @@
+#ifndef _QOSREQUESTS_H
+#define _QOSREQUESTS_H
+
+#include "Throttling.h"
+
+/*
+ * Performance floors and ceilings asked for by clients, e.g. a daemon that
+ * wants "at least P1 while I'm handling requests" or a batch job that wants
+ * "at most P3". Limits are PStates[] indexes, so a floor is the slowest state
+ * allowed (the smallest floor wins) and a ceiling the fastest one (the
+ * largest wins); qosNone leaves that side open. Where a floor and a ceiling
+ * cross the floor wins, a ceiling never makes anyone miss their latency.
+ *
+ * Every holder belongs to an owner, an opaque token (the user client in the
+ * kext). The same owner asking for the same limits again takes another
+ * reference on its holder and gets the same handle back; release() drops one.
+ * A holder can expire on its own after timeoutMS, refreshed by every new
+ * reference. When a client goes away releaseOwner() drops all it held.
+ *
+ * Fixed size, no allocation. Not locked: the kext only touches it on the
+ * workloop.
+ */
+#define qosHolders	32
+#define qosNone		-1
+
+struct QoSHolder {
+	uint32_t	handle;		// 0 = free slot
+	uintptr_t	owner;
+	int8_t		floor;		// PStates[] index or qosNone
+	int8_t		ceiling;
+	uint16_t	refs;
+	uint64_t	expiresNS;	// uptime, 0 = never
+};
+
+class QoSRequests {
+public:
+	void	reset();
+
+	/* Handle of the holder with these limits, 0 if they are invalid or the table is full */
+	uint32_t	add(uintptr_t owner, int floor, int ceiling, uint32_t timeoutMS, uint64_t nowNS);
+	/* Drops one reference; false if the owner doesn't hold the handle */
+	bool		release(uintptr_t owner, uint32_t handle);
+	/* Drops everything the owner holds, returns how many holders went */
+	int		releaseOwner(uintptr_t owner);
+	/* Frees the holders whose time is up, returns how many */
+	int		expire(uint64_t nowNS);
+
+	int	floor(uint64_t nowNS) const;	// smallest unexpired floor, qosNone if none
+	int	ceiling(uint64_t nowNS) const;	// largest unexpired ceiling, qosNone if none
+	/* The PStates[] index to use instead of pstate */
+	int	clamp(int pstate, uint64_t nowNS) const;
+
+	int		holders() const;	// in use, expired or not
+	const QoSHolder& holder(int i) const { return slot[i]; }
+
+private:
+	bool	live(const QoSHolder& h, uint64_t nowNS) const { return h.handle && (!h.expiresNS || nowNS < h.expiresNS); }
+
+	QoSHolder	slot[qosHolders];
+	uint32_t	lastHandle;
+};
+
+#endif // _QOSREQUESTS_H
@@ -0,0 +1,104 @@
+#include "TargetTuner.h"
+#include "Governors.h"
+#include "Utility.h"
+
+#define tunerVersion	1
+
+const uint16_t tunerTargets[tunerArms] = { 300, 400, 500, 600, 700 };
+
+void TargetTuner::setDefaults() {
+	enabled		= false;
+	epochMS		= defaultTuneEpoch;
+	missBudget	= defaultMissBudget;
+	reset(tunerTargets[1]);
+}
+
+void TargetTuner::reset(uint16_t target) {
+	bzero(arms, sizeof(arms));
+	arm = 0;
+	for (int i = 1; i < tunerArms; i++)
+		if (abs(tunerTargets[i] - target) < abs(tunerTargets[arm] - target)) arm = i;
+	totalEpochs = 0;
+	random = 1;
+	epochWork = epochEnergy = 0;
+	epochMissMS = epochElapsedMS = 0;
+}
+
+/* Power above idle of a state while busy, mW or f * V^2 when _PSS didn't say */
+static uint32_t busyPower(int i, uint32_t idlePower) {
+	for (int j = 0; j < NumberOfPStates; j++) {
+		if (PStates[j].Power) continue;
+		uint64_t mV = VID_to_mV(PStates[i].OriginalVoltage);
+		return PStates[i].AcpiFreq * mV * mV / 1000000;
+	}
+	return PStates[i].Power > idlePower ? PStates[i].Power - idlePower : 0;
+}
+
+int TargetTuner::choose() {
+	for (int i = 0; i < tunerArms; i++)
+		if (!arms[i].epochs) return i;
+
+	random = random * 1103515245 + 12345;
+	if ((random >> 16) % tunerExplore == 0)
+		return (random >> 20) % tunerArms;
+
+	int best = -1, leastMiss = 0;
+	for (int i = 0; i < tunerArms; i++) {
+		if (arms[i].miss < arms[leastMiss].miss) leastMiss = i;
+		if (arms[i].miss > missBudget) continue;
+		if (best < 0 || arms[i].cost < arms[best].cost) best = i;
+	}
+	return best >= 0 ? best : leastMiss;
+}
+
+bool TargetTuner::sample(const LoadSample& s, uint32_t idlePower) {
+	uint64_t demand = (uint64_t) s.used * PStates[s.pstate].AcpiFreq / PStates[0].AcpiFreq;
+	epochWork	+= demand * s.intervalMS;
+	epochEnergy	+= (uint64_t) busyPower(s.pstate, idlePower) * s.used * s.intervalMS;
+	if (s.used >= 950 && s.pstate != 0) epochMissMS += s.intervalMS;
+	epochElapsedMS	+= s.intervalMS;
+	if (epochElapsedMS < epochMS) return false;
+
+	bool idle = epochWork * 100 < (uint64_t) epochElapsedMS * 1000;
+	uint32_t cost = idle ? 0 : (uint32_t) (epochEnergy / epochWork);
+	uint16_t miss = (uint16_t) ((uint64_t) epochMissMS * 1000 / epochElapsedMS);
+	epochWork = epochEnergy = 0;
+	epochMissMS = epochElapsedMS = 0;
+	// Less than 1% of a core's work in the whole epoch, nothing to learn from
+	if (idle) return false;
+
+	TunerArm& a = arms[arm];
+	if (!a.epochs) {
+		a.cost = cost;
+		a.miss = miss;
+	} else {
+		a.cost = a.cost - a.cost / 4 + cost / 4;
+		a.miss = a.miss - a.miss / 4 + miss / 4;
+	}
+	if (a.epochs < 0xffff) a.epochs++;
+	totalEpochs++;
+
+	int next = choose();
+	if (next == arm) return false;
+	dbg("Auto-tune: target load %d%% -> %d%%\n", tunerTargets[arm] / 10, tunerTargets[next] / 10);
+	arm = next;
+	return true;
+}
+
+void TargetTuner::save(TunerState* state) const {
+	bzero(state, sizeof(*state));
+	state->version = tunerVersion;
+	memcpy(state->arms, arms, sizeof(arms));
+	state->arm = arm;
+}
+
+bool TargetTuner::restore(const void* data, size_t length) {
+	const TunerState* state = (const TunerState*) data;
+	if (length != sizeof(TunerState) || state->version != tunerVersion || state->arm >= tunerArms)
+		return false;
+	memcpy(arms, state->arms, sizeof(arms));
+	arm = state->arm;
+	for (int i = 0; i < tunerArms; i++)
+		totalEpochs += arms[i].epochs;
+	return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _TARGETTUNER_H
+#define _TARGETTUNER_H
+
+#include "Throttling.h"
+
+struct LoadSample;
+
+/*
+ * Picks targetCPULoad online: a multi-armed bandit over tunerArms candidate
+ * targets, tried one epoch at a time.
+ *
+ * Over an epoch every sample adds its work (demand times its interval) and
+ * the energy above idle that work cost in the state that ran it,
+ * (Power - idlePower) * used * interval. Their ratio is the epoch's cost, in
+ * mW per core of P0 work; it only depends on which states carried the work,
+ * not on how much there was. Time spent saturated below P0 counts as missed:
+ * that is demand waiting for the governor to ramp up. Epochs with less than
+ * 1% work say nothing and are dropped.
+ *
+ * Every arm keeps a running average of both (weight 1/4). Untried arms go
+ * first; after that one epoch in tunerExplore tries a random arm, the rest
+ * go to the cheapest arm that misses no more than missBudget permille of the
+ * time, or the one that misses least if none does.
+ *
+ * Power comes from _PSS. If any state lacks it, f * V^2 of each state stands
+ * in for its power above idle: only the ratio between arms matters, and that
+ * still favours the targets that keep the work in the low-voltage states.
+ * The learned arms can be saved and restored (TunerState), so a reload
+ * doesn't start over.
+ */
+#define tunerArms	5
+#define tunerExplore	8	// one epoch in this many explores
+
+extern const uint16_t tunerTargets[tunerArms];	// percent x 10
+
+const uint32_t defaultTuneEpoch		= 10000; // ms
+const uint16_t defaultMissBudget	= 20;    // permille of the time saturated below P0
+
+struct TunerArm {
+	uint32_t	cost;		// mW per core of P0 work
+	uint16_t	miss;		// permille
+	uint16_t	epochs;		// how often it ran, saturates
+};
+
+/* What save() and restore() exchange, e.g. as a registry property */
+struct TunerState {
+	uint32_t	version;
+	TunerArm	arms[tunerArms];
+	uint8_t		arm;
+};
+
+class TargetTuner {
+public:
+	bool		enabled;
+	uint32_t	epochMS;
+	uint16_t	missBudget;	// permille
+
+	void	setDefaults();
+
+	/* Forget everything learned, start on the arm closest to the given target */
+	void	reset(uint16_t target);
+
+	/*
+	 * One load sample: s ran in s.pstate for s.intervalMS. Returns true when
+	 * the epoch ended and target() changed.
+	 */
+	bool	sample(const LoadSample& s, uint32_t idlePower);
+
+	uint16_t	target() const { return tunerTargets[arm]; }
+	const TunerArm&	stats(int i) const { return arms[i]; }
+	uint32_t	epochs() const { return totalEpochs; }
+
+	void	save(TunerState* state) const;
+	bool	restore(const void* data, size_t length);
+
+private:
+	int		choose();
+
+	TunerArm	arms[tunerArms];
+	uint8_t		arm;
+	uint32_t	totalEpochs;
+	uint32_t	random;
+	uint64_t	epochWork;	// permille * ms
+	uint64_t	epochEnergy;	// mW * permille * ms
+	uint32_t	epochMissMS;
+	uint32_t	epochElapsedMS;
+};
+
+#endif // _TARGETTUNER_H
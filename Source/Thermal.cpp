@@ -0,0 +1,295 @@
+#include "Thermal.h"
+#include "Utility.h"
+
+void ThermalCap::setDefaults() {
+	tjMax		= defaultTjMax;
+	softMargin	= defaultThermalSoft;
+	hardMargin	= defaultThermalHard;
+}
+
+void ThermalCap::reset() {
+	count = validCPUs = 0;
+	minMargin = 127;
+	capState = 0;
+	hot = false;
+	hotUpdates = 0;
+}
+
+int ThermalCap::temperature(int cpu) const {
+	if (cpu < 0 || cpu >= count || readout[cpu] < 0) return -1;
+	return tjMax - readout[cpu];
+}
+
+int ThermalCap::capFor(int margin) const {
+	int slowest = NumberOfPStates - 1;
+	if (margin >= softMargin) return 0;
+	if (margin <= hardMargin || softMargin <= hardMargin) return slowest;
+	// Round towards the slower state, every degree lost counts
+	int span = softMargin - hardMargin;
+	return ((softMargin - margin) * slowest + span - 1) / span;
+}
+
+void ThermalCap::update(const uint64_t* status, int cpus) {
+	if (cpus > max_cpus) cpus = max_cpus;
+	count = cpus;
+	validCPUs = 0;
+	minMargin = 127;
+	hot = false;
+	for (int i = 0; i < cpus; i++) {
+		if (!(status[i] & THERM_STATUS_VALID)) {
+			readout[i] = -1;
+			continue;
+		}
+		readout[i] = THERM_STATUS_READOUT(status[i]);
+		if (readout[i] < minMargin) minMargin = readout[i];
+		if (status[i] & THERM_STATUS_PROCHOT) hot = true;
+		validCPUs++;
+	}
+	if (hot) hotUpdates++;
+
+	if (!softMargin || !valid()) {
+		capState = 0;
+		return;
+	}
+	int want = hot ? NumberOfPStates - 1 : capFor(minMargin);
+	if (want > capState) {
+		capState = want;
+		dbg("Thermal: %d C below TjMax, nothing faster than %d MHz\n", minMargin, PStates[capState].AcpiFreq);
+	} else if (want < capState && capFor(minMargin - thermalHysteresis) < capState) {
+		capState--;
+	}
+}
+
+int ThermalCap::hardCap() const {
+	if (!valid()) return 0;
+	return hot || minMargin <= hardMargin ? NumberOfPStates - 1 : 0;
+}
+
+#define Q	65536
+
+static int64_t abs64(int64_t x) { return x < 0 ? -x : x; }
+
+/* num / den in 1/65536, without the shift overflowing */
+static int64_t ratioQ16(int64_t num, int64_t den) {
+	while (abs64(num) > (1LL << 46)) {
+		num /= 2;
+		den /= 2;
+	}
+	return den ? num * Q / den : 0;
+}
+
+static int toPower16(uint32_t mW) { return (int) (((uint64_t) mW * 16 + 500) / 1000); }
+
+void ThermalModel::setDefaults() {
+	stepMS = defaultThermalStep;
+	memory = defaultThermalMemory;
+}
+
+void ThermalModel::reset() {
+	if (!stepMS) stepMS = defaultThermalStep;
+	if (memory < 1 || memory > 10) memory = defaultThermalMemory;
+	primed = fitted = false;
+	stepStartC16 = 0;
+	stepEnergy = 0;
+	stepElapsedMS = 0;
+	lastPowerMW = 0;
+	lastStep16 = -1;
+	n = 0;
+	bzero(sum, sizeof(sum));
+	bzero(cross, sizeof(cross));
+	phi = gain = carry = offset = 0;
+	fits = 0;
+}
+
+void ThermalModel::update(int tempC16, uint32_t powerMW, uint32_t intervalMS) {
+	lastPowerMW = powerMW;
+	if (!primed) { // nothing to go from yet
+		stepStartC16 = tempC16;
+		primed = true;
+		return;
+	}
+	stepEnergy += (uint64_t) powerMW * intervalMS;
+	stepElapsedMS += intervalMS;
+	if (stepElapsedMS < stepMS) return;
+
+	// Scale a long step's change back to stepMS
+	int to = stepStartC16 + (int) ((int64_t) (tempC16 - stepStartC16) * stepMS / stepElapsedMS);
+	addStep(stepStartC16, to, toPower16((uint32_t) (stepEnergy / stepElapsedMS)));
+	stepStartC16 = tempC16;
+	stepEnergy = 0;
+	stepElapsedMS = 0;
+}
+
+void ThermalModel::addStep(int fromC16, int toC16, int power16) {
+	if (lastStep16 < 0) { // carry needs the step before
+		lastStep16 = power16;
+		return;
+	}
+	int64_t x[terms] = { fromC16, power16, lastStep16, toC16 };
+	lastStep16 = power16;
+	if (n == (1LL << memory)) {
+		for (int i = 0; i < terms; i++) {
+			sum[i] -= sum[i] >> memory;
+			for (int j = i; j < terms; j++) cross[i][j] -= cross[i][j] >> memory;
+		}
+	} else {
+		n++;
+	}
+	for (int i = 0; i < terms; i++) {
+		sum[i] += x[i];
+		for (int j = i; j < terms; j++) cross[i][j] += x[i] * x[j];
+	}
+	solve();
+}
+
+/* a00 (a11 a22 - a12 a21) - ..., every entry under 2^19 */
+static int64_t det3(int64_t a[3][3]) {
+	return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+	     - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+	     + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+}
+
+void ThermalModel::solve() {
+	if (n < 16) return;
+	// Centered (co)variances, times n
+	int64_t c[terms][terms];
+	for (int i = 0; i < terms; i++)
+		for (int j = i; j < terms; j++)
+			c[i][j] = c[j][i] = cross[i][j] - sum[i] * sum[j] / n;
+	// A degree and half a watt rms at least
+	if (c[xFrom][xFrom] < n * 256 || c[xPower][xPower] < n * 64) return;
+
+	// Normal equations, scaled down so det3() can't overflow
+	int64_t m[3][3], b[3], largest = 0;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			m[i][j] = c[i][j];
+			if (abs64(m[i][j]) > largest) largest = abs64(m[i][j]);
+		}
+		b[i] = c[i][yTo];
+		if (abs64(b[i]) > largest) largest = abs64(b[i]);
+	}
+	int shift = 0;
+	while ((largest >> shift) >= (1 << 19)) shift++;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) m[i][j] >>= shift;
+		b[i] >>= shift;
+	}
+	int64_t det = det3(m);
+	// Not when the temperature and the power move together too closely to tell apart
+	if (det <= 0 || det < (m[0][0] * m[1][1] * m[2][2]) >> 8) return;
+
+	int64_t coef[3];
+	for (int k = 0; k < 3; k++) {
+		int64_t mk[3][3];
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) mk[i][j] = j == k ? b[i] : m[i][j];
+		coef[k] = ratioQ16(det3(mk), det);
+	}
+	int64_t p = coef[xFrom], g = coef[xPower], cr = coef[xLastPower];
+	if (p <= 0 || p >= Q - 16 || g <= 0 || g + cr <= 0) return;
+	int64_t h = (sum[yTo] * Q - p * sum[xFrom] - g * sum[xPower] - cr * sum[xLastPower]) / n;
+	int64_t ambient16 = h / (Q - p);
+	if (ambient16 < 0 || ambient16 > 80 * 16) return;
+	phi = p; gain = g; carry = cr; offset = h;
+	fitted = true;
+	fits++;
+}
+
+int ThermalModel::step(int tempC16, uint32_t powerMW, uint32_t lastMW) const {
+	int64_t t = phi * tempC16 + gain * toPower16(powerMW) + carry * toPower16(lastMW) + offset;
+	return (int) ((t + Q / 2) / Q);
+}
+
+int ThermalModel::predict(int tempC16, uint32_t powerMW, int steps) const {
+	int64_t t = (int64_t) tempC16 * Q, p16 = toPower16(powerMW), last = lastStep16 >= 0 ? lastStep16 : p16;
+	for (int i = 0; i < steps; i++, last = p16)
+		t = phi * t / Q + gain * p16 + carry * last + offset;
+	return (int) ((t + Q / 2) / Q);
+}
+
+int ThermalModel::steady(uint32_t powerMW) const {
+	if (!fitted) return 0;
+	return (int) (((gain + carry) * toPower16(powerMW) + offset) / (Q - phi));
+}
+
+int ThermalModel::stepsUntil(int tempC16, uint32_t powerMW, int limitC16, int maxSteps) const {
+	if (steady(powerMW) <= limitC16) return maxSteps; // never gets there
+	int64_t t = (int64_t) tempC16 * Q, limit = (int64_t) limitC16 * Q;
+	int64_t p16 = toPower16(powerMW), last = lastStep16 >= 0 ? lastStep16 : p16;
+	for (int i = 0; i < maxSteps; i++, last = p16) {
+		t = phi * t / Q + gain * p16 + carry * last + offset;
+		if (t > limit) return i;
+	}
+	return maxSteps;
+}
+
+uint32_t ThermalModel::resistance() const {
+	return fitted ? (uint32_t) ((gain + carry) * 1000 / (Q - phi)) : 0;
+}
+
+uint32_t ThermalModel::tauMS() const {
+	// -step / ln(phi), to within a fraction of a step
+	return fitted ? (uint32_t) ((uint64_t) stepMS * (Q + phi) / (2 * (Q - phi))) : 0;
+}
+
+int ThermalModel::ambient() const {
+	return fitted ? (int) (offset / (Q - phi) / 16) : 0;
+}
+
+void ThermalBudget::setDefaults() {
+	limitMargin	= defaultThermalLimit;
+	boostMinMS	= defaultThermalBoostMin;
+	model.setDefaults();
+}
+
+void ThermalBudget::reset() {
+	model.reset();
+	capState = sustainableState = 0;
+	boosting = false;
+	leftMS = 0;
+	boosts = 0;
+}
+
+void ThermalBudget::update(const ThermalCap& thermal, uint32_t spentMW, const uint32_t* powerAt, uint32_t intervalMS) {
+	if (!thermal.valid()) return;
+	int now16 = (thermal.tjMax - thermal.margin()) * 16;
+	model.update(now16, spentMW, intervalMS);
+	if (!active()) {
+		capState = 0;
+		boosting = false;
+		return;
+	}
+
+	int slowest = NumberOfPStates - 1, limit16 = (thermal.tjMax - limitMargin) * 16;
+	sustainableState = slowest;
+	for (int i = 0; i < slowest; i++) {
+		if (model.steady(powerAt[i]) <= limit16) {
+			sustainableState = i;
+			break;
+		}
+	}
+	int steps = model.stepsUntil(now16, powerAt[0], limit16, thermalPlanSteps);
+	leftMS = steps * model.stepMS;
+	if (sustainableState == 0) {
+		capState = 0;
+		boosting = false;
+	} else if (now16 > limit16) {
+		if (boosting || capState < sustainableState)
+			capState = sustainableState;
+		else if (capState < slowest)
+			capState++;
+		boosting = false;
+		dbg("Thermal budget: %d C, past the limit, nothing faster than %d MHz\n", now16 / 16, PStates[capState].AcpiFreq);
+	} else if (boosting ? steps > 0 : leftMS >= boostMinMS) {
+		if (!boosting) {
+			boosts++;
+			dbg("Thermal budget: %u ms at P0 before %d C\n", leftMS, limit16 / 16);
+		}
+		boosting = true;
+		capState = 0;
+	} else {
+		boosting = false;
+		capState = sustainableState;
+	}
+}
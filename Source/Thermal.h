@@ -0,0 +1,173 @@
+#ifndef _THERMAL_H
+#define _THERMAL_H
+
+#include "Throttling.h"
+
+const uint8_t defaultTjMax		= 100; // degrees C, Core 2 mobile parts
+const uint8_t defaultThermalSoft	= 10;  // degrees below TjMax where the cap starts, 0 = off
+const uint8_t defaultThermalHard	= 2;   // degrees below TjMax where only the slowest state is left
+const uint8_t thermalHysteresis		= 2;   // degrees the margin has to come back before the cap loosens
+const uint32_t defaultThermalStep	= 1000; // ms per step of the thermal model
+const uint8_t defaultThermalMemory	= 7;   // the fit forgets 1/2^memory of the past every step
+const uint8_t defaultThermalLimit	= 5;   // degrees below TjMax the budget plans up to, 0 = off
+const uint32_t defaultThermalBoostMin	= 5000; // ms at P0 the model has to promise before a boost starts
+const int thermalPlanSteps		= 600; // how far ahead the model looks
+
+/*
+ * Soft cap on the speed from the digital thermal sensors, so the CPU stays
+ * clear of PROCHOT (TM2 pulling it to the lowest ratio) and of the idle
+ * injection the kernel does on top. The caller feeds it every CPU's
+ * IA32_THERM_STATUS (readThermalStatus()); the readout there is the distance
+ * to TjMax in degrees, and the hottest core counts.
+ *
+ * Down to softMargin nothing is capped. From there to hardMargin the fastest
+ * state allowed moves evenly from P0 to the slowest one, and at hardMargin or
+ * while any core asserts PROCHOT only the slowest is left. A tighter cap
+ * takes effect at once; it loosens one state per update, and only once the
+ * margin is thermalHysteresis degrees past where the looser cap would start.
+ *
+ * Readings without the valid bit are ignored; without any it caps nothing.
+ */
+class ThermalCap {
+public:
+	uint8_t		tjMax;		// degrees C, for temperature() only
+	uint8_t		softMargin;	// degrees, 0 = off
+	uint8_t		hardMargin;
+
+	void	setDefaults();
+	void	reset();
+	void	update(const uint64_t* status, int cpus);
+
+	bool	valid() const { return validCPUs > 0; }
+	int	margin() const { return minMargin; }		// degrees below TjMax, hottest core
+	int	temperature(int cpu) const;			// degrees C, -1 if not valid
+	int	cpus() const { return count; }
+	int	cap() const { return capState; }		// fastest PStates[] index allowed
+	int	hardCap() const;				// the same, from hardMargin and PROCHOT only
+	bool	prochot() const { return hot; }
+
+	/* Statistics */
+	uint64_t	hotUpdates;	// updates that found a core at PROCHOT
+
+private:
+	int	capFor(int margin) const;
+
+	int8_t		readout[max_cpus];	// -1 = not valid
+	int		count;
+	int		validCPUs;
+	int		minMargin;
+	uint8_t		capState;
+	bool		hot;
+};
+
+/*
+ * Lumped RC model of the package, fitted online. Over a step of stepMS
+ * drawing P[k], the hottest core goes from T[k] to
+ *
+ *	T[k+1] = phi * T[k] + gain * P[k] + carry * P[k-1] + offset
+ *
+ * That is the exact discrete form of C dT/dt = P - (T - ambient) / R, with
+ * phi = exp(-step / RC), plus a small resistance straight from the core to
+ * its sensor: the hot spot follows the power at once, so it is in T[k]
+ * from P[k-1] (carry takes it out again) and in T[k+1] from P[k]. Predicting
+ * needs no exp(); a constant power settles at
+ * ((gain + carry) * P + offset) / (1 - phi). The parameters come from least
+ * squares with exponential forgetting over the steps so far, in fixed
+ * point: temperatures in 1/16 C, power in 1/16 W, parameters in 1/65536.
+ * Until the power and the temperature have moved enough to tell them apart,
+ * and whenever the fit comes out unphysical, the last good fit stays (or
+ * there is none, valid() is false).
+ *
+ * Steps are closed by update() once stepMS have passed; one that ran longer
+ * has its temperature change scaled back to stepMS.
+ */
+class ThermalModel {
+public:
+	uint32_t	stepMS;
+	uint8_t		memory;		// forgetting, 1..10
+
+	void	setDefaults();
+	void	reset();
+
+	/* intervalMS just went by at powerMW on average, and ended at tempC16 (1/16 C) */
+	void	update(int tempC16, uint32_t powerMW, uint32_t intervalMS);
+
+	bool	valid() const { return fitted; }
+	/* 1/16 C after a step at powerMW from tempC16, the step before it having drawn lastMW */
+	int	step(int tempC16, uint32_t powerMW, uint32_t lastMW) const;
+	/* 1/16 C after steps at powerMW, starting from tempC16 right after the last step */
+	int	predict(int tempC16, uint32_t powerMW, int steps) const;
+	/* 1/16 C a constant powerMW settles at */
+	int	steady(uint32_t powerMW) const;
+	/* Steps before powerMW takes tempC16 past limitC16, maxSteps if not that soon */
+	int	stepsUntil(int tempC16, uint32_t powerMW, int limitC16, int maxSteps) const;
+
+	/* The fit in the usual units */
+	uint32_t	resistance() const;	// C/W x 1000, to ambient
+	uint32_t	tauMS() const;
+	int		ambient() const;	// C
+	uint32_t	power() const { return lastPowerMW; }	// of the last update
+
+	uint64_t	fits;		// steps that moved the fit
+
+private:
+	enum { xFrom, xPower, xLastPower, yTo, terms };
+
+	void	addStep(int fromC16, int toC16, int power16);
+	void	solve();
+
+	bool		primed;
+	int		stepStartC16;
+	uint64_t	stepEnergy;	// mW x ms so far in this step
+	uint32_t	stepElapsedMS;
+	uint32_t	lastPowerMW;
+	int		lastStep16;	// power of the last step, 1/16 W, -1 before the first
+	int64_t		n;		// weight of the sums, up to 2^memory
+	int64_t		sum[terms];
+	int64_t		cross[terms][terms];
+	bool		fitted;
+	int64_t		phi, gain, carry, offset;	// x 65536, offset in 1/16 C
+};
+
+/*
+ * Spends the thermal headroom at P0 for as long as the model says it lasts,
+ * then settles on the fastest state it says can run forever, both below
+ * limitMargin degrees under TjMax. A boost only starts when the model
+ * promises at least boostMinMS of it, so that once settled a degree or two
+ * of headroom doesn't make it flip between P0 and the sustainable state.
+ * Past the limit anyway (the model was off) it tightens one state per
+ * update until the temperature is back. While the model isn't valid()
+ * it caps nothing and the controller falls back to ThermalCap.
+ */
+class ThermalBudget {
+public:
+	uint8_t		limitMargin;	// degrees below TjMax, 0 = off
+	uint32_t	boostMinMS;
+	ThermalModel	model;
+
+	void	setDefaults();
+	/* Forgets the fit too */
+	void	reset();
+
+	/*
+	 * After thermal.update(): the interval of intervalMS just ended having
+	 * drawn spentMW, and powerAt[i] is what PStates[i] would draw at the
+	 * present demand.
+	 */
+	void	update(const ThermalCap& thermal, uint32_t spentMW, const uint32_t* powerAt, uint32_t intervalMS);
+
+	bool	active() const { return limitMargin && model.valid(); }
+	int	cap() const { return active() ? capState : 0; }	// fastest PStates[] index allowed
+	int	sustainable() const { return sustainableState; }
+	uint32_t boostLeftMS() const { return leftMS; }	// at P0 before the limit, as of the last update
+
+	uint64_t	boosts;		// times it let P0 run past the sustainable state
+
+private:
+	uint8_t		capState;
+	uint8_t		sustainableState;
+	bool		boosting;
+	uint32_t	leftMS;
+};
+
+#endif // _THERMAL_H
@@ -0,0 +1,666 @@
+#include "ThrottleController.h"
+#include "Utility.h"
+
+void CPULoadTracker::reset() {
+	bzero(cpu_load_last, sizeof(cpu_load_last));
+	count = 0;
+}
+
+void CPULoadTracker::update(const processor_cpu_load_info* load, int cpus, long* idle, long* total) {
+	processor_cpu_load_info delta;
+	unsigned int cpu_maxload = 0;
+	/* Superhai method */
+	unsigned int temp_ticks = 0;
+	for (int i = 0; i < cpus && i < max_cpus; i++)
+	{
+		total_ticks[i] = 0;
+		delta = load[i];
+		for (int t = 0; t < CPU_STATE_MAX; t++)
+		{
+			(delta.cpu_ticks[t]) -= (cpu_load_last[i].cpu_ticks[t]);
+			total_ticks[i] += (delta.cpu_ticks[t]);
+		}
+		load_ticks[i] = total_ticks[i] - delta.cpu_ticks[CPU_STATE_IDLE];
+		if ((load_ticks[i]) > temp_ticks)
+		{
+			temp_ticks = load_ticks[i];
+			cpu_maxload = i;
+		}
+		cpu_load_last[i] = load[i];
+	}
+	count = cpus < max_cpus ? cpus : max_cpus;
+
+	*total = total_ticks[cpu_maxload];
+	*idle  = *total - load_ticks[cpu_maxload];
+}
+
+long CPULoadTracker::load(int cpu) const {
+	if (cpu < 0 || cpu >= count || !total_ticks[cpu]) return 0;
+	return (long) load_ticks[cpu] * 1000 / total_ticks[cpu];
+}
+
+#define avenrunFract	800	// osfmk/kern/mach_factor.c, the 5 second average
+
+void RunQueueTracker::reset() {
+	lastAvenrun = 0;
+	lastRunnable = 0;
+	cpus = 1;
+	primed = false;
+}
+
+void RunQueueTracker::update(const host_load_info* info, int count) {
+	int avenrun = info->avenrun[0];
+	cpus = count > 0 ? count : 1;
+	if (!primed) {
+		lastRunnable = avenrun > 0 ? avenrun : 0;
+		primed = true;
+	} else if (avenrun != lastAvenrun) {
+		// Undo one step of the average
+		int runnable = (avenrun * LOAD_SCALE - lastAvenrun * avenrunFract) / (LOAD_SCALE - avenrunFract);
+		lastRunnable = runnable > 0 ? runnable : 0;
+	}
+	lastAvenrun = avenrun;
+}
+
+long RunQueueTracker::load(long used) const {
+	if (lastRunnable > (uint32_t) cpus * LOAD_SCALE)
+		return 1000;
+	return used;
+}
+
+void IPCTracker::reset() {
+	lastIPC = 0;
+	lastCycles = 0;
+	primed = false;
+}
+
+void IPCTracker::update(const FixedCounters* counters, int cpus) {
+	uint64_t maxCycles = 0, maxInstructions = 0;
+	for (int i = 0; i < cpus && i < max_cpus; i++) {
+		uint64_t cycles		= (counters[i].cycles - last[i].cycles) & FIXED_CTR_MASK;
+		uint64_t instructions	= (counters[i].instructions - last[i].instructions) & FIXED_CTR_MASK;
+		if (cycles > maxCycles) {
+			maxCycles = cycles;
+			maxInstructions = instructions;
+		}
+		last[i] = counters[i];
+	}
+	if (primed) {
+		lastCycles = maxCycles;
+		lastIPC = maxCycles ? (uint32_t) (maxInstructions * 1000 / maxCycles) : 0;
+	}
+	primed = true;
+}
+
+void C0Tracker::reset() {
+	bzero(c0, sizeof(c0));
+	bzero(mhz, sizeof(mhz));
+	lastTscMHz = 0;
+	count = 0;
+	primed = false;
+}
+
+void C0Tracker::update(const ClockCounters* counters, int cpus) {
+	uint64_t now, ns;
+	clock_get_uptime(&now);
+	if (cpus > max_cpus) cpus = max_cpus;
+	if (primed) {
+		absolutetime_to_nanoseconds(now - lastUptime, &ns);
+		uint64_t tsc = counters[0].tsc - last[0].tsc;
+		if (ns) lastTscMHz = (uint32_t) (tsc * 1000 / ns);
+		for (int i = 0; i < cpus; i++) {
+			uint64_t dtsc	= counters[i].tsc - last[i].tsc;
+			uint64_t mperf	= counters[i].mperf - last[i].mperf;
+			uint64_t aperf	= counters[i].aperf - last[i].aperf;
+			c0[i]	= dtsc ? (uint32_t) (mperf * 1000 / dtsc) : 0;
+			if (c0[i] > 1000) c0[i] = 1000;
+			mhz[i]	= mperf ? (uint32_t) (aperf * lastTscMHz / mperf) : 0;
+		}
+		count = cpus;
+	}
+	for (int i = 0; i < cpus; i++)
+		last[i] = counters[i];
+	lastUptime = now;
+	primed = true;
+}
+
+long C0Tracker::load() const {
+	uint32_t busiest = 0;
+	for (int i = 0; i < count; i++)
+		if (c0[i] > busiest) busiest = c0[i];
+	return busiest;
+}
+
+uint32_t C0Tracker::residency(int cpu) const {
+	return cpu >= 0 && cpu < count ? c0[cpu] : 0;
+}
+
+uint32_t C0Tracker::effectiveMHz(int cpu) const {
+	return cpu >= 0 && cpu < count ? mhz[cpu] : 0;
+}
+
+void LoadAggregator::setDefaults() {
+	reduction	= reduceMax;
+	shortShift	= defaultShortShift;
+	longShift	= defaultLongShift;
+}
+
+void LoadAggregator::reset() {
+	bzero(shortAvg, sizeof(shortAvg));
+	bzero(longAvg, sizeof(longAvg));
+	count = 0;
+	primed = false;
+}
+
+void LoadAggregator::update(const long* demand, int cpus) {
+	if (cpus > max_cpus) cpus = max_cpus;
+	for (int i = 0; i < cpus; i++) {
+		int32_t x = (demand[i] < 0 ? 0 : (demand[i] > 1000 ? 1000 : demand[i])) << 8;
+		if (!primed || i >= count) {
+			shortAvg[i] = longAvg[i] = x;
+			continue;
+		}
+		shortAvg[i] += (x - shortAvg[i]) / (1 << shortShift);
+		longAvg[i]  += (x - longAvg[i]) / (1 << longShift);
+	}
+	count = cpus;
+	primed = true;
+}
+
+long LoadAggregator::reduce(const long* load, int cpus) const {
+	long first = 0, second = 0, sum = 0;
+	if (cpus <= 0) return 0;
+	for (int i = 0; i < cpus; i++) {
+		sum += load[i];
+		if (load[i] > first) {
+			second = first;
+			first = load[i];
+		} else if (load[i] > second) {
+			second = load[i];
+		}
+	}
+	switch (reduction) {
+		case reduceMean:	return sum / cpus;
+		case reduceSum:		return sum < 1000 ? sum : 1000;
+		case reduceSecond:	return cpus > 1 ? second : first;
+		default:		return first;
+	}
+}
+
+long LoadAggregator::shortDemand() const {
+	long v[max_cpus];
+	for (int i = 0; i < count; i++) v[i] = shortAvg[i] >> 8;
+	return reduce(v, count);
+}
+
+long LoadAggregator::longDemand() const {
+	long v[max_cpus];
+	for (int i = 0; i < count; i++) v[i] = longAvg[i] >> 8;
+	return reduce(v, count);
+}
+
+void ThrottleController::setDefaults() {
+	targetCPULoad	= defaultTargetLoad; // % x10
+	quantumMS	= throttleQuantum;
+	timeoutScale	= defaultTimeoutScale;
+	upThreshold	= defaultUpThreshold;
+	downThreshold	= defaultDownThreshold;
+	minDwellMS	= defaultMinDwell;
+	skipCostly	= true;
+	loadSource	= loadFromTicks;
+	memBoundIPC	= defaultMemBoundIPC;
+	memBoundLoss	= defaultMemBoundLoss;
+	boostPState	= 0;
+	boostHoldMS	= defaultBoostHold;
+	qos.reset();
+	damper.setDefaults();
+	limiter.setDefaults();
+	limiterTimer	= 0;
+	thermal.setDefaults();
+	thermalBudget.setDefaults();
+	loads.setDefaults();
+	tuner.setDefaults();
+	pid.setDefaults();
+	ondemand.setDefaults();
+	conservative.setDefaults();
+	markov.setDefaults();
+	energy.setDefaults();
+	race.setDefaults();
+	active		= 0;
+	requested	= -1;
+}
+
+void ThrottleController::reset() {
+	ticks.reset();
+	runQueue.reset();
+	ipc.reset();
+	c0.reset();
+	loads.reset();
+	currentPState = NumberOfPStates - 1;
+	dwellMS = 0;
+	if (!quantumMS) quantumMS = throttleQuantum;
+	if (!targetCPULoad) targetCPULoad = defaultTargetLoad; // % x10
+	if (tuner.enabled) targetCPULoad = tuner.target();
+	lastTimeoutMS = quantumMS;
+	stateChanges = defaultChanges = shadowedChanges = skippedChanges = memBoundSamples = boosts = qosClamped = 0;
+	deferredChanges = coalescedChanges = thermalCapped = 0;
+	boostUntil = 0;
+	schedule.cancel();
+	damper.reset();
+	limiter.reset();
+	thermal.reset();
+	thermalBudget.reset();
+	pendingPState = -1;
+	appliedCtl = 0;
+	if (requested >= 0) {
+		active = requested;
+		requested = -1;
+	}
+	activeGovernor()->start(*this, currentPState);
+	restartShadow();
+}
+
+Governor* ThrottleController::governor(int index) {
+	Governor* all[numberOfGovernors] = { &proportional, &pid, &ondemand, &conservative, &markov, &energy, &race };
+	return index >= 0 && index < numberOfGovernors ? all[index] : 0;
+}
+
+int ThrottleController::findGovernor(const char* name) {
+	for (int i = 0; i < numberOfGovernors; i++)
+		if (!strcmp(governor(i)->name(), name)) return i;
+	return -1;
+}
+
+const char* ThrottleController::governorName() {
+	int8_t next = requested;
+	return governor(next >= 0 ? next : active)->name();
+}
+
+bool ThrottleController::selectGovernor(const char* name) {
+	return selectGovernor(findGovernor(name));
+}
+
+bool ThrottleController::selectGovernor(int index) {
+	if (!governor(index)) return false;
+	requested = index; // a single byte store, picked up by the next sample
+	return true;
+}
+
+void ThrottleController::switchGovernor() {
+	int8_t next = requested;
+	if (next < 0) return;
+	requested = -1;
+	if (next == active) return;
+	dbg("Switching to the %s governor\n", governor(next)->name());
+	// Bumpless: whatever takes over starts from the state we're in
+	governor(next)->start(*this, currentPState);
+	active = next;
+	restartShadow();
+}
+
+void ThrottleController::restartShadow() {
+	shadowPState = currentPState;
+	shadowDwellMS = dwellMS;
+}
+
+void ThrottleController::shadowDefault(long used, uint32_t timeoutMS) {
+	// The load as it would have been at the shadow's speed
+	long shadowUsed = used * PStates[currentPState].AcpiFreq / PStates[shadowPState].AcpiFreq;
+	if (shadowUsed > 1000) shadowUsed = 1000;
+
+	int step = proportional.step(*this, shadowUsed, loads.longDemand(), shadowPState, shadowDwellMS);
+	if (step != shadowPState) {
+		defaultChanges++;
+		shadowDwellMS = 0;
+		shadowPState = step;
+	}
+	shadowDwellMS += timeoutMS;
+}
+
+uint32_t ThrottleController::timeoutFor(int pstate) const {
+	return quantumMS * (10 + timeoutScale * (NumberOfPStates - 1 - pstate)) / 10;
+}
+
+bool ThrottleController::worthSwitching(int from, int to, long used, uint32_t timeoutMS) const {
+	uint64_t fFrom = PStates[from].AcpiFreq, fTo = PStates[to].AcpiFreq;
+	uint64_t busyUS = (uint64_t) used * timeoutMS; // used is permille, so this is usec
+	uint64_t gainUS;
+	if (fTo > fFrom)
+		gainUS = busyUS * (fTo - fFrom) / fTo;
+	else	// the whole interval runs slower, idle or not: count it as time at from's power
+		gainUS = (uint64_t) timeoutMS * 1000 * (fFrom - fTo) / fFrom;
+	return gainUS >= transitionLatency(from, to);
+}
+
+bool ThrottleController::memoryBound() const {
+	uint64_t intervalCycles = (uint64_t) lastTimeoutMS * PStates[currentPState].AcpiFreq * 1000;
+	return ipc.ipc() && ipc.ipc() < memBoundIPC && ipc.cycles() >= intervalCycles / 4;
+}
+
+int ThrottleController::memoryBoundCap() const {
+	uint64_t cpi = 1000000 / ipc.ipc(), f = PStates[currentPState].AcpiFreq; // x1000
+	if (cpi <= 1000) return 0;
+	uint64_t stall = cpi - 1000; // stall cycles per instruction at f, x1000
+	uint64_t f0 = PStates[0].AcpiFreq, cpi0 = 1000 + stall * f0 / f;
+	for (int i = NumberOfPStates - 1; i > 0; i--) {
+		uint64_t g = PStates[i].AcpiFreq, cpiG = 1000 + stall * g / f;
+		if (g * cpi0 * 100 >= f0 * cpiG * (100 - memBoundLoss)) // rate is MHz / CPI
+			return i;
+	}
+	return 0;
+}
+
+void OscillationDamper::setDefaults() {
+	flips		= defaultOscillationFlips;
+	windowMS	= defaultOscillationWindow;
+	holdMS		= defaultOscillationHold;
+}
+
+void OscillationDamper::reset() {
+	run = 0;
+	lastUp = false;
+	lastChangeNS = 0;
+	holding = false;
+	oscillations = damped = 0;
+}
+
+int OscillationDamper::step(int from, int want, uint64_t nowNS) {
+	if (!flips) {
+		holding = false;
+		return want;
+	}
+	if (holding && nowNS >= holdUntilNS) holding = false;
+	if (holding) {
+		if (from == fast && want > fast && want <= slow) {
+			// Only busy spells in between keep it going, a plain lull runs out
+			if (busySinceDamped) holdUntilNS = nowNS + (uint64_t) holdMS * 1000000;
+			busySinceDamped = false;
+			damped++;
+			return from;
+		}
+		if (want == from) busySinceDamped = true;
+		else holding = false; // out of the band, the load moved
+	}
+	if (want == from) return want;
+
+	// The other way than the last change, soon enough?
+	bool up = want < from;
+	if (run && up != lastUp && nowNS - lastChangeNS <= (uint64_t) windowMS * 1000000) {
+		run++;
+		if (want < bandFast) bandFast = want;
+		if (want > bandSlow) bandSlow = want;
+	} else {
+		run = 1;
+		bandFast = up ? want : from;
+		bandSlow = up ? from : want;
+	}
+	lastUp = up;
+	lastChangeNS = nowNS;
+	if (run < flips) return want;
+
+	oscillations++;
+	run = 0;
+	holding = true;
+	busySinceDamped = false;
+	fast = bandFast;
+	slow = bandSlow;
+	holdUntilNS = nowNS + (uint64_t) holdMS * 1000000;
+	dbg("Oscillating between %d and %d MHz, holding %d MHz\n", PStates[slow].AcpiFreq, PStates[fast].AcpiFreq,
+	    PStates[fast].AcpiFreq);
+	if (want > fast) {
+		damped++;
+		return fast;
+	}
+	return want;
+}
+
+void TransitionLimiter::setDefaults() {
+	ratePerS	= defaultTransitionRate;
+	burst		= defaultTransitionBurst;
+}
+
+/*
+ * ratePerS and burst are read once per call: the cost is derived from that
+ * copy, so a new setting can never be seen half way through
+ */
+void TransitionLimiter::reset() {
+	uint16_t rate = ratePerS, size = burst;
+	creditNS = rate ? (uint64_t) (size ? size : 1) * costNS(rate) : 0;
+	lastNS = 0;
+}
+
+void TransitionLimiter::refill(uint64_t nowNS, uint64_t tokenNS) {
+	uint16_t size = burst;
+	uint64_t full = (uint64_t) (size ? size : 1) * tokenNS;
+	if (lastNS && nowNS > lastNS) creditNS += nowNS - lastNS;
+	if (!lastNS || creditNS > full) creditNS = full;
+	lastNS = nowNS;
+}
+
+bool TransitionLimiter::take(uint64_t nowNS) {
+	uint16_t rate = ratePerS;
+	if (!rate) return true;
+	uint64_t cost = costNS(rate);
+	refill(nowNS, cost);
+	if (creditNS < cost) return false;
+	creditNS -= cost;
+	return true;
+}
+
+uint64_t TransitionLimiter::waitNS(uint64_t nowNS) {
+	uint16_t rate = ratePerS;
+	if (!rate) return 0;
+	uint64_t cost = costNS(rate);
+	refill(nowNS, cost);
+	return creditNS < cost ? cost - creditNS : 0;
+}
+
+static uint64_t uptimeNS() {
+	uint64_t now, ns;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &ns);
+	return ns;
+}
+
+int ThrottleController::sample(long idle, long total, uint32_t* timeoutMS) {
+	LoadSample s;
+	int wantstep;
+
+	switchGovernor();
+
+	// Used = % used x 10, per CPU
+	long load[max_cpus];
+	int cpus;
+	if (loadSource == loadFromAPERF && c0.valid()) {
+		cpus = c0.cpus();
+		for (int i = 0; i < cpus; i++) load[i] = c0.residency(i);
+	} else if (total <= 0) { // no ticks since the last sample, nothing to go by
+		*timeoutMS = lastTimeoutMS;
+		return currentPState;
+	} else if (ticks.cpus() > 0) {
+		cpus = ticks.cpus();
+		for (int i = 0; i < cpus; i++) load[i] = ticks.load(i);
+	} else {
+		cpus = 1;
+		load[0] = ((total - idle) * 1000) / total;
+	}
+	s.used = loads.reduce(load, cpus);
+	if (thermal.valid())
+		updateThermalBudget(load, cpus);
+
+	// The same as demand for the averages
+	uint32_t f = PStates[currentPState].AcpiFreq, f0 = PStates[0].AcpiFreq;
+	for (int i = 0; i < cpus; i++) load[i] = load[i] * f / f0;
+	loads.update(load, cpus);
+	s.shortDemand	= loads.shortDemand();
+	s.longDemand	= loads.longDemand();
+
+	if (tuner.enabled && tuner.sample(s, energy.idlePower))
+		targetCPULoad = tuner.target();
+	if (loadSource == loadFromRunQueue)
+		s.used = runQueue.load(s.used);
+	s.pstate	= currentPState;
+	s.dwellMS	= dwellMS;
+	s.intervalMS	= lastTimeoutMS;
+
+	wantstep = activeGovernor()->sample(*this, s, timeoutMS);
+	if (wantstep < 0 || wantstep >= NumberOfPStates) wantstep = currentPState;
+	if (memBoundIPC && memoryBound()) {
+		int cap = memoryBoundCap();
+		if (wantstep < cap) {
+			memBoundSamples++;
+			wantstep = cap;
+		}
+	}
+	if (skipCostly && wantstep != currentPState && s.used < 950 &&
+	    !worthSwitching(currentPState, wantstep, s.used, *timeoutMS)) {
+		skippedChanges++;
+		wantstep = currentPState;
+	}
+	if (activeGovernor()->damped())
+		wantstep = damper.step(currentPState, wantstep, uptimeNS());
+	if (wantstep > boostPState && boosting())
+		wantstep = boostPState;
+	int limited = qos.clamp(wantstep, uptimeNS());
+	if (limited != wantstep) {
+		qosClamped++;
+		wantstep = limited;
+	}
+	if (active != 0) shadowDefault(s.used, *timeoutMS);
+	return wantstep;
+}
+
+bool ThrottleController::boosting() const {
+	return boostHoldMS && uptimeNS() < boostUntil;
+}
+
+bool ThrottleController::boost() {
+	if (!boostHoldMS || boostPState >= NumberOfPStates || schedule.running()) return false;
+	boostUntil = uptimeNS() + (uint64_t) boostHoldMS * 1000000;
+	if (currentPState <= boostPState) return false; // fast enough already, just hold
+
+	if (!moveTo(boostPState, true)) return false;
+	boosts++;
+	return true;
+}
+
+bool ThrottleController::applyLimits() {
+	if (schedule.running()) return false;
+	// A change waiting for a token was clamped to the old limits, hold it to the new ones too
+	int want = pendingPState >= 0 ? pendingPState : currentPState;
+	int pstate = qos.clamp(want, uptimeNS());
+	if (pstate == want && (pendingPState >= 0 || pstate == currentPState)) return false;
+	return moveTo(pstate, true);
+}
+
+void ThrottleController::startSchedule(IOTimerEventSource* timer) {
+	schedule.start(uptimeNS());
+	scheduleEvent(timer);
+}
+
+void ThrottleController::stopSchedule(IOTimerEventSource* timer) {
+	schedule.cancel();
+	timer->cancelTimeout();
+}
+
+void ThrottleController::scheduleEvent(IOTimerEventSource* timer) {
+	uint64_t waitNS;
+	int pstate = schedule.due(uptimeNS(), &waitNS);
+	// Arm first, the next deadline doesn't move by however long throttling takes
+	if (schedule.running())
+		timer->setTimeoutUS((uint32_t) ((waitNS + 999) / 1000));
+	if (pstate >= 0 && pstate < NumberOfPStates)
+		moveTo(pstate, false);
+}
+
+void ThrottleController::cancelPending() {
+	if (pendingPState >= 0 && limiterTimer) limiterTimer->cancelTimeout();
+	pendingPState = -1;
+}
+
+void ThrottleController::limiterEvent() {
+	if (pendingPState < 0 || schedule.running()) return;
+	// The boost or the qos limits may have changed while it waited
+	int pstate = pendingPState;
+	if (pstate > boostPState && boosting())
+		pstate = boostPState;
+	moveTo(qos.clamp(pstate, uptimeNS()), true);
+}
+
+void ThrottleController::updateThermalBudget(const long* load, int cpus) {
+	uint32_t powerAt[16], idle = energy.idlePower;
+	uint32_t f = PStates[currentPState].AcpiFreq;
+	for (int s = 0; s < (int) NumberOfPStates; s++) {
+		uint64_t mW = 0;
+		for (int i = 0; i < cpus; i++) {
+			uint64_t busy = (uint64_t) load[i] * f / PStates[s].AcpiFreq;
+			if (busy > 1000) busy = 1000;
+			mW += (busy * PStates[s].Power + (1000 - busy) * idle) / 1000;
+		}
+		powerAt[s] = (uint32_t) mW;
+	}
+	thermalBudget.update(thermal, powerAt[currentPState], powerAt, lastTimeoutMS);
+}
+
+int ThrottleController::thermalCeiling() const {
+	if (!thermalBudget.active()) return thermal.cap();
+	int cap = thermalBudget.cap(), hard = thermal.hardCap();
+	return cap > hard ? cap : hard;
+}
+
+bool ThrottleController::moveTo(int pstate, bool governed) {
+	int ceiling = thermalCeiling();
+	if (pstate < ceiling) {
+		thermalCapped++;
+		pstate = ceiling;
+	}
+	if (governed && pstate != currentPState) {
+		uint64_t now = uptimeNS();
+		if (!limiter.take(now)) {
+			if (pstate != pendingPState) {
+				deferredChanges++;
+				if (pendingPState >= 0) coalescedChanges++;
+				pendingPState = pstate;
+			}
+			if (limiterTimer) limiterTimer->setTimeoutUS((uint32_t) ((limiter.waitNS(now) + 999) / 1000));
+			return false;
+		}
+	}
+	bool changed = pstate != currentPState;
+	cancelPending();
+	// Staying put needs no rendezvous, unless the voltage was changed under it
+	uint16_t ctl = CTL(PStates[pstate].Frequency, PStates[pstate].Voltage);
+	if (!changed && ctl == appliedCtl) return false;
+	if (changed) {
+		stateChanges++;
+		if (governed && active != 0) shadowedChanges++;
+		currentPState = pstate;
+		dwellMS = 0;
+	}
+	throttleAllCPUs(&PStates[currentPState]);
+	appliedCtl = ctl;
+	return changed;
+}
+
+void ThrottleController::timerEvent(long idle, long total, IOTimerEventSource* timer) {
+	uint32_t timeout;
+
+	// gather stats
+	PStates[currentPState].TimesChosen++;
+	totalTimerEvents++;
+
+	qos.expire(uptimeNS());
+	if (schedule.running()) {
+		dwellMS += lastTimeoutMS;
+		timer->setTimeoutMS(lastTimeoutMS);
+		return;
+	}
+
+	uint8_t wantstep = sample(idle, total, &timeout);
+	PStates[wantstep].Voltage = mV_to_VID(975);
+	moveTo(wantstep, true); // Assume we got the one we wanted, or it waits for the limiter
+	dwellMS += timeout;
+	lastTimeoutMS = timeout;
+
+	timer->setTimeoutMS(timeout);
+}
@@ -0,0 +1,462 @@
+#ifndef _THROTTLECONTROLLER_H
+#define _THROTTLECONTROLLER_H
+
+#include "Throttling.h"
+#include "Governors.h"
+#include "TargetTuner.h"
+#include "PStateSchedule.h"
+#include "QoSRequests.h"
+#include "Thermal.h"
+
+#ifndef IESS_HOST
+#include <IOKit/IOTimerEventSource.h>
+#include <mach/processor_info.h>
+#include <mach/host_info.h>
+#endif
+
+const uint32_t throttleQuantum		= 100; // ms
+const uint32_t defaultTargetLoad	= 400; // percent x 10
+const uint16_t defaultTimeoutScale	= 10;  // x10, see ThrottleController::timeoutFor()
+const uint16_t defaultUpThreshold	= 50;  // percent x 10 above the target before stepping up
+const uint16_t defaultDownThreshold	= 100; // percent x 10 below the target before stepping down
+const uint32_t defaultMinDwell		= 200; // ms in a state before leaving it again
+const uint16_t defaultMemBoundIPC	= 300; // IPC x 1000 under which a busy CPU is stalled on memory
+const uint8_t  defaultMemBoundLoss	= 3;   // percent of P0's instruction rate a memory bound CPU may give up
+const uint32_t defaultBoostHold		= 300; // ms at boostPState after input, 0 = no boost
+const uint8_t  defaultOscillationFlips	= 4;   // changes in a row alternating up and down that count as oscillating, 0 = off
+const uint32_t defaultOscillationWindow	= 1200; // ms, at most this far apart
+const uint32_t defaultOscillationHold	= 2000; // ms the fast end is held after the last busy spell
+const uint16_t defaultTransitionRate	= 10;  // P-State changes per second the limiter refills, 0 = unlimited
+const uint16_t defaultTransitionBurst	= 10;  // changes it lets through in a row
+const uint8_t  defaultShortShift	= 1;   // short load average moves 1/2 of the way per sample
+const uint8_t  defaultLongShift		= 4;   // long one 1/16
+
+const int numberOfGovernors		= 7;
+
+/* Where ThrottleController::sample() gets the load from */
+enum {
+	loadFromTicks		= 0,	// busiest CPU's ticks only
+	loadFromRunQueue	= 1,	// ticks, but full load while threads wait to run
+	loadFromAPERF		= 2,	// busiest CPU's C0 residency from MPERF
+};
+
+/* How LoadAggregator makes one load out of the per-CPU ones */
+enum {
+	reduceMax		= 0,	// the busiest CPU
+	reduceMean		= 1,	// all of them on average
+	reduceSum		= 2,	// the whole voltage domain's work on one CPU, up to 100%
+	reduceSecond		= 3,	// the second busiest, ignores a single hog
+	numberOfReductions
+};
+
+/*
+ * Turns the cumulative per-CPU tick counters from processor_info(PROCESSOR_CPU_LOAD_INFO)
+ * into the load since the previous update. idle and total are the busiest
+ * CPU's, load() has every one.
+ */
+class CPULoadTracker {
+public:
+	void	reset();
+	void	update(const processor_cpu_load_info* load, int cpus, long* idle, long* total);
+
+	/* Per CPU load of the last update, percent x 10 */
+	long	load(int cpu) const;
+	int	cpus() const { return count; }
+
+private:
+	uint32_t		total_ticks[max_cpus];
+	uint32_t		load_ticks[max_cpus];
+	processor_cpu_load_info	cpu_load_last[max_cpus];
+	int			count;
+};
+
+/*
+ * Runnable threads from the scheduler's load average, host_statistics(HOST_LOAD_INFO).
+ * avenrun[0] is a 5 second average the scheduler updates once a second as
+ * avenrun = (avenrun * 800 + runnable * 200) / 1000, so whenever it changes
+ * the runnable count of the last second can be solved for. Ticks can't tell
+ * one busy thread from eight runnable ones; this can.
+ */
+class RunQueueTracker {
+public:
+	void	reset();
+	void	update(const host_load_info* info, int cpus);
+
+	/* Runnable threads in the last scheduler second, LOAD_SCALE units */
+	uint32_t	runnable() const { return lastRunnable; }
+
+	/* The tick load (percent x 10), or full load when more threads are runnable than there are CPUs */
+	long		load(long used) const;
+
+private:
+	int		lastAvenrun;
+	uint32_t	lastRunnable;
+	int		cpus;
+	bool		primed;
+};
+
+/*
+ * Instructions per cycle from the fixed counters (see readFixedCounters()) since
+ * the previous update, of the CPU that ran the most unhalted cycles: that is
+ * the one the package speed is picked for.
+ */
+class IPCTracker {
+public:
+	void	reset();
+	void	update(const FixedCounters* counters, int cpus);
+
+	uint32_t	ipc() const	{ return lastIPC; }	// x1000, 0 until there have been two updates
+	uint64_t	cycles() const	{ return lastCycles; }	// the unhalted cycles it was measured over
+
+private:
+	FixedCounters	last[max_cpus];
+	uint32_t	lastIPC;
+	uint64_t	lastCycles;
+	bool		primed;
+};
+
+/*
+ * C0 residency and delivered clock per CPU from readClockCounters() since the
+ * previous update. MPERF only counts in C0, at the TSC rate, so MPERF / TSC
+ * is the share of the interval the CPU was busy, to the cycle instead of to
+ * the scheduler tick. APERF counts at the clock actually delivered, so
+ * APERF / MPERF times the TSC rate is the average MHz while busy, whatever
+ * PERF_CTL asked for. The TSC rate is measured against the uptime clock.
+ */
+class C0Tracker {
+public:
+	void	reset();
+	void	update(const ClockCounters* counters, int cpus);
+
+	bool		valid() const { return primed && count > 0; }	// has an interval
+	long		load() const;			// percent x 10, busiest CPU
+	uint32_t	residency(int cpu) const;	// percent x 10 in C0
+	uint32_t	effectiveMHz(int cpu) const;	// average while in C0, 0 if it never was
+	uint32_t	tscMHz() const { return lastTscMHz; }
+	int		cpus() const { return count; }
+
+private:
+	ClockCounters	last[max_cpus];
+	uint32_t	c0[max_cpus];		// percent x 10
+	uint32_t	mhz[max_cpus];
+	uint64_t	lastUptime;
+	uint32_t	lastTscMHz;
+	int		count;
+	bool		primed;
+};
+
+/*
+ * Short and long exponential averages of every CPU's demand, reduced to one
+ * number across the CPUs. Demand is the load scaled to P0 (permille of what
+ * P0 can do), so the averages don't jump when the speed changes. Kept in
+ * 1/256 permille; each update moves an average 1/2^shift of the way to the
+ * new sample, so how much time that spans depends on the sampling interval.
+ * The first update starts both at the sample.
+ */
+class LoadAggregator {
+public:
+	uint8_t		reduction;	// reduceMax, reduceMean, reduceSum or reduceSecond
+	uint8_t		shortShift;	// 1..8
+	uint8_t		longShift;	// 1..8, normally above shortShift
+
+	void	setDefaults();
+	void	reset();
+	void	update(const long* demand, int cpus);
+
+	/* One load out of per-CPU ones (percent x 10) by the reduction */
+	long	reduce(const long* load, int cpus) const;
+
+	long	shortDemand() const;	// reduced, permille of P0
+	long	longDemand() const;
+	long	shortDemand(int cpu) const { return cpu >= 0 && cpu < count ? shortAvg[cpu] >> 8 : 0; }
+	long	longDemand(int cpu) const { return cpu >= 0 && cpu < count ? longAvg[cpu] >> 8 : 0; }
+
+private:
+	int32_t		shortAvg[max_cpus];	// permille << 8
+	int32_t		longAvg[max_cpus];
+	int		count;
+	bool		primed;
+};
+
+/*
+ * Notices the controller flipping up and down, as periodic work at about
+ * the sampling rate makes it do, and holds the fast end instead; every flip
+ * is a rendezvous with interrupts off and a PLL relock. flips changes in a
+ * row that alternate in direction, each within windowMS of the previous
+ * one, are an oscillation between the fastest and the slowest state they
+ * touched. From then on a change from the fast end to anything up to the
+ * slow end is dropped. That lasts until holdMS pass without the governor
+ * asking to stay fast in between, so an idle spell still gets to slow
+ * down, or until it asks for a state outside the band, which means the
+ * load really moved. Works on whatever the governor decided, so it is the
+ * same for all of them.
+ */
+class OscillationDamper {
+public:
+	uint8_t		flips;		// 0 = off
+	uint32_t	windowMS;
+	uint32_t	holdMS;
+
+	void	setDefaults();
+	void	reset();
+
+	/* The state to go to instead of want, coming from from */
+	int	step(int from, int want, uint64_t nowNS);
+	bool	damping() const { return holding; }
+
+	uint64_t	oscillations;	// detected
+	uint64_t	damped;		// changes dropped
+
+private:
+	bool		lastUp;		// direction of the last change
+	uint8_t		run;		// changes in alternating directions so far
+	int8_t		bandFast, bandSlow;	// the states they went between
+	uint64_t	lastChangeNS;
+	bool		holding;
+	bool		busySinceDamped;	// the governor wanted to stay fast since the last drop
+	int8_t		fast, slow;
+	uint64_t	holdUntilNS;
+};
+
+/*
+ * Token bucket in front of throttleAllCPUs: every P-State change stalls all
+ * cores, so at most burst of them go through in a row and then ratePerS a
+ * second. Tokens are kept as time, 1/ratePerS s each, so refilling is just
+ * adding the time that passed.
+ */
+class TransitionLimiter {
+public:
+	uint16_t	ratePerS;	// 0 = unlimited
+	uint16_t	burst;
+
+	void	setDefaults();
+	/* Start with a full bucket */
+	void	reset();
+
+	/* Use up a token if there is one */
+	bool	take(uint64_t nowNS);
+	/* Time until take() would succeed, 0 = now */
+	uint64_t waitNS(uint64_t nowNS);
+
+private:
+	void	refill(uint64_t nowNS, uint64_t tokenNS);
+	static uint64_t	costNS(uint16_t rate) { return 1000000000ULL / rate; }
+
+	uint64_t	creditNS;
+	uint64_t	lastNS;
+};
+
+/*
+ * The auto-throttler. It doesn't know about IOKit, so the host replay tool
+ * runs exactly the code the kext does: AutoThrottler only collects the ticks and
+ * hands every perfTimer event to timerEvent().
+ *
+ * The decision itself is made by the active Governor (see Governors.h). All of
+ * them are members, so their tunables keep their values while another one is
+ * active. selectGovernor() only records the wish; the switch happens at the
+ * start of the next sample, on the workloop, so a governor never sees a sample
+ * half way through a switch.
+ */
+class ThrottleController {
+public:
+	uint16_t	targetCPULoad;	// percent x 10
+	uint32_t	quantumMS;	// base sampling interval
+	uint16_t	timeoutScale;	// x10, how much longer to wait per step above the slowest state
+	uint16_t	upThreshold;	// percent x 10, load must exceed target + this to step up
+	uint16_t	downThreshold;	// percent x 10, load must be under target - this to step down
+	uint32_t	minDwellMS;	// time to stay in a state before another switch (except to P0 at full load)
+	uint8_t		currentPState;
+	uint32_t	dwellMS;	// time spent in currentPState so far
+	uint32_t	lastTimeoutMS;	// length of the interval being measured
+	bool		skipCostly;	// keep the current state when a switch wouldn't pay for itself
+	uint8_t		loadSource;	// loadFromTicks, loadFromRunQueue or loadFromAPERF
+	uint16_t	memBoundIPC;	// IPC x 1000 under which a busy CPU counts as memory bound, 0 = off
+	uint8_t		memBoundLoss;	// percent of P0's instruction rate the cap may cost
+	uint8_t		boostPState;	// PStates[] index input activity raises to at least
+	uint32_t	boostHoldMS;	// how long it holds there, 0 = off
+
+	ProportionalGovernor	proportional;
+	PIDGovernor		pid;
+	OndemandGovernor	ondemand;
+	ConservativeGovernor	conservative;
+	MarkovGovernor		markov;
+	EnergyGovernor		energy;
+	RaceGovernor		race;
+
+	/*
+	 * Statistics. stateChanges counts the PState switches this controller asked for.
+	 * While another governor runs, the proportional one is shadowed on the same load
+	 * (scaled to the speed it would be running at) and its switches are counted in
+	 * defaultChanges, so transitionsAvoided() tells what the governor saved.
+	 */
+	uint64_t	stateChanges;
+	uint64_t	defaultChanges;
+	int64_t		transitionsAvoided() const { return (int64_t) defaultChanges - (int64_t) shadowedChanges; }
+	uint64_t	skippedChanges;	// switches the governor wanted that cost more than they'd gain
+	CPULoadTracker	ticks;
+	RunQueueTracker	runQueue;	// kept up to date by the caller while loadSource is loadFromRunQueue
+	IPCTracker	ipc;		// kept up to date by the caller while memBoundIPC is set
+	C0Tracker	c0;		// kept up to date by the caller where the CPU has APERF/MPERF
+	LoadAggregator	loads;		// per CPU averages, updated by sample()
+	TargetTuner	tuner;		// sets targetCPULoad while enabled, keeps what it learned over reset()
+	uint64_t	memBoundSamples;	// samples where the memory bound cap held the speed down
+	uint64_t	boosts;		// input events that raised the speed
+	PStateSchedule	schedule;	// uploaded P-States, run by scheduleEvent()
+	QoSRequests	qos;		// client floors and ceilings, kept over reset()
+	OscillationDamper	damper;	// holds the faster state when the governor flip-flops
+	uint64_t	qosClamped;	// samples where they overrode the governor
+	TransitionLimiter	limiter;	// caps P-State changes per second
+	IOTimerEventSource*	limiterTimer;	// set by the caller, runs limiterEvent(); 0 = retry at the next sample
+	uint64_t	deferredChanges;	// changes that had to wait for a token
+	uint64_t	coalescedChanges;	// of those, replaced by a newer one before they went through
+	ThermalCap	thermal;	// kept up to date by the caller where the CPU has a DTS
+	ThermalBudget	thermalBudget;	// fitted to thermal and the _PSS power, replaces its soft cap once valid
+	uint64_t	thermalCapped;	// throttles either held below the speed asked for
+
+	/*
+	 * Input activity: go to boostPState right away if slower (as soon as the
+	 * limiter lets it, like any change), and keep at least
+	 * that speed for boostHoldMS. The perfTimer keeps its schedule; samples
+	 * during the hold are clamped, the first one after it is the governor's
+	 * again. Another event during the hold extends it. Returns whether the
+	 * speed changed.
+	 */
+	bool	boost();
+	bool	boosting() const;
+
+	/*
+	 * After qos changed: move into its limits now instead of at the next
+	 * sample, and hold a change still waiting for a token to them as well.
+	 * Returns whether the speed changed.
+	 */
+	bool	applyLimits();
+
+	/* Fill in the defaults for everything tunable */
+	void	setDefaults();
+
+	/* Start from the slowest state with a fresh tick history */
+	void	reset();
+
+	/* The registered governors by index, 0 past the end */
+	Governor*	governor(int index);
+	int		findGovernor(const char* name);	// -1 if there's none by that name
+	Governor*	activeGovernor()	{ return governor(active); }
+	/* Name of the governor that is (or is about to be) active */
+	const char*	governorName();
+
+	/* Make a governor active from the next sample on */
+	bool	selectGovernor(const char* name);
+	bool	selectGovernor(int index);
+
+	/*
+	 * Delay until the next sample after picking the given PState:
+	 * quantumMS * (1 + timeoutScale/10 * steps above the slowest state).
+	 * The default scale of 10 gives the original quantum * (NumberOfPStates - pstate).
+	 */
+	uint32_t timeoutFor(int pstate) const;
+
+	/*
+	 * Whether going from one PState to another pays off over the next interval:
+	 * what it gains has to be at least transitionLatency(from, to). Going
+	 * faster gains the busy time it saves at this load. Going slower saves
+	 * power over the whole interval, busy or idle; that counts as the share of
+	 * the interval the clock drops by, so an idle CPU still comes down.
+	 */
+	bool	worthSwitching(int from, int to, long used, uint32_t timeoutMS) const;
+
+	/*
+	 * Whether the last interval was memory bound: busy for at least a quarter of
+	 * it, at an IPC under memBoundIPC. Going faster would mostly add stall cycles.
+	 */
+	bool	memoryBound() const;
+
+	/*
+	 * The slowest PState expected to keep all but memBoundLoss % of the
+	 * instruction rate P0 would give. CPI is taken as 1 plus a memory stall
+	 * that costs the same time at every speed, so stall cycles grow with the
+	 * clock; the measured IPC tells how big the stall is.
+	 */
+	int	memoryBoundCap() const;
+
+	/*
+	 * Asks the active governor for the PState for the next interval and the delay
+	 * until the next sample. The load is every CPU's share of the ticks, or of
+	 * C0 with loadFromAPERF once c0 is valid(), reduced by loads.reduction;
+	 * the governor also gets the reduced averages. Without per-CPU ticks
+	 * idle/total count as the only CPU. While memoryBound(), nothing faster
+	 * than memoryBoundCap() is picked. With skipCostly, a switch that isn't
+	 * worthSwitching() is dropped, except to P0 at full load. Then the damper
+	 * may hold the faster state of an oscillation, unless the governor flips
+	 * on purpose (Governor::damped()). Never slower than
+	 * boostPState while boosting(), and always within the qos limits.
+	 */
+	int	sample(long idle, long total, uint32_t* timeoutMS);
+
+	/*
+	 * One perfTimer event: account, pick, throttle and re-arm the timer.
+	 * While the schedule runs it only accounts and re-arms; it also lets
+	 * expired qos holders go.
+	 */
+	void	timerEvent(long idle, long total, IOTimerEventSource* timer);
+
+	/*
+	 * Run the schedule from now on, on its own timer. The governor, the
+	 * boost and the qos limits stand aside until it is done or stopped, then the governor
+	 * carries on from wherever the schedule left the CPU.
+	 */
+	void	startSchedule(IOTimerEventSource* timer);
+	void	stopSchedule(IOTimerEventSource* timer);
+	/* The schedule timer fired: throttle to what is due, arm for the next entry */
+	void	scheduleEvent(IOTimerEventSource* timer);
+
+	/*
+	 * The limiter has a token again: make the change that was left waiting,
+	 * if any, clamped to the boost and the qos limits as they are now
+	 */
+	void	limiterEvent();
+	/* Drop the change waiting for a token, if any, and stop limiterTimer */
+	void	cancelPending();
+	/* The CPU was throttled behind its back: the next moveTo() throttles even to currentPState */
+	void	throttledElsewhere()	{ appliedCtl = 0; }
+
+	/*
+	 * The fastest PStates[] index anything may go to: thermalBudget.cap()
+	 * while it is active, short of thermal's hard margin and PROCHOT;
+	 * thermal.cap() otherwise. Manual settings are held to it as well.
+	 */
+	int	thermalCeiling() const;
+
+private:
+	/*
+	 * Every throttle goes through here. Nothing is faster than thermalCeiling(),
+	 * whoever asks. A governed change, one made in place
+	 * of the governor's, needs a token from the limiter; without one only the
+	 * latest target is kept, and limiterTimer is armed for when the next
+	 * token comes in. The schedule's were uploaded with their timing and go
+	 * straight through. Staying in currentPState clears a waiting change
+	 * and skips the rendezvous. Returns whether the speed changed.
+	 */
+	bool	moveTo(int pstate, bool governed);
+
+	/*
+	 * Feeds thermalBudget the interval that ended: the per-CPU load at
+	 * currentPState, costed from PStates[].Power and energy.idlePower, and
+	 * the same demand at every other state.
+	 */
+	void	updateThermalBudget(const long* load, int cpus);
+
+	void	switchGovernor();
+	void	shadowDefault(long used, uint32_t timeoutMS);
+	void	restartShadow();
+
+	uint8_t		active;
+	volatile int8_t	requested;	// -1 or the governor to switch to
+	uint64_t	shadowedChanges;	// stateChanges while the shadow ran
+	uint8_t		shadowPState;
+	uint32_t	shadowDwellMS;
+	uint64_t	boostUntil;	// uptime ns
+	int8_t		pendingPState;	// -1 or the change waiting for a token
+	uint16_t	appliedCtl;	// last given to throttleAllCPUs, 0 = none since reset()
+};
+
+#endif // _THROTTLECONTROLLER_H
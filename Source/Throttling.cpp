@@ -0,0 +1,241 @@
+#include "Throttling.h"
+#include "Utility.h"
+
+/*
+ * Certain (pseudo)global variables
+ */
+IESS_TLS PState		PStates[16];		// 16 states max
+IESS_TLS unsigned int NumberOfPStates;	// How many this processor supports
+IESS_TLS IOSimpleLock*	Lock;			// lock to use while throttling
+IESS_TLS bool		InterruptsEnabled;	// to save state of interrupts before throttling
+IESS_TLS bool		Is45nmPenryn;		// so that we can use proper VID -> mV calculation
+IESS_TLS bool		RtcFixKernel;		// to indicate if this kernel has rtc fix
+IESS_TLS bool		ConstantTSC;		// whether processor supports constant tsc
+IESS_TLS bool		Nby2Ratio;		// Whether cpu supports N/2 fsb ratio
+IESS_TLS bool		DebugOn;		// whether to print debug messages
+IESS_TLS uint64_t	FSB;			// as reported by EFI
+IESS_TLS uint32_t	MaxLatency;		// how long to wait after switching pstate
+IESS_TLS uint64_t	totalThrottles;
+IESS_TLS uint64_t	totalTimerEvents;
+IESS_TLS uint32_t	TransitionLatency[16][16];
+static IESS_TLS uint64_t savedFixedCtrl[max_cpus];	// per CPU, from enableFixedCounters() for disableFixedCounters()
+static IESS_TLS uint64_t savedGlobalCtrl[max_cpus];
+
+#ifndef IESS_HOST
+static KernelMSR kernelMSR;
+MSRBackend*	MSR = &kernelMSR;
+#endif
+
+int FindClosestPState(int wantedFreq) {
+	// assume P0 is best
+	int bestpstate = 0;
+	int bestdiff   = abs(PStates[0].AcpiFreq - wantedFreq);
+
+	// now iterate over others and find the best
+	for (int i = 1; i < NumberOfPStates; i++) {
+		if (abs(PStates[i].AcpiFreq - wantedFreq) < bestdiff) {
+			bestpstate = i;
+			bestdiff = abs(PStates[i].AcpiFreq - wantedFreq);
+		}
+	}
+
+	return bestpstate;
+}
+
+void checkForNby2Ratio() {
+	uint64_t sts;
+	sts = MSR->read(INTEL_MSR_PERF_STS);
+	Nby2Ratio = (sts & (1ULL << 46)); // bit 46 is set
+}
+
+uint16_t getCurrentVoltage() {
+	// Apple recommends not to return cached value, but to read it from the processor
+	uint64_t msr = MSR->read(INTEL_MSR_PERF_STS);
+	return VID_to_mV(VID(msr));
+}
+
+uint16_t getCurrentFrequency() {
+	uint64_t msr = MSR->read(INTEL_MSR_PERF_STS);
+	return FID_to_MHz(FID(msr));
+}
+
+uint16_t VID_to_mV(uint8_t VID) {
+	if (Is45nmPenryn)
+		return (((int)VID * 125) + 7125) / 10; // to avoid using float
+	else
+		return (((int)VID * 16) + 700);
+}
+
+uint8_t mV_to_VID(uint16_t mv) {
+	if (Is45nmPenryn)
+		return ((mv * 10) - 7125) / 125;
+	else
+		return (mv - 700) / 16;
+}
+
+uint16_t FID_to_MHz(uint8_t x) {
+	bool nby2 = x & 0x80;
+	uint8_t realfid = x & 0x7f; // removes the bit from 0x80
+	if (nby2)
+		realfid /= 2;
+	return realfid * (FSB / 1000000ULL);
+}
+
+static inline uint32_t FID_to_Hz(uint8_t x) {
+	bool nby2 = x & 0x80;
+	uint8_t realfid = x & 0x7f;
+	if (nby2)
+		realfid /= 2;
+	return realfid * FSB;
+}
+
+uint8_t MHz_to_FID(uint16_t x) {
+	uint8_t realfid = x / (FSB / 1000000ULL);
+	if (Nby2Ratio && x < 1000) // FIXME: use n/2 for only <1ghz frequencies?
+		realfid = (realfid*2) | 0x80;
+	return realfid;
+}
+
+/**************************************************************************************************/
+/* Throttling functions */
+
+void throttleAllCPUs(PState* p) {
+	dbg("Starting throttle with CTL 0x%x\n", CTL(p->Frequency, p->Voltage));
+	IOSimpleLockLock(Lock);
+
+	mp_rendezvous(disableInterrupts, throttleCPU, enableInterrupts, p);
+	IODelay(p->Latency); // maybe wait longer?
+
+	totalThrottles++;
+
+	IOSimpleLockUnlock(Lock);
+	dbg("Throttle done.\n");
+}
+
+#define calibrationPollLimit	500	// usec to wait for PERF_STS before falling back to the table for a pair
+
+/*
+ * Rendezvous to p and poll PERF_STS every usec until it shows the FID, returns how long that took
+ * in usec, 0 if it didn't within calibrationPollLimit. The IODelay throttleAllCPUs adds is the
+ * table's guess at this, so it is left out; the lock is only held for the rendezvous.
+ */
+static uint32_t timeTransition(PState* p) {
+	uint64_t start, now, ns;
+	int polls = 0;
+	IOSimpleLockLock(Lock);
+	clock_get_uptime(&start);
+	mp_rendezvous(disableInterrupts, throttleCPU, enableInterrupts, p);
+	IOSimpleLockUnlock(Lock);
+	while (FID(MSR->read(INTEL_MSR_PERF_STS)) != p->Frequency) {
+		if (polls++ == calibrationPollLimit) return 0;
+		IODelay(1);
+	}
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - start, &ns);
+	return (uint32_t) ((ns + 999) / 1000);
+}
+
+void calibrateTransitions() {
+	int current = FindClosestPState(FID_to_MHz(FID(MSR->read(INTEL_MSR_PERF_STS))));
+	uint64_t throttles = totalThrottles;
+	for (int from = 0; from < NumberOfPStates; from++) {
+		for (int to = 0; to < NumberOfPStates; to++) {
+			if (from == to) {
+				TransitionLatency[from][to] = 0;	// staying put costs nothing
+				continue;
+			}
+			throttleAllCPUs(&PStates[from]);
+			TransitionLatency[from][to] = timeTransition(&PStates[to]);
+			dbg("P-State %d -> %d: %d usec\n", from, to, TransitionLatency[from][to]);
+		}
+	}
+	throttleAllCPUs(&PStates[current]);
+	totalThrottles = throttles; // none of these were asked for
+}
+
+uint32_t transitionLatency(int from, int to) {
+	if (from == to) return 0;
+	return TransitionLatency[from][to] ? TransitionLatency[from][to] : PStates[to].Latency;
+}
+
+void throttleCPU(void *t) {
+	uint64_t msr;
+	PState p;
+	uint32_t newfreq, oldfreq;
+
+	bcopy(t,&p,sizeof(PState)); // get the ctl we want
+
+	msr = MSR->read(INTEL_MSR_PERF_STS); // read current MSR
+
+	// For clock recalibration
+	oldfreq = FID_to_Hz(FID(msr));
+	// blank out last 32 bits and put our ctl there
+	msr = (msr & 0xffffffffffff0000ULL) | CTL(p.Frequency, mV_to_VID(1000));
+	newfreq = FID_to_Hz(FID(msr)); // after setting ctl in msr
+
+	if (RtcFixKernel && !ConstantTSC) {
+		rtc_clock_stepping(newfreq, oldfreq);
+	}
+
+	MSR->write(INTEL_MSR_PERF_CTL, msr); // and write it to the processor
+
+	if (RtcFixKernel && !ConstantTSC)
+		rtc_clock_stepped(newfreq, oldfreq);
+}
+
+void enableFixedCounters(__unused void *t) {
+	int cpu = cpu_number();
+	uint64_t ctrl = MSR->read(INTEL_MSR_FIXED_CTR_CTRL), global = MSR->read(INTEL_MSR_PERF_GLOBAL_CTRL);
+	if (cpu < max_cpus) {
+		savedFixedCtrl[cpu] = ctrl;
+		savedGlobalCtrl[cpu] = global;
+	}
+	MSR->write(INTEL_MSR_FIXED_CTR_CTRL, (ctrl & ~0xffULL) | 0x33); // counters 0 and 1, OS and USR, no PMI
+	MSR->write(INTEL_MSR_PERF_GLOBAL_CTRL, global | (3ULL << 32));
+}
+
+/* Puts back what enableFixedCounters() found, so a profiler that had them on keeps them */
+void disableFixedCounters(__unused void *t) {
+	int cpu = cpu_number();
+	uint64_t ctrl = cpu < max_cpus ? savedFixedCtrl[cpu] : 0, global = cpu < max_cpus ? savedGlobalCtrl[cpu] : 0;
+	MSR->write(INTEL_MSR_PERF_GLOBAL_CTRL, (MSR->read(INTEL_MSR_PERF_GLOBAL_CTRL) & ~(3ULL << 32)) | (global & (3ULL << 32)));
+	MSR->write(INTEL_MSR_FIXED_CTR_CTRL, (MSR->read(INTEL_MSR_FIXED_CTR_CTRL) & ~0xffULL) | (ctrl & 0xffULL));
+}
+
+void readFixedCounters(void *t) {
+	int cpu = cpu_number();
+	if (cpu >= max_cpus) return;
+	FixedCounters* counters = (FixedCounters*) t;
+	counters[cpu].instructions	= MSR->read(INTEL_MSR_FIXED_CTR0);
+	counters[cpu].cycles		= MSR->read(INTEL_MSR_FIXED_CTR1);
+}
+
+void readClockCounters(void *t) {
+	int cpu = cpu_number();
+	if (cpu >= max_cpus) return;
+	ClockCounters* counters = (ClockCounters*) t;
+	counters[cpu].tsc	= MSR->read(INTEL_MSR_TSC);
+	counters[cpu].mperf	= MSR->read(INTEL_MSR_MPERF);
+	counters[cpu].aperf	= MSR->read(INTEL_MSR_APERF);
+}
+
+void readThermalStatus(void *t) {
+	int cpu = cpu_number();
+	if (cpu >= max_cpus) return;
+	((uint64_t*) t)[cpu] = MSR->read(INTEL_MSR_THERM_STATUS);
+}
+
+void readCounters(void *t) {
+	CounterReads* reads = (CounterReads*) t;
+	if (reads->clocks)	readClockCounters(reads->clocks);
+	if (reads->fixed)	readFixedCounters(reads->fixed);
+	if (reads->thermal)	readThermalStatus(reads->thermal);
+}
+
+void disableInterrupts(__unused void *t) {
+	InterruptsEnabled = ml_set_interrupts_enabled(false);
+}
+
+void enableInterrupts(__unused void *t) {
+	ml_set_interrupts_enabled(InterruptsEnabled);
+}
@@ -0,0 +1,187 @@
+#ifndef _THROTTLING_H
+#define _THROTTLING_H
+
+/*
+ * P-State table and the actual throttling code. Nothing in here depends on
+ * IOKit classes, so it is also compiled into the host-side tools (hostbuild.sh)
+ * where HostKernel.h stands in for the kernel functions we use.
+ */
+#ifdef IESS_HOST
+#include "HostKernel.h"
+#else
+extern "C" {
+#include <machine/machine_routines.h>
+}
+#include <IOKit/IOLib.h>
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
+#include <i386/proc_reg.h>
+#include <sys/types.h>
+
+/*
+ * Rendezvous
+ */
+extern "C" void mp_rendezvous(	void (*setup_func) (void *),
+			void (*action_func) (void *),
+			void (*teardown_func) (void *),
+			void *arg);
+
+/*
+ * For timer fix
+ */
+__BEGIN_DECLS
+/* The next 2 functions are used for clock recalibration on non-constant tsc */
+extern void rtc_clock_stepping(uint32_t new_frequency, uint32_t old_frequency);
+extern void rtc_clock_stepped (uint32_t new_frequency, uint32_t old_frequency);
+__END_DECLS
+
+#define IESS_TLS	// per-thread only in the host simulators
+#endif
+
+#include "MSRAccess.h"
+
+#define max_cpus 32
+
+/*
+ * This class holds information about each throttle state
+ */
+class PState {
+public:
+	uint16_t Frequency;		// processor clock speed (FID, not MHz)
+	uint16_t AcpiFreq;		// as reported by ACPI (nice rounded) for display purposes
+	uint16_t Voltage;		// wanted voltage ID while on AC
+	uint16_t OriginalVoltage;	// The factory default voltage ID for this frequency
+	uint32_t Latency;		// how long to wait after writing to msr
+	uint32_t Power;			// mW while busy, from _PSS (0 = unknown)
+	uint64_t TimesChosen;		// how many times this Pstate was chosen to switch to
+};
+
+/*
+ * The following is used with mp_rendezvous to throttle all CPUs
+ */
+void disableInterrupts	(__unused void* t);
+void enableInterrupts	(__unused void* t);
+void throttleCPU	(void* fidvid);
+
+/*
+ * Fixed counter values of one CPU
+ */
+struct FixedCounters {
+	uint64_t	instructions;	// fixed counter 0
+	uint64_t	cycles;		// fixed counter 1, unhalted core cycles
+};
+
+/*
+ * Also for mp_rendezvous: switch fixed counters 0 and 1 on for ring 0 and 3
+ * on every CPU (disabling puts back the control bits they had before), and
+ * read them into ((FixedCounters*) arg)[cpu_number()].
+ * The array needs max_cpus entries.
+ */
+void enableFixedCounters	(__unused void* t);
+void disableFixedCounters	(__unused void* t);
+void readFixedCounters		(void* counters);
+
+/*
+ * TSC, MPERF and APERF of one CPU, read together
+ */
+struct ClockCounters {
+	uint64_t	tsc;
+	uint64_t	mperf;
+	uint64_t	aperf;
+};
+
+/* For mp_rendezvous: read them into ((ClockCounters*) arg)[cpu_number()], max_cpus entries */
+void readClockCounters		(void* counters);
+
+/* For mp_rendezvous: IA32_THERM_STATUS into ((uint64_t*) arg)[cpu_number()], max_cpus entries */
+void readThermalStatus		(void* status);
+
+/*
+ * What a sample needs from every CPU, so it takes one rendezvous instead of
+ * one per kind; arrays left 0 aren't read
+ */
+struct CounterReads {
+	ClockCounters*	clocks;
+	FixedCounters*	fixed;
+	uint64_t*	thermal;
+};
+
+/* For mp_rendezvous: the reads above with ((CounterReads*) arg)'s arrays */
+void readCounters		(void* reads);
+
+/*
+ * The main throttling function. This sets up mp_rendezvous and provides
+ * the proper fid/vid for the given P-State.
+ */
+void throttleAllCPUs(PState* p);
+
+/*
+ * Measures the real cost of every from -> to pair in PStates[]: the time from
+ * the rendezvous until PERF_STS shows the new FID, in usec, into
+ * TransitionLatency; the diagonal stays 0, and so does a pair that took
+ * longer than calibrationPollLimit. Leaves the CPU in the state it was found
+ * in, and totalThrottles as it was.
+ */
+void calibrateTransitions();
+
+/*
+ * Cost of switching between two PStates in usec: the calibrated figure, or
+ * what the table says if there is none; 0 from a state to itself
+ */
+uint32_t transitionLatency(int from, int to);
+
+/*
+ * Gets the current core voltage. Only current processor is read
+ */
+uint16_t getCurrentVoltage();
+
+/*
+ * Returns the current operating frequency in MHz
+ */
+uint16_t getCurrentFrequency();
+
+/*
+ * Check whether CPU supports N/2 fsb ratios
+ */
+void checkForNby2Ratio();
+
+/*
+ * Convert VID to mV
+ */
+uint16_t VID_to_mV(uint8_t VID);
+
+/*
+ * Convert mV to VID
+ */
+uint8_t mV_to_VID(uint16_t mv);
+
+/*
+ * FID to Mhz and vice versa
+ */
+uint8_t  MHz_to_FID(uint16_t mhz);
+uint16_t FID_to_MHz(uint8_t fid);
+
+/*
+ * Index of the PState whose frequency is closest to the given MHz
+ */
+int	FindClosestPState(int wantedFreq);
+
+/*
+ * Globals shared by the driver and the throttling code
+ */
+extern IESS_TLS PState		PStates[16];		// 16 states max
+extern IESS_TLS unsigned int NumberOfPStates;	// How many this processor supports
+extern IESS_TLS IOSimpleLock*	Lock;			// lock to use while throttling
+extern IESS_TLS bool		InterruptsEnabled;	// to save state of interrupts before throttling
+extern IESS_TLS bool		Is45nmPenryn;		// so that we can use proper VID -> mV calculation
+extern IESS_TLS bool		RtcFixKernel;		// to indicate if this kernel has rtc fix
+extern IESS_TLS bool		ConstantTSC;		// whether processor supports constant tsc
+extern IESS_TLS bool		Nby2Ratio;		// Whether cpu supports N/2 fsb ratio
+extern IESS_TLS bool		DebugOn;		// whether to print debug messages
+extern IESS_TLS uint64_t		FSB;			// as reported by EFI
+extern IESS_TLS uint32_t		MaxLatency;		// how long to wait after switching pstate
+extern IESS_TLS uint64_t		totalThrottles;		// for kern.cputhrottle_totalthrottles
+extern IESS_TLS uint64_t		totalTimerEvents;	// auto-throttle samples taken
+extern IESS_TLS uint32_t		TransitionLatency[16][16];	// usec, from calibrateTransitions(), 0 = not measured
+
+#endif // _THROTTLING_H
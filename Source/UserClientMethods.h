@@ -0,0 +1,20 @@
+#ifndef _USERCLIENTMETHODS_H
+#define _USERCLIENTMETHODS_H
+
+/*
+ * What a client can call on the driver's user client, through
+ * IOConnectMethodScalarIScalarO() on a connection from IOServiceOpen().
+ * Everything a connection holds is released when it is closed or its task
+ * dies.
+ *
+ * kIESSQoSAdd		in: floor, ceiling (PStates[] index, -1 = none), timeout ms (0 = none)
+ *			out: handle. Needs an administrator.
+ * kIESSQoSRelease	in: handle
+ */
+enum {
+	kIESSQoSAdd,
+	kIESSQoSRelease,
+	kIESSNumberOfMethods
+};
+
+#endif // _USERCLIENTMETHODS_H
@@ -13,6 +13,25 @@
 #define INTEL_MSR_PERF_CTL	0x199
 #define INTEL_MSR_PERF_STS	0x198
 
+/* Time stamp counter and the C0 clock counters, CPUID.06H:ECX[0] */
+#define INTEL_MSR_TSC		0x10
+#define INTEL_MSR_MPERF		0xe7	// counts at the TSC rate while in C0
+#define INTEL_MSR_APERF		0xe8	// counts at the actual clock while in C0
+
+/* Digital thermal sensor, CPUID.06H:EAX[0] */
+#define INTEL_MSR_THERM_STATUS	0x19c
+#define THERM_STATUS_PROCHOT	(1ULL << 0)	// thermal throttling (TM1/TM2) active now
+#define THERM_STATUS_LOG	(1ULL << 1)	// sticky, has been active since cleared
+#define THERM_STATUS_READOUT(x)	(((x) >> 16) & 0x7f)	// degrees C below TjMax
+#define THERM_STATUS_VALID	(1ULL << 31)
+
+/* Architectural performance monitoring, version 2 */
+#define INTEL_MSR_FIXED_CTR0		0x309	// INST_RETIRED.ANY
+#define INTEL_MSR_FIXED_CTR1		0x30a	// CPU_CLK_UNHALTED.CORE
+#define INTEL_MSR_FIXED_CTR_CTRL	0x38d
+#define INTEL_MSR_PERF_GLOBAL_CTRL	0x38f
+#define FIXED_CTR_MASK			0xffffffffffULL	// 40 bits wide on Core 2
+
 #define CTL(fid, vid)	(((fid) << 8) | (vid))
 #define FID(ctl)		(((ctl) & 0xff00) >> 8)
 #define VID(ctl)		((ctl) & 0x00ff)
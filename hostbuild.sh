@@ -0,0 +1,34 @@
+#!/bin/sh
+# Builds the host-side tools in Host/ (simulated CPU, no kext) into Host/build
+CXX=${CXX:-c++}
+CXXFLAGS="${CXXFLAGS:--O2 -g -Wall -Wno-sign-compare} -std=c++11 -DIESS_HOST -IHost -ISource"
+COMMON="Host/HostKernel.cpp Host/HostSetup.cpp Host/SimulatedCPU.cpp Host/Trace.cpp Host/Replay.cpp
+        Source/Throttling.cpp Source/ThrottleController.cpp Source/PIDController.cpp
+        Source/Governors.cpp Source/TargetTuner.cpp Source/PStateSchedule.cpp
+        Source/QoSRequests.cpp Source/Thermal.cpp"
+
+cd "$(dirname "$0")" || exit 1
+mkdir -p Host/build
+
+# buildfrom <tool> <main source> [extra sources/flags]
+buildfrom() {
+  tool=$1; main=$2; shift 2
+  echo "Building $tool"
+  $CXX $CXXFLAGS "$@" -o Host/build/$tool $main $COMMON -lpthread || exit 1
+}
+
+build() {
+  tool=$1; shift
+  buildfrom $tool Host/$tool.cpp "$@"
+}
+
+build msrbench
+# Host/Replay.cpp is the library part; a replay.cpp next to it clashes on case-insensitive file systems
+buildfrom replay Host/replaytool.cpp
+build sweep -DIESS_HOST_TLS Host/WorkPool.cpp
+build rvbench Host/Rendezvous.cpp Host/WorkPool.cpp
+build govstep
+build loadagg
+build schedrun
+build qosreq
+build thermfit